@@ -3,6 +3,9 @@
 #include <gtest/gtest.h>
 #include <jni.h>
 
+#include <atomic>
+#include <thread>
+
 #include <fakelinker/elf_reader.h>
 #include <fakelinker/fake_linker.h>
 #include "../linker/linker_globals.h"
@@ -406,6 +409,46 @@ TEST(FakeLinker, relocateTest) {
   ASSERT_TRUE(message_addr) << "find import android_set_abort_message";
   EXPECT_EQ(*message_addr, &android_set_abort_message) << "call_manual_relocation_by_soinfo verify";
 
+  // the journal of the previous relocation is used to toggle the symbol without scanning again
+  EXPECT_TRUE(g_fakelinker_export.update_manual_relocation_symbol(log_soinfo, "android_set_abort_message", nullptr))
+    << "update_manual_relocation_symbol restore";
+  EXPECT_NE(*message_addr, &android_set_abort_message) << "update_manual_relocation_symbol restore verify";
+  EXPECT_TRUE(g_fakelinker_export.update_manual_relocation_symbol(log_soinfo, "android_set_abort_message",
+                                                                  reinterpret_cast<void *>(&android_set_abort_message)))
+    << "update_manual_relocation_symbol";
+  EXPECT_EQ(*message_addr, &android_set_abort_message) << "update_manual_relocation_symbol verify";
+  EXPECT_TRUE(g_fakelinker_export.call_manual_unrelocation(log_soinfo)) << "call_manual_unrelocation";
+  EXPECT_NE(*message_addr, &android_set_abort_message) << "call_manual_unrelocation verify";
+  EXPECT_TRUE(g_fakelinker_export.call_manual_relocation_by_soinfo(thiz, log_soinfo))
+    << "call_manual_relocation_by_soinfo again";
+  EXPECT_EQ(*message_addr, &android_set_abort_message) << "call_manual_relocation_by_soinfo again verify";
+  RelocationStats last{}, total{};
+  EXPECT_EQ(g_fakelinker_export.get_relocation_stats(log_soinfo, &last, &total), FakeLinkerError::kErrorNo)
+    << "get_relocation_stats";
+  EXPECT_GT(last.patched_slots, 0) << "get_relocation_stats patched slots";
+  EXPECT_GE(total.relink_count, last.relink_count) << "get_relocation_stats cumulative";
+
+  // plan without touching memory, then apply the verified writes
+  EXPECT_TRUE(g_fakelinker_export.update_manual_relocation_symbol(log_soinfo, "android_set_abort_message", nullptr))
+    << "update_manual_relocation_symbol restore before plan";
+  size_t plan_size = 0;
+  void *plan = g_fakelinker_export.plan_manual_relocation(thiz, log_soinfo, &plan_size);
+  ASSERT_TRUE(plan) << "plan_manual_relocation";
+  EXPECT_NE(*message_addr, &android_set_abort_message) << "plan_manual_relocation does not write";
+  // A slot that changed after planning rejects the whole plan
+  EXPECT_TRUE(g_fakelinker_export.update_manual_relocation_symbol(log_soinfo, "android_set_abort_message",
+                                                                  reinterpret_cast<void *>(&gettimeofday)))
+    << "update_manual_relocation_symbol after plan";
+  EXPECT_FALSE(g_fakelinker_export.apply_manual_relocation_plan(thiz, log_soinfo, plan, plan_size))
+    << "apply_manual_relocation_plan changed slot";
+  EXPECT_EQ(*message_addr, reinterpret_cast<void *>(&gettimeofday)) << "rejected plan does not write";
+  EXPECT_TRUE(g_fakelinker_export.update_manual_relocation_symbol(log_soinfo, "android_set_abort_message", nullptr))
+    << "update_manual_relocation_symbol restore after plan";
+  EXPECT_TRUE(g_fakelinker_export.apply_manual_relocation_plan(thiz, log_soinfo, plan, plan_size))
+    << "apply_manual_relocation_plan";
+  EXPECT_EQ(*message_addr, &android_set_abort_message) << "apply_manual_relocation_plan verify";
+  g_fakelinker_export.free_inside_memory(plan);
+
   const char *test_library = nullptr;
   const char *test_function = "gettimeofday";
 
@@ -539,6 +582,152 @@ TEST(FakeLinker, relocateTest) {
   }
 }
 
+TEST(FakeLinker, autoRelocationTest) {
+  auto thiz = g_fakelinker_export.soinfo_find(SoinfoFindType::kSTAddress, nullptr, nullptr);
+  ASSERT_TRUE(thiz) << "soinfo find";
+  // Otherwise the system linker already binds the test function to this library
+  g_fakelinker_export.soinfo_remove_global(thiz);
+  const char *test_function = "gettimeofday";
+  std::vector<const char *> test_librarys = {"libssl.so",      "libpcap.so", "libext2_uuid.so",
+                                             "libcups.so",     "libcurl.so", "libpac.so",
+                                             "libloc_stub.so", "libavlm.so", "libbcinfo.so"};
+  void *caller_address = nullptr;
+  AndroidNamespacePtr log_np = nullptr;
+  if (android_api >= __ANDROID_API_N__) {
+    auto log_soinfo = g_fakelinker_export.soinfo_find(SoinfoFindType::kSTName, "liblog.so", nullptr);
+    log_np = g_fakelinker_export.android_namespace_find(NamespaceFindType::kNPSoinfo, log_soinfo, nullptr);
+    ASSERT_TRUE(log_np) << "find liblog.so namespace failed.";
+    caller_address = g_fakelinker_export.android_namespace_get_caller_address(log_np, nullptr);
+    ASSERT_TRUE(caller_address) << "get liblog.so namespace caller address failed";
+  }
+  auto find_test_soinfo = [&](const char *name) {
+    if (android_api >= __ANDROID_API_N__) {
+      return g_fakelinker_export.soinfo_find_in_namespace(SoinfoFindType::kSTName, name, log_np, nullptr);
+    }
+    return g_fakelinker_export.soinfo_find(SoinfoFindType::kSTName, name, nullptr);
+  };
+  const char *test_library = nullptr;
+  std::string library_dir = is64BitBuild() ? "/system/lib64/" : "/system/lib/";
+  for (auto name : test_librarys) {
+    if (access((library_dir + name).c_str(), F_OK) == 0 && !find_test_soinfo(name)) {
+      test_library = name;
+      break;
+    }
+  }
+  if (!test_library) {
+    GTEST_SKIP() << "The current device has no test library that is not loaded yet";
+  }
+
+  ASSERT_TRUE(g_fakelinker_export.set_auto_relocation(thiz)) << "set_auto_relocation";
+  void *handle = g_fakelinker_export.call_dlopen_inside(test_library, RTLD_NOW, caller_address, nullptr);
+  ASSERT_TRUE(handle) << "call_dlopen_inside " << test_library;
+  SoinfoPtr test_soinfo = find_test_soinfo(test_library);
+  ASSERT_TRUE(test_soinfo) << "find " << test_library << " soinfo failed";
+  SymbolAddress *import = g_fakelinker_export.soinfo_get_import_symbol_address(test_soinfo, test_function, nullptr);
+  ASSERT_TRUE(import) << "find " << test_library << " import symbol: " << test_function;
+  EXPECT_EQ(*import, reinterpret_cast<void *>(&gettimeofday)) << "relinked after call_dlopen_inside";
+  RelocationStats last{};
+  EXPECT_EQ(g_fakelinker_export.get_relocation_stats(test_soinfo, &last, nullptr), FakeLinkerError::kErrorNo);
+  EXPECT_GT(last.patched_slots, 0) << "auto relink stats";
+  ASSERT_EQ(dlclose(handle), 0) << "dlclose";
+
+  // Loaded again after it was unloaded, the exports are resolved for this load
+  handle = g_fakelinker_export.call_dlopen_inside(test_library, RTLD_NOW, caller_address, nullptr);
+  ASSERT_TRUE(handle) << "call_dlopen_inside again";
+  test_soinfo = find_test_soinfo(test_library);
+  ASSERT_TRUE(test_soinfo);
+  import = g_fakelinker_export.soinfo_get_import_symbol_address(test_soinfo, test_function, nullptr);
+  ASSERT_TRUE(import);
+  EXPECT_EQ(*import, reinterpret_cast<void *>(&gettimeofday)) << "relinked after loading again";
+  ASSERT_EQ(dlclose(handle), 0) << "dlclose";
+
+  if (android_api >= __ANDROID_API_O__) {
+    // Loaded by the libdl android_dlopen_ext as System.loadLibrary does, not by the FakeLinker dlopen
+    constexpr uint64_t kDlextUseNamespace = 0x200; // ANDROID_DLEXT_USE_NAMESPACE
+    auto android_dlopen_ext_fn =
+      reinterpret_cast<void *(*)(const char *, int, const void *)>(dlsym(RTLD_DEFAULT, "android_dlopen_ext"));
+    ASSERT_TRUE(android_dlopen_ext_fn) << "find android_dlopen_ext";
+    android_dlextinfoN extinfo{};
+    extinfo.flags = kDlextUseNamespace;
+    extinfo.library_namespace = static_cast<android_namespace_t *>(log_np);
+    handle = android_dlopen_ext_fn(test_library, RTLD_NOW, &extinfo);
+    ASSERT_TRUE(handle) << "android_dlopen_ext " << test_library << ": " << dlerror();
+    test_soinfo = find_test_soinfo(test_library);
+    ASSERT_TRUE(test_soinfo);
+    import = g_fakelinker_export.soinfo_get_import_symbol_address(test_soinfo, test_function, nullptr);
+    ASSERT_TRUE(import);
+    EXPECT_EQ(*import, reinterpret_cast<void *>(&gettimeofday)) << "relinked after the system dlopen";
+    ASSERT_EQ(dlclose(handle), 0) << "dlclose";
+  }
+
+  ASSERT_TRUE(g_fakelinker_export.set_auto_relocation(nullptr)) << "disable auto relocation";
+  handle = g_fakelinker_export.call_dlopen_inside(test_library, RTLD_NOW, caller_address, nullptr);
+  ASSERT_TRUE(handle);
+  test_soinfo = find_test_soinfo(test_library);
+  ASSERT_TRUE(test_soinfo);
+  import = g_fakelinker_export.soinfo_get_import_symbol_address(test_soinfo, test_function, nullptr);
+  ASSERT_TRUE(import);
+  EXPECT_NE(*import, reinterpret_cast<void *>(&gettimeofday)) << "auto relocation disabled";
+  ASSERT_EQ(dlclose(handle), 0) << "dlclose";
+}
+
+TEST(FakeLinker, relocationBlacklistTest) {
+  auto thiz =
+    reinterpret_cast<soinfo *>(g_fakelinker_export.soinfo_find(SoinfoFindType::kSTAddress, nullptr, nullptr));
+  ASSERT_TRUE(thiz) << "soinfo find";
+  ProxyLinker &linker = ProxyLinker::Get();
+  g_fakelinker_export.clear_relocation_blacklist();
+  EXPECT_FALSE(linker.GetRelocationBlacklist()) << "clear_relocation_blacklist";
+  symbol_relocations all = thiz->get_global_soinfo_export_symbols(false, nullptr, nullptr);
+  ASSERT_EQ(all.count("gettimeofday"), 1U) << "exported test function";
+  ASSERT_EQ(all.count("android_set_abort_message"), 1U) << "exported test function";
+
+  g_fakelinker_export.add_relocation_blacklist("gettimeofday");
+  g_fakelinker_export.add_relocation_blacklist("gettimeofday");
+  g_fakelinker_export.add_relocation_blacklist(nullptr);
+  auto first = linker.GetRelocationBlacklist();
+  ASSERT_TRUE(first);
+  EXPECT_EQ(first->names().size(), 1U) << "add_relocation_blacklist ignores duplicates";
+  g_fakelinker_export.add_relocation_blacklist("android_set_abort_message");
+  EXPECT_EQ(first->names().size(), 1U) << "a blacklist that was handed out does not change";
+
+  auto second = linker.GetRelocationBlacklist();
+  size_t skipped = 0;
+  symbol_relocations rels = thiz->get_global_soinfo_export_symbols(false, second.get(), &skipped);
+  EXPECT_EQ(skipped, 2U);
+  EXPECT_EQ(rels.size(), all.size() - 2);
+  EXPECT_EQ(rels.count("gettimeofday"), 0U) << "blacklisted";
+  EXPECT_EQ(rels.count("android_set_abort_message"), 0U) << "blacklisted";
+
+  g_fakelinker_export.remove_relocation_blacklist("gettimeofday");
+  g_fakelinker_export.remove_relocation_blacklist("not_blacklisted");
+  skipped = 0;
+  rels = thiz->get_global_soinfo_export_symbols(false, linker.GetRelocationBlacklist().get(), &skipped);
+  EXPECT_EQ(skipped, 1U);
+  EXPECT_EQ(rels.count("gettimeofday"), 1U) << "remove_relocation_blacklist";
+  EXPECT_EQ(rels.count("android_set_abort_message"), 0U);
+
+  // Enumerations keep the blacklist they started with while another thread changes it
+  std::atomic<bool> stop{false};
+  std::thread writer([&] {
+    while (!stop.load()) {
+      g_fakelinker_export.add_relocation_blacklist("gettimeofday");
+      g_fakelinker_export.remove_relocation_blacklist("gettimeofday");
+    }
+  });
+  for (int i = 0; i < 200; ++i) {
+    auto filters = linker.GetRelocationBlacklist();
+    skipped = 0;
+    rels = thiz->get_global_soinfo_export_symbols(false, filters.get(), &skipped);
+    ASSERT_EQ(rels.size() + skipped, all.size());
+    EXPECT_EQ(rels.count("gettimeofday"), filters->contains("gettimeofday") ? 0U : 1U);
+  }
+  stop.store(true);
+  writer.join();
+  g_fakelinker_export.clear_relocation_blacklist();
+  EXPECT_FALSE(linker.GetRelocationBlacklist());
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   print_soinfo_offset<soinfoL>();
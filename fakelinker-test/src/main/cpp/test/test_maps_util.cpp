@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <cinttypes>
+
+#include <fakelinker/alog.h>
+#include <fakelinker/maps_util.h>
+
+using namespace fakelinker;
+
+static uint64_t elapsed_us(const timespec &start) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) * 1000000ULL + now.tv_nsec / 1000 - start.tv_nsec / 1000;
+}
+
+TEST(MapsHelper, parseTest) {
+  MapsHelper libc;
+  ASSERT_TRUE(libc.GetLibraryProtect("libc.so")) << "get libc protect";
+  EXPECT_NE(libc.GetLibraryBaseAddress(), 0) << "libc base address";
+  EXPECT_EQ(libc.GetLibraryBaseAddress(), MapsHelper().FindLibraryBase("libc.so")) << "find libc base";
+  EXPECT_NE(libc.GetCurrentRealPath().find("/libc.so"), std::string::npos) << "libc real path";
+  // Segments of one library share a single interned path
+  for (auto &pp : libc) {
+    EXPECT_EQ(pp.path, libc.begin()->path) << "interned library path";
+  }
+
+  // Two pages with different protections are always listed as two lines
+  size_t page = getpagesize();
+  auto *mem = static_cast<uint8_t *>(mmap(nullptr, page * 2, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(mem, MAP_FAILED) << "mmap";
+  ASSERT_EQ(mprotect(mem + page, page, PROT_READ | PROT_WRITE), 0) << "mprotect";
+  // Changed outside of fake-linker, the shared snapshot has to be dropped
+  MapsHelper::Refresh();
+  MapsHelper util;
+  ASSERT_TRUE(util.GetMemoryProtect(mem, page * 2)) << "get memory protect";
+  ASSERT_EQ(util.end() - util.begin(), 2) << "memory protect pages";
+  EXPECT_EQ(util.begin()->start, reinterpret_cast<Address>(mem));
+  EXPECT_EQ(util.begin()->old_protect, kMPRead | kMPPrivate);
+  EXPECT_EQ((util.begin() + 1)->old_protect, kMPReadWrite | kMPPrivate);
+  EXPECT_EQ((util.begin() + 1)->inode, 0);
+  EXPECT_TRUE(util.CheckAddressPageProtect(reinterpret_cast<Address>(mem), page * 2, kMPRead)) << "check read";
+  EXPECT_FALSE(util.CheckAddressPageProtect(reinterpret_cast<Address>(mem), page * 2, kMPWrite)) << "check write";
+
+  // Pages unlocked by one helper are seen by the others until they are recovered
+  ASSERT_TRUE(util.UnlockPageProtect()) << "unlock page protect";
+  // The writable page already satisfies the request and is merged into the same call
+  EXPECT_EQ(util.MprotectCount(), 1) << "coalesced unlock";
+  MapsHelper inner;
+  ASSERT_TRUE(inner.GetMemoryProtect(mem, page)) << "get unlocked memory protect";
+  EXPECT_EQ(inner.begin()->old_protect, kMPReadWrite | kMPPrivate) << "unlocked protect";
+  EXPECT_TRUE(util.RecoveryPageProtect()) << "recovery page protect";
+  EXPECT_EQ(util.MprotectCount(), 2) << "only the changed page is restored";
+  MapsHelper after;
+  ASSERT_TRUE(after.GetMemoryProtect(mem, page)) << "get recovered memory protect";
+  EXPECT_EQ(after.begin()->old_protect, kMPRead | kMPPrivate) << "recovered protect";
+  munmap(mem, page * 2);
+  MapsHelper::Refresh();
+}
+
+// Benchmarks map tens of thousands of pages and only log their timings, they are kept out of the default run,
+// pass --gtest_also_run_disabled_tests to run them
+TEST(MapsHelper, DISABLED_benchmarkTest) {
+  // Alternating protections keep the kernel from merging the mappings, so each page is one maps line
+  size_t page = getpagesize();
+  for (size_t lines : {1000, 10000, 50000}) {
+    auto *mem = static_cast<uint8_t *>(mmap(nullptr, page * lines, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(mem, MAP_FAILED) << "mmap " << lines;
+    for (size_t i = 1; i < lines; i += 2) {
+      mprotect(mem + i * page, page, PROT_READ | PROT_WRITE);
+    }
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    constexpr int kRounds = 10;
+    for (int i = 0; i < kRounds; ++i) {
+      MapsHelper::Refresh();
+      MapsHelper util;
+      // The stack is mapped at the highest address, so the whole file is parsed
+      EXPECT_TRUE(util.GetMemoryProtect(&start)) << "get stack protect";
+    }
+    uint64_t parse_us = elapsed_us(start) / kRounds;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < kRounds; ++i) {
+      MapsHelper util;
+      EXPECT_TRUE(util.GetMemoryProtect(mem + (lines - 1) * page)) << "get protect from snapshot";
+    }
+    LOGI("maps lines: %zu, GetMemoryProtect parse: %" PRIu64 " us, snapshot: %" PRIu64 " us", lines, parse_us,
+         elapsed_us(start) / kRounds);
+    munmap(mem, page * lines);
+    MapsHelper::Refresh();
+  }
+}
+
+TEST(MapsHelper, procmapQueryTest) {
+  if (!MapsHelper::SupportProcmapQuery()) {
+    GTEST_SKIP() << "PROCMAP_QUERY requires Linux 6.11+";
+  }
+  size_t page = getpagesize();
+  auto *mem = static_cast<uint8_t *>(mmap(nullptr, page * 2, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(mem, MAP_FAILED) << "mmap";
+  ASSERT_EQ(mprotect(mem + page, page, PROT_READ | PROT_EXEC), 0) << "mprotect";
+  MapsHelper::Refresh();
+
+  MapsHelper kernel;
+  ASSERT_TRUE(kernel.GetMemoryProtect(mem, page * 2)) << "ioctl get memory protect";
+  MapsHelper::SetProcmapQueryEnabled(false);
+  MapsHelper text;
+  ASSERT_TRUE(text.GetMemoryProtect(mem, page * 2)) << "text get memory protect";
+  MapsHelper::SetProcmapQueryEnabled(true);
+
+  ASSERT_EQ(kernel.end() - kernel.begin(), text.end() - text.begin()) << "same page count";
+  for (auto k = kernel.begin(), t = text.begin(); k != kernel.end(); ++k, ++t) {
+    EXPECT_EQ(k->start, t->start);
+    EXPECT_EQ(k->end, t->end);
+    EXPECT_EQ(k->old_protect, t->old_protect);
+  }
+  EXPECT_TRUE(MapsHelper().CheckAddressPageProtect(reinterpret_cast<Address>(mem), page * 2, kMPRead));
+  EXPECT_FALSE(MapsHelper().CheckAddressPageProtect(reinterpret_cast<Address>(mem), page * 2, kMPExecute));
+  munmap(mem, page * 2);
+  MapsHelper::Refresh();
+}
+
+TEST(MapsHelper, DISABLED_procmapQueryBenchmarkTest) {
+  if (!MapsHelper::SupportProcmapQuery()) {
+    GTEST_SKIP() << "PROCMAP_QUERY requires Linux 6.11+";
+  }
+  // Latency with many mappings, the text parser has to read the whole file for the stack
+  size_t page = getpagesize();
+  constexpr size_t kLines = 20000;
+  auto *many = static_cast<uint8_t *>(mmap(nullptr, page * kLines, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(many, MAP_FAILED) << "mmap many";
+  for (size_t i = 1; i < kLines; i += 2) {
+    mprotect(many + i * page, page, PROT_READ | PROT_WRITE);
+  }
+  uint64_t cost[2];
+  for (bool procmap : {false, true}) {
+    MapsHelper::SetProcmapQueryEnabled(procmap);
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 10; ++i) {
+      MapsHelper::Refresh();
+      MapsHelper util;
+      EXPECT_TRUE(util.GetMemoryProtect(&start)) << "get stack protect";
+    }
+    cost[procmap] = elapsed_us(start) / 10;
+  }
+  LOGI("maps lines: %zu, GetMemoryProtect text: %" PRIu64 " us, PROCMAP_QUERY: %" PRIu64 " us", kLines, cost[0],
+       cost[1]);
+  munmap(many, page * kLines);
+  MapsHelper::Refresh();
+}
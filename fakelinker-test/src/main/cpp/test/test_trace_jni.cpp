@@ -0,0 +1,734 @@
+#include <dlfcn.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fakelinker/alog.h>
+#include <fakelinker/default_trace_jni.h>
+#include <fakelinker/symbol_resolver.h>
+#include <fakelinker/trace_callgraph.h>
+#include <fakelinker/trace_epoch.h>
+#include <fakelinker/trace_file.h>
+#include <fakelinker/trace_latency.h>
+#include <fakelinker/trace_sampler.h>
+
+using namespace fakelinker;
+
+using Monitor = JNIMonitor<DefaultTraceJNICallback>;
+
+TEST(JNIMonitor, filterTest) {
+  Monitor monitor;
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(5))) << "nothing monitored";
+  ASSERT_TRUE(monitor.AddMonitorAddress(100, 200, false));
+  ASSERT_TRUE(monitor.AddMonitorAddress(150, 300, false));
+  ASSERT_TRUE(monitor.AddMonitorAddress(1000, 2000, false));
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(99)));
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(100)));
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(250))) << "overlapping ranges are merged";
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(300)));
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(301)));
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(2000)));
+  EXPECT_FALSE(monitor.IsMonitoring(UINTPTR_MAX));
+  // The cached range of the last hit must not survive a change
+  ASSERT_TRUE(monitor.RemoveMonitorAddress(150, 300));
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(250)));
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(200)));
+
+  ASSERT_TRUE(monitor.AddMonitorAddress(100, 200, true));
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(150))) << "excluded range";
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(50))) << "outside of excluded range";
+  ASSERT_TRUE(monitor.RemoveMonitorAddress(100, 200));
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(150))) << "nothing is excluded any more";
+  EXPECT_TRUE(monitor.IsMonitoring(uintptr_t(50)));
+  ASSERT_TRUE(monitor.AddMonitorAddress(100, 200, false));
+  ASSERT_TRUE(monitor.RemoveMonitorAddress(100, 200));
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(150))) << "nothing is included any more";
+  ASSERT_TRUE(monitor.AddMonitorAddress(100, 200, true));
+  monitor.Clear();
+  EXPECT_FALSE(monitor.IsMonitoring(uintptr_t(50)));
+}
+
+TEST(JNIMonitor, concurrentFilterTest) {
+  Monitor monitor;
+  monitor.AddMonitorAddress(0x1000, 0x1fff, false);
+  std::atomic<bool> stop = false;
+  std::atomic<int> errors = 0;
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        // Never removed, always monitored
+        if (!monitor.IsMonitoring(uintptr_t(0x1800))) {
+          errors++;
+        }
+        monitor.IsMonitoring(uintptr_t(0x10800));
+      }
+    });
+  }
+  for (int i = 0; i < 2000; ++i) {
+    monitor.AddMonitorAddress(0x10000, 0x10fff, false);
+    monitor.RemoveMonitorAddress(0x10000, 0x10fff);
+  }
+  stop = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(errors.load(), 0) << "readers saw a broken filter";
+
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  constexpr int kCalls = 1000000;
+  int hits = 0;
+  for (int i = 0; i < kCalls; ++i) {
+    hits += monitor.IsMonitoring(reinterpret_cast<void *>(0x20000 + (i & 0xff)));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  EXPECT_EQ(hits, 0);
+  uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+  LOGI("IsMonitoring miss: %.2f ns/call", static_cast<double>(ns) / kCalls);
+}
+
+static std::atomic<int> g_freed_tables{0};
+
+struct CountedTable {
+  ~CountedTable() { g_freed_tables++; }
+};
+
+TEST(TraceEpoch, reclaimTest) {
+  TraceRetireList<CountedTable> retired;
+  retired.Retire(new CountedTable());
+  EXPECT_EQ(g_freed_tables.load(), 1) << "no reader, freed at once";
+
+  std::atomic<int> step = 0;
+  std::thread reader([&] {
+    TraceEpoch::ReadGuard guard;
+    {
+      TraceEpoch::ReadGuard nested;
+    }
+    step = 1;
+    while (step.load() != 2) {
+      std::this_thread::yield();
+    }
+  });
+  while (step.load() != 1) {
+    std::this_thread::yield();
+  }
+  retired.Retire(new CountedTable());
+  retired.Retire(new CountedTable());
+  EXPECT_EQ(retired.Pending(), 2U) << "the reader may still use both tables";
+  EXPECT_EQ(g_freed_tables.load(), 1);
+  step = 2;
+  reader.join();
+  retired.Reclaim();
+  EXPECT_EQ(retired.Pending(), 0U);
+  EXPECT_EQ(g_freed_tables.load(), 3);
+
+  {
+    TraceEpoch::ReadGuard guard;
+    retired.Retire(new CountedTable());
+    EXPECT_EQ(retired.Pending(), 1U) << "the writer thread reads as well";
+  }
+  retired.Reclaim();
+  EXPECT_EQ(g_freed_tables.load(), 4);
+}
+
+TEST(JNIMonitor, memberFilterTest) {
+  Monitor monitor;
+  TraceMember method{kTVMethodID, 0x1000};
+  TraceMember field{kTVFieldID, 0x1000};
+  EXPECT_TRUE(monitor.IsTracingMember(method)) << "empty filter traces every member";
+  monitor.AddTraceMethod(reinterpret_cast<jmethodID>(0x1000));
+  monitor.AddTraceMethod(reinterpret_cast<jmethodID>(0x1000));
+  monitor.AddTraceMethod(nullptr);
+  EXPECT_TRUE(monitor.IsTracingMember(method));
+  EXPECT_FALSE(monitor.IsTracingMember(field)) << "method and field ids are kept apart";
+  EXPECT_FALSE(monitor.IsTracingMember(TraceMember{kTVMethodID, 0}));
+  EXPECT_TRUE(monitor.IsTracingMember(TraceMember{kTVNone, 0})) << "calls without a member are not filtered";
+
+  // Grow the table past several rehashes while readers look up a member that never leaves
+  std::atomic<bool> stop = false;
+  std::atomic<int> errors = 0;
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        if (!monitor.IsTracingMember(method)) {
+          errors++;
+        }
+      }
+    });
+  }
+  for (uintptr_t i = 1; i <= 1000; ++i) {
+    monitor.AddTraceField(reinterpret_cast<jfieldID>(0x100000 + i * 8));
+  }
+  stop = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(errors.load(), 0) << "readers saw a broken filter";
+  for (uintptr_t i = 1; i <= 1000; ++i) {
+    ASSERT_TRUE(monitor.IsTracingMember(TraceMember{kTVFieldID, 0x100000 + i * 8}));
+    ASSERT_FALSE(monitor.IsTracingMember(TraceMember{kTVMethodID, 0x100000 + i * 8}));
+  }
+
+  monitor.ClearTraceMembers();
+  EXPECT_TRUE(monitor.IsTracingMember(field));
+}
+
+TEST(JNIMonitor, toggleFunctionTest) {
+  DefaultTraceJNICallback tracer(false);
+  tracer.BindMethod();
+  Monitor monitor;
+  monitor.SetTraceMode(JNITraceMode::kShadowTable);
+  size_t find_class = offsetof(JNINativeInterface, FindClass);
+  size_t get_version = offsetof(JNINativeInterface, GetVersion);
+  EXPECT_FALSE(monitor.EnableTraceFunction(find_class, true)) << "not hooked yet";
+  monitor.SetHookAllFunctions(true);
+  monitor.AddTraceFunction(find_class);
+  ASSERT_TRUE(monitor.StartTrace(&tracer));
+  EXPECT_EQ(jni_trace::shadow_jni.FindClass, jni_trace::hook_jni.FindClass);
+  EXPECT_EQ(jni_trace::shadow_jni.GetObjectRefType, jni_trace::hook_jni.GetObjectRefType) << "every function is hooked";
+  EXPECT_TRUE(Monitor::IsTraceFunctionEnabled(find_class));
+  EXPECT_FALSE(Monitor::IsTraceFunctionEnabled(get_version)) << "only the trace functions start enabled";
+
+  EXPECT_TRUE(monitor.EnableTraceFunction("GetVersion", true));
+  EXPECT_TRUE(Monitor::IsTraceFunctionEnabled(get_version));
+  EXPECT_TRUE(monitor.EnableTraceFunction(find_class, false));
+  EXPECT_FALSE(Monitor::IsTraceFunctionEnabled(find_class));
+  EXPECT_FALSE(monitor.EnableTraceFunction("NoSuchFunction", true));
+  EXPECT_FALSE(monitor.EnableTraceFunction(size_t(1), true));
+  EXPECT_TRUE(monitor.EnableTraceFunction("*", false));
+  EXPECT_FALSE(Monitor::IsTraceFunctionEnabled(get_version));
+  jni_trace::monitor = nullptr;
+  jni_trace::callback = nullptr;
+}
+
+static jint FakeCallIntMethodV(JNIEnv *, jobject, jmethodID, va_list args) { return va_arg(args, jint); }
+
+static uint64_t CallGraphCount(size_t function, jmethodID method) {
+  uint64_t count = 0;
+  for (auto &entry : TraceCallGraph::Snapshot()) {
+    if (entry.function == function && entry.member.value == reinterpret_cast<uintptr_t>(method)) {
+      count += entry.count;
+    }
+  }
+  return count;
+}
+
+TEST(JNIMonitor, toggleVariadicFunctionTest) {
+  DefaultTraceJNICallback tracer(false);
+  tracer.BindMethod();
+  Monitor monitor;
+  monitor.SetTraceMode(JNITraceMode::kShadowTable);
+  monitor.AddTraceFunction(offsetof(JNINativeInterface, CallIntMethod));
+  monitor.AddTraceFunction(offsetof(JNINativeInterface, CallIntMethodV));
+  ASSERT_TRUE(monitor.StartTrace(&tracer));
+  JNINativeInterface fake_jni{};
+  fake_jni.CallIntMethodV = FakeCallIntMethodV;
+  JNINativeInterface *org_jni = jni_trace::org_jni;
+  jni_trace::org_jni = &fake_jni;
+  JNIEnv env{&jni_trace::shadow_jni};
+  jmethodID method = reinterpret_cast<jmethodID>(0x3000);
+  // Both hooks forward to CallIntMethodV, the call graph counts them under that name
+  size_t call_v = FindJNIFunctionIndex("CallIntMethodV");
+  TraceCallGraph::SetEnabled(true);
+  TraceCallGraph::Reset();
+
+  EXPECT_EQ(jni_trace::shadow_jni.CallIntMethod(&env, nullptr, method, 42), 42);
+  EXPECT_EQ(CallGraphCount(call_v, method), 1U);
+  EXPECT_TRUE(monitor.EnableTraceFunction("CallIntMethodV", false));
+  EXPECT_EQ(jni_trace::shadow_jni.CallIntMethod(&env, nullptr, method, 43), 43);
+  EXPECT_EQ(CallGraphCount(call_v, method), 2U) << "disabling the va_list function keeps the variadic one";
+  EXPECT_TRUE(monitor.EnableTraceFunction("CallIntMethodV", true));
+  EXPECT_TRUE(monitor.EnableTraceFunction("CallIntMethod", false));
+  EXPECT_EQ(jni_trace::shadow_jni.CallIntMethod(&env, nullptr, method, 44), 44) << "passed through";
+  EXPECT_EQ(CallGraphCount(call_v, method), 2U) << "the variadic hook checks its own slot";
+  EXPECT_TRUE(monitor.EnableTraceFunction("CallIntMethod", true));
+  EXPECT_EQ(jni_trace::shadow_jni.CallIntMethod(&env, nullptr, method, 45), 45);
+  EXPECT_EQ(CallGraphCount(call_v, method), 3U);
+
+  TraceCallGraph::SetEnabled(false);
+  TraceCallGraph::Reset();
+  monitor.EnableTraceFunction("*", false);
+  jni_trace::org_jni = org_jni;
+  jni_trace::monitor = nullptr;
+  jni_trace::callback = nullptr;
+}
+
+TEST(DescriptionCache, stressTest) {
+  DescriptionCache<jmethodID> cache;
+  EXPECT_EQ(cache.Insert(nullptr, "null"), nullptr) << "null keys are not interned";
+  EXPECT_EQ(cache.Find(nullptr), nullptr);
+  constexpr int kThreads = 32;
+  constexpr uintptr_t kKeys = 4096;
+  std::atomic<int> errors = 0;
+  std::atomic<int> inserts = 0;
+  auto key_of = [](uintptr_t i) { return reinterpret_cast<jmethodID>((i + 1) * 16); };
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      char expected[32];
+      for (int round = 0; round < 20; ++round) {
+        for (uintptr_t i = 0; i < kKeys; ++i) {
+          // Every thread walks the keys in a different order
+          uintptr_t index = (i * 7 + t * 131) % kKeys;
+          jmethodID key = key_of(index);
+          snprintf(expected, sizeof(expected), "method-%zu", static_cast<size_t>(index));
+          // The strings of a cleared cache are freed once no guard may use them
+          TraceEpoch::ReadGuard guard;
+          const char *desc = cache.Find(key);
+          if (desc == nullptr) {
+            desc = cache.Insert(key, expected);
+            inserts++;
+          }
+          if (strcmp(desc, expected) != 0) {
+            errors++;
+          }
+        }
+        if (t == 0 && round % 5 == 4) {
+          cache.Clear();
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  EXPECT_EQ(errors.load(), 0) << "wrong description";
+  // Every key is inserted at least once and again after every Clear
+  EXPECT_GE(inserts.load(), static_cast<int>(kKeys));
+  uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+  LOGI("DescriptionCache %d threads: %.2f ns/lookup, inserts: %d", kThreads,
+       static_cast<double>(ns) / (kThreads * 20 * kKeys), inserts.load());
+}
+
+static std::atomic<uint64_t> g_sink_records{0};
+static std::atomic<uint64_t> g_sink_disorder{0};
+
+static void CountingSink(const TraceRecord *records, size_t count, void *) {
+  for (size_t i = 1; i < count; ++i) {
+    // Records of one ring are drained in order, a batch never mixes threads
+    if (records[i].tid == records[i - 1].tid && records[i].timestamp_ns < records[i - 1].timestamp_ns) {
+      g_sink_disorder++;
+    }
+  }
+  g_sink_records += count;
+}
+
+TEST(TraceBuffer, drainTest) {
+  constexpr int kThreads = 8;
+  constexpr int kRecords = 50000;
+  ASSERT_TRUE(TraceBuffer::Start(CountingSink, nullptr, 1));
+  EXPECT_FALSE(TraceBuffer::Start(CountingSink, nullptr, 1)) << "already running";
+  uint64_t dropped_before = TraceBuffer::DroppedRecords();
+  uint64_t drained_before = TraceBuffer::DrainedRecords();
+  std::atomic<uint64_t> recorded{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      TraceRecord record{};
+      record.tid = t;
+      record.function = 4;
+      for (int i = 0; i < kRecords; ++i) {
+        record.timestamp_ns = i;
+        if (TraceBuffer::Record(record)) {
+          recorded++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  TraceBuffer::Stop();
+  EXPECT_FALSE(TraceBuffer::IsRunning());
+  uint64_t dropped = TraceBuffer::DroppedRecords() - dropped_before;
+  uint64_t drained = TraceBuffer::DrainedRecords() - drained_before;
+  EXPECT_EQ(drained, recorded.load()) << "stop drains every pending record";
+  EXPECT_EQ(drained + dropped, static_cast<uint64_t>(kThreads) * kRecords);
+  EXPECT_EQ(g_sink_records.load(), drained);
+  EXPECT_EQ(g_sink_disorder.load(), 0U);
+  EXPECT_FALSE(TraceBuffer::Record(TraceRecord{})) << "not running";
+  LOGI("TraceBuffer drained: %" PRIu64 ", dropped: %" PRIu64, drained, dropped);
+}
+
+TEST(TraceFileWriter, writeTest) {
+  const char *dir = getenv("TMPDIR");
+  std::string path = std::string(dir ? dir : "/data/local/tmp") + "/fakelinker_test.trace";
+  constexpr int kRecords = 100000;
+  TraceFileWriter writer;
+  // Start small so the mapping has to grow
+  ASSERT_TRUE(writer.Open(path.c_str(), 4096));
+  EXPECT_EQ(writer.Size(), sizeof(TraceFileHeader));
+  static const char *kMethod = "void java.lang.Object.notify()";
+  EXPECT_FALSE(writer.HasSymbol(kTVMethodID, 0x1234));
+  ASSERT_TRUE(writer.AddSymbol(kTVMethodID, 0x1234, kMethod));
+  ASSERT_TRUE(writer.AddSymbol(kTVMethodID, 0x5678, kMethod)) << "string is written once";
+  // Descriptions are deduplicated by content, a reused buffer holding a new description is written again
+  char buffer[64];
+  strcpy(buffer, kMethod);
+  size_t before = writer.Size();
+  ASSERT_TRUE(writer.AddSymbol(kTVMethodID, 0x9abc, buffer));
+  EXPECT_LT(writer.Size() - before, strlen(kMethod));
+  strcpy(buffer, "int java.lang.Object.hashCode()");
+  before = writer.Size();
+  ASSERT_TRUE(writer.AddSymbol(kTVMethodID, 0xdef0, buffer));
+  EXPECT_GT(writer.Size() - before, strlen(buffer));
+  EXPECT_TRUE(writer.HasSymbol(kTVMethodID, 0x1234));
+  EXPECT_FALSE(writer.HasSymbol(kTVFieldID, 0x1234));
+  EXPECT_FALSE(writer.AddSymbol(kTVInt, 1, "invalid"));
+  ASSERT_TRUE(writer.AddSymbol(kTVPointer, 0x7f001000, "0x7f001000 [libtest.so!0x1000]"));
+  TraceRecord record{};
+  record.timestamp_ns = 1000;
+  record.caller = 0x7f001000;
+  record.tid = 1234;
+  // CallVoidMethod(obj, methodID)
+  record.function = 61;
+  record.args[0] = 0x2006;
+  record.args[1] = 0x1234;
+  record.arg_types = kTVObject | (kTVMethodID << 4);
+  for (int i = 0; i < kRecords; ++i) {
+    record.timestamp_ns += 800;
+    ASSERT_TRUE(writer.WriteRecord(record));
+  }
+  ASSERT_TRUE(writer.WriteDropped(3));
+  EXPECT_EQ(writer.Events(), static_cast<uint64_t>(kRecords));
+  size_t size = writer.Size();
+  // The text line of this call is around 100 bytes
+  EXPECT_LT(size, kRecords * 24U);
+  writer.Close();
+  EXPECT_FALSE(writer.IsOpen());
+  struct stat st;
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  EXPECT_EQ(static_cast<size_t>(st.st_size), size) << "close truncates the reserved space";
+  LOGI("TraceFileWriter %d records: %zu bytes, %.1f bytes/record", kRecords, size,
+       static_cast<double>(size) / kRecords);
+  unlink(path.c_str());
+}
+
+static int AdmitCount(size_t function, uintptr_t caller, int calls) {
+  int admitted = 0;
+  for (int i = 0; i < calls; ++i) {
+    if (TraceSampler::Admit(function, reinterpret_cast<void *>(caller))) {
+      admitted++;
+    }
+  }
+  return admitted;
+}
+
+TEST(TraceSampler, limitTest) {
+  TraceSampler::Reset();
+  EXPECT_FALSE(TraceSampler::IsActive());
+  EXPECT_EQ(AdmitCount(31, 0x1000, 100), 100) << "nothing configured";
+  TraceSuppressedCounts before = TraceSampler::Suppressed();
+
+  EXPECT_FALSE(TraceSampler::SetSampleRate("NoSuchFunction", 10));
+  ASSERT_TRUE(TraceSampler::SetSampleRate("GetObjectClass", 10));
+  EXPECT_TRUE(TraceSampler::IsActive());
+  size_t index = FindJNIFunctionIndex("GetObjectClass");
+  EXPECT_EQ(AdmitCount(index, 0x1000, 1000), 100);
+  EXPECT_EQ(AdmitCount(index + 1, 0x1000, 100), 100) << "other functions are not sampled";
+  TraceSampler::SetSampleRate(index, 0);
+  EXPECT_FALSE(TraceSampler::IsActive());
+
+  // The coarse clock does not move much within the loop, only the burst passes
+  TraceSampler::SetCallerRateLimit(1, 5);
+  EXPECT_EQ(AdmitCount(index, 0x1000, 100), 5);
+  EXPECT_EQ(AdmitCount(index, 0x2000, 100), 5) << "every caller has its own bucket";
+  TraceSampler::SetCallerRateLimit(0, 0);
+
+  TraceSampler::SetGlobalRateLimit(1, 3);
+  EXPECT_EQ(AdmitCount(index, 0x3000, 50) + AdmitCount(index, 0x4000, 50), 3);
+
+  TraceSuppressedCounts after = TraceSampler::Suppressed();
+  EXPECT_EQ(after.sampled - before.sampled, 900U);
+  EXPECT_EQ(after.caller_limited - before.caller_limited, 190U);
+  EXPECT_EQ(after.global_limited - before.global_limited, 97U);
+  TraceSuppressedCounts report;
+  EXPECT_TRUE(TraceSampler::TakeReport(report));
+  EXPECT_GE(report.Total(), 900U + 190U + 97U);
+  EXPECT_FALSE(TraceSampler::TakeReport(report)) << "once per interval";
+
+  TraceSampler::Reset();
+  EXPECT_FALSE(TraceSampler::IsActive());
+}
+
+TEST(TraceSampler, exitedThreadTest) {
+  TraceSampler::Reset();
+  size_t index = FindJNIFunctionIndex("GetObjectClass");
+  TraceSampler::SetSampleRate(index, 100);
+  TraceSuppressedCounts before = TraceSampler::Suppressed();
+  std::atomic<bool> counted{false};
+  std::atomic<bool> checked{false};
+  // Counts of a live thread are seen from another thread, even fewer than a hundred of them
+  std::thread worker([&] {
+    EXPECT_EQ(AdmitCount(index, 0x1000, 230), 3);
+    counted.store(true);
+    while (!checked.load()) {
+      std::this_thread::yield();
+    }
+  });
+  while (!counted.load()) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(TraceSampler::Suppressed().sampled - before.sampled, 227U);
+  checked.store(true);
+  worker.join();
+  EXPECT_EQ(TraceSampler::Suppressed().sampled - before.sampled, 227U) << "kept after the thread exited";
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([index] { AdmitCount(index, 0x1000, 150); });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(TraceSampler::Suppressed().sampled - before.sampled, 227U + 4 * 148U);
+  TraceSampler::Reset();
+}
+
+static void RecordLatency(size_t function, uint64_t duration_ns) {
+  TraceLatencyStats::End(function, reinterpret_cast<void *>(&RecordLatency), TraceLatencyStats::Begin() - duration_ns);
+}
+
+TEST(TraceLatencyStats, histogramTest) {
+  TraceLatencyStats::SetEnabled(false);
+  EXPECT_EQ(TraceLatencyStats::Begin(), 0U) << "disabled";
+  TraceLatencyStats::SetEnabled(true);
+  TraceLatencyStats::Reset();
+  size_t get_class = FindJNIFunctionIndex("GetObjectClass");
+  size_t find_class = FindJNIFunctionIndex("FindClass");
+  constexpr int kThreads = 4;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([=]() {
+      // 1us to 100us evenly, the clock adds a little on top
+      for (int i = 1; i <= 100; ++i) {
+        RecordLatency(get_class, i * 1000);
+      }
+      RecordLatency(find_class, 10000000);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::vector<TraceLatencySummary> summaries = TraceLatencyStats::Snapshot();
+  ASSERT_EQ(summaries.size(), 2U);
+  // Sorted by total time, 4 * 10ms before 4 * 5.05ms
+  const TraceLatencySummary &first = summaries[0];
+  const TraceLatencySummary &second = summaries[1];
+  EXPECT_STREQ(first.function, "FindClass");
+  EXPECT_EQ(first.count, static_cast<uint64_t>(kThreads));
+  EXPECT_STREQ(second.function, "GetObjectClass");
+  EXPECT_EQ(second.count, static_cast<uint64_t>(kThreads * 100));
+  EXPECT_STREQ(first.library, second.library);
+  EXPECT_STRNE(first.library, "unknown") << "the caller library is resolved from the maps";
+  // Log-linear buckets are at most 12.5% wide
+  EXPECT_NEAR(second.p50_ns, 50000, 50000 * 0.15);
+  EXPECT_NEAR(second.p90_ns, 90000, 90000 * 0.15);
+  EXPECT_NEAR(second.p99_ns, 99000, 99000 * 0.15);
+  EXPECT_GE(second.max_ns, 100000U);
+  EXPECT_LE(second.p99_ns, second.max_ns);
+  LOGI("%s", TraceLatencyStats::Dump().c_str());
+
+  TraceLatencyStats::Reset();
+  EXPECT_TRUE(TraceLatencyStats::Snapshot().empty()) << "reset drops the histograms of all threads";
+  RecordLatency(find_class, 1000);
+  summaries = TraceLatencyStats::Snapshot();
+  ASSERT_EQ(summaries.size(), 1U);
+  EXPECT_EQ(summaries[0].count, 1U);
+  TraceLatencyStats::SetEnabled(false);
+}
+
+static void AppendTestLine(TraceMessage &message, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  message.AppendLine(format, args);
+  va_end(args);
+}
+
+TEST(TraceMessage, arenaTest) {
+  // Contexts stay small, the buffer is only taken when a line is formatted
+  EXPECT_LE(sizeof(TraceInvokeContext<jobject>), 48U);
+  EXPECT_LE(sizeof(TraceInvokeContext<void>), 40U);
+  TraceInvokeContext<void> context(nullptr, nullptr);
+  EXPECT_TRUE(context.message.empty());
+  EXPECT_EQ(context.message.Finish(), "");
+
+  {
+    // Deeper than the arena, the last ones come from malloc
+    std::vector<std::unique_ptr<TraceMessage>> nested;
+    for (int i = 0; i < 8; ++i) {
+      nested.emplace_back(new TraceMessage());
+      AppendTestLine(*nested.back(), "level %d", i);
+    }
+    for (int i = 0; i < 8; ++i) {
+      EXPECT_EQ(nested[i]->Finish(), "level " + std::to_string(i) + "\n");
+    }
+    // Released in reverse order like stack contexts
+    while (!nested.empty()) {
+      nested.pop_back();
+    }
+  }
+
+  TraceMessage message;
+  std::string line(1000, 'x');
+  for (int i = 0; i < 10; ++i) {
+    AppendTestLine(message, "%s", line.c_str());
+  }
+  std::string_view text = message.Finish();
+  EXPECT_EQ(text.size(), TraceMessage::kCapacity - 1) << "cut off at the capacity";
+  EXPECT_EQ(text.back(), '\n');
+  EXPECT_EQ(text.data()[text.size()], '\0');
+}
+
+TEST(TraceCallGraph, aggregateTest) {
+  jmethodID method = reinterpret_cast<jmethodID>(0x1000);
+  jfieldID field = reinterpret_cast<jfieldID>(0x2000);
+  TraceMember member = TraceMemberOf(nullptr, jobject(nullptr), method, field);
+  EXPECT_EQ(member.type, kTVMethodID) << "the first id is taken";
+  EXPECT_EQ(member.value, 0x1000U);
+  EXPECT_EQ(TraceMemberOf(jobject(nullptr), 1).type, kTVNone);
+  EXPECT_EQ(TraceMemberOf().type, kTVNone);
+
+  TraceCallGraph::SetEnabled(true);
+  TraceCallGraph::Reset();
+  EXPECT_NE(TraceLatencyStats::Begin(), 0U) << "the call graph needs the durations";
+  size_t call_method = FindJNIFunctionIndex("CallObjectMethodV");
+  size_t get_field = FindJNIFunctionIndex("GetIntField");
+  const void *caller = reinterpret_cast<void *>(&RecordLatency);
+  constexpr int kThreads = 4;
+  constexpr int kCalls = 1000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([=]() {
+      for (int i = 0; i < kCalls; ++i) {
+        TraceCallGraph::Record(call_method, caller, TraceMember{kTVMethodID, 0x1000}, 100);
+        if (i % 2 == 0) {
+          TraceCallGraph::Record(get_field, caller, TraceMember{kTVFieldID, 0x2000}, 1000);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // Threads racing on the first call of a tuple may split it over two slots, the counts are never lost
+  std::vector<TraceCallGraphEntry> entries = TraceCallGraph::Snapshot();
+  ASSERT_GE(entries.size(), 2U);
+  ASSERT_LE(entries.size(), 2U * kThreads);
+  uint64_t method_count = 0, method_ns = 0, field_count = 0;
+  for (auto &entry : entries) {
+    if (entry.function == call_method) {
+      method_count += entry.count;
+      method_ns += entry.total_ns;
+    } else {
+      EXPECT_EQ(entry.function, get_field);
+      field_count += entry.count;
+    }
+  }
+  EXPECT_EQ(method_count, static_cast<uint64_t>(kThreads * kCalls));
+  EXPECT_EQ(method_ns, kThreads * kCalls * 100U);
+  EXPECT_EQ(field_count, static_cast<uint64_t>(kThreads * kCalls / 2));
+  EXPECT_EQ(TraceCallGraph::Overflow(), 0U);
+
+  // Sorted by count, members described by the callback
+  std::string top = TraceCallGraph::DumpTop(
+    1, true, [](TraceMember member, void *) { return member.type == kTVMethodID ? "Object.toString" : "Foo.bar"; },
+    nullptr);
+  LOGI("%s", top.c_str());
+  EXPECT_NE(top.find("CallObjectMethodV"), std::string::npos);
+  EXPECT_NE(top.find("Object.toString"), std::string::npos);
+  EXPECT_EQ(top.find("GetIntField"), std::string::npos) << "only the top entry";
+
+  const char *dir = getenv("TMPDIR");
+  std::string path = std::string(dir ? dir : "/data/local/tmp") + "/fakelinker_test.folded";
+  ASSERT_TRUE(TraceCallGraph::WriteFolded(path.c_str(), false, true, nullptr, nullptr));
+  FILE *file = fopen(path.c_str(), "re");
+  ASSERT_NE(file, nullptr);
+  std::vector<std::string> lines;
+  char line[512];
+  while (fgets(line, sizeof(line), file)) {
+    lines.emplace_back(line);
+  }
+  fclose(file);
+  unlink(path.c_str());
+  ASSERT_EQ(lines.size(), 2U);
+  for (auto &folded : lines) {
+    // caller;function;member weight
+    EXPECT_EQ(std::count(folded.begin(), folded.end(), ';'), 2) << folded;
+    if (folded.find(";GetIntField;field 0x2000 ") != std::string::npos) {
+      EXPECT_NE(folded.find(" " + std::to_string(kThreads * kCalls / 2 * 1000) + "\n"), std::string::npos) << folded;
+    } else {
+      EXPECT_NE(folded.find(";CallObjectMethodV;method 0x1000 "), std::string::npos) << folded;
+    }
+  }
+
+  TraceCallGraph::Reset();
+  EXPECT_TRUE(TraceCallGraph::Snapshot().empty());
+  TraceCallGraph::Record(get_field, caller, TraceMember{kTVFieldID, 0x2000}, 1);
+  entries = TraceCallGraph::Snapshot();
+  ASSERT_EQ(entries.size(), 1U) << "the slot is reused after a reset";
+  EXPECT_EQ(entries[0].count, 1U);
+  TraceCallGraph::SetEnabled(false);
+  EXPECT_EQ(TraceLatencyStats::Begin(), 0U);
+}
+
+TEST(SymbolResolver, functionSymbolTest) {
+  Dl_info info;
+  ASSERT_NE(dladdr(reinterpret_cast<void *>(calloc), &info), 0);
+  // Thumb functions have the lowest bit set
+  uintptr_t function = reinterpret_cast<uintptr_t>(calloc) & ~static_cast<uintptr_t>(1);
+  SymbolResolver resolver;
+  ASSERT_TRUE(resolver.AddAddressRange("libc.so", info.dli_fbase, reinterpret_cast<void *>(function + 0x1000)));
+  SymbolResolver::SymbolResult result;
+  ASSERT_TRUE(resolver.ResolveSymbol(function + 4, result));
+  EXPECT_EQ(result.symbol, nullptr) << "function symbols are disabled by default";
+  EXPECT_EQ(result.offset, function + 4 - reinterpret_cast<uintptr_t>(info.dli_fbase));
+
+  resolver.SetFunctionSymbols(true);
+  ASSERT_TRUE(resolver.ResolveSymbol(function + 4, result));
+  ASSERT_NE(result.symbol, nullptr);
+  EXPECT_STREQ(result.symbol, "calloc");
+  EXPECT_EQ(result.symbol_offset, 4U);
+  std::string formatted = resolver.FormatAddress(function + 4, false);
+  EXPECT_NE(formatted.find("[libc.so!calloc+0x4]"), std::string::npos) << formatted;
+  EXPECT_EQ(resolver.FormatAddress(function + 4, false), formatted) << "served from the cache";
+  EXPECT_NE(resolver.FormatAddress(function, false, "head").find("head "), std::string::npos);
+  // Evicted entries are formatted again
+  for (uintptr_t i = 0; i < SymbolResolver::kFormatCacheSize + 8; ++i) {
+    resolver.FormatAddress(function + 8 + i, false);
+  }
+  EXPECT_EQ(resolver.FormatAddress(function + 4, false), formatted);
+
+  // The first read of the table, cache hits and replaced slots race without a lock
+  SymbolResolver shared;
+  ASSERT_TRUE(shared.AddAddressRange("libc.so", info.dli_fbase, reinterpret_cast<void *>(function + 0x1000)));
+  shared.SetFunctionSymbols(true);
+  std::atomic<int> mismatches{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (uintptr_t i = 0; i < 4 * SymbolResolver::kFormatCacheSize; ++i) {
+        if (shared.FormatAddress(function + 4, false) != formatted) {
+          mismatches++;
+        }
+        shared.FormatAddress(function + 8 + i % (2 * SymbolResolver::kFormatCacheSize), false);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(mismatches.load(), 0);
+}
@@ -5,12 +5,19 @@
 #include "fakelinker/maps_util.h"
 
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <unordered_map>
 
 #include <fakelinker/alog.h>
 #include <fakelinker/macros.h>
@@ -18,6 +25,44 @@
 
 #define MAPS_PATH "/proc/self/maps"
 
+// Large enough for several hundred lines per read, a single line is at most PATH_MAX plus the fixed fields
+static constexpr size_t kMapsBufferSize = 64 * 1024;
+
+#ifndef PROCMAP_QUERY
+// uapi/linux/fs.h, Linux 6.11+
+#define PROCFS_IOCTL_MAGIC 'f'
+#define PROCMAP_QUERY      _IOWR(PROCFS_IOCTL_MAGIC, 17, struct procmap_query)
+
+enum procmap_query_flags {
+  PROCMAP_QUERY_VMA_READABLE = 0x01,
+  PROCMAP_QUERY_VMA_WRITABLE = 0x02,
+  PROCMAP_QUERY_VMA_EXECUTABLE = 0x04,
+  PROCMAP_QUERY_VMA_SHARED = 0x08,
+  PROCMAP_QUERY_COVERING_OR_NEXT_VMA = 0x10,
+  PROCMAP_QUERY_FILE_BACKED_VMA = 0x20,
+};
+
+struct procmap_query {
+  uint64_t size;
+  uint64_t query_flags;
+  uint64_t query_addr;
+  uint64_t vma_start;
+  uint64_t vma_end;
+  uint64_t vma_flags;
+  uint64_t vma_page_size;
+  uint64_t vma_offset;
+  uint64_t inode;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint32_t vma_name_size;
+  uint32_t build_id_size;
+  uint64_t vma_name_addr;
+  uint64_t build_id_addr;
+};
+#endif
+
+static constexpr size_t kProcmapNameSize = PATH_MAX + 64;
+
 namespace fakelinker {
 
 static std::string FormatProt(int prot) {
@@ -49,36 +94,480 @@ static std::string FormatPageProtect(const PageProtect &pp) {
   return result;
 }
 
-MapsHelper::MapsHelper(const char *library_name) { GetLibraryProtect(library_name); }
+static inline bool ParseHex(char *&p, uint64_t &value) {
+  char *start = p;
+  uint64_t result = 0;
+  for (;; ++p) {
+    unsigned c = static_cast<unsigned char>(*p);
+    if (c - '0' < 10) {
+      result = (result << 4) | (c - '0');
+    } else if ((c | 0x20) - 'a' < 6) {
+      result = (result << 4) | ((c | 0x20) - 'a' + 10);
+    } else {
+      break;
+    }
+  }
+  value = result;
+  return p != start;
+}
 
-MapsHelper::~MapsHelper() { CloseMaps(); }
+static inline bool ParseDecimal(char *&p, uint64_t &value) {
+  char *start = p;
+  uint64_t result = 0;
+  for (unsigned c; (c = static_cast<unsigned char>(*p) - '0') < 10; ++p) {
+    result = result * 10 + c;
+  }
+  value = result;
+  return p != start;
+}
 
-bool MapsHelper::GetMemoryProtect(void *address, uint64_t size) {
-  if (!OpenMaps()) {
+static inline int ParseProtect(const char *p) {
+  int prot = kMPNone;
+  for (int i = 0; i < 4; ++i) {
+    switch (p[i]) {
+    case 'r':
+      prot |= kMPRead;
+      break;
+    case 'w':
+      prot |= kMPWrite;
+      break;
+    case 'x':
+      prot |= kMPExecute;
+      break;
+    case 's':
+      prot |= kMPShared;
+      break;
+    case 'p':
+      prot |= kMPPrivate;
+      break;
+    case '-':
+      break;
+    default:
+      return kMPInvalid;
+    }
+  }
+  return prot;
+}
+
+namespace {
+/*
+ * Reads the maps file with large read() calls and splits the lines in place, no stdio is involved
+ */
+class MapsReader {
+public:
+  ~MapsReader() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+
+  bool Open() {
+    fd_ = open(MAPS_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+      return false;
+    }
+    // One extra byte for the terminator of a last line without line break
+    buffer_.reset(new char[kMapsBufferSize + 1]);
+    return true;
+  }
+
+  bool NextLine();
+
+  bool ParseLine(MapsEntry &entry, const char *&path);
+
+private:
+  std::unique_ptr<char[]> buffer_;
+  size_t pos_ = 0;
+  size_t len_ = 0;
+  bool eof_ = false;
+  char *line_ = nullptr;
+  int fd_ = -1;
+};
+} // namespace
+
+bool MapsReader::NextLine() {
+  for (;;) {
+    char *begin = buffer_.get() + pos_;
+    size_t remain = len_ - pos_;
+    if (char *newline = static_cast<char *>(memchr(begin, '\n', remain))) {
+      *newline = '\0';
+      line_ = begin;
+      pos_ += newline - begin + 1;
+      return true;
+    }
+    if (eof_) {
+      if (remain == 0) {
+        return false;
+      }
+      // The last line has no line break
+      begin[remain] = '\0';
+      line_ = begin;
+      pos_ = len_;
+      return true;
+    }
+    if (remain == kMapsBufferSize) {
+      // Should not happen, drop the oversized line and let FormatLine reject the rest of it
+      remain = 0;
+    }
+    memmove(buffer_.get(), begin, remain);
+    pos_ = 0;
+    len_ = remain;
+    ssize_t rc = TEMP_FAILURE_RETRY(read(fd_, buffer_.get() + len_, kMapsBufferSize - len_));
+    if (rc <= 0) {
+      eof_ = true;
+    } else {
+      len_ += rc;
+    }
+  }
+}
+
+/**
+ * @brief Parse "start-end perms offset dev inode path" in place, the path is cut at the first blank
+ *
+ */
+bool MapsReader::ParseLine(MapsEntry &entry, const char *&path) {
+  char *p = line_;
+  uint64_t start, end, offset, inode;
+  if (!ParseHex(p, start) || *p++ != '-' || !ParseHex(p, end) || *p++ != ' ') {
     return false;
   }
-  auto target = reinterpret_cast<Address>(address);
-  auto end = target + size;
-  while (GetMapsLine()) {
-    if (!FormatLine()) {
-      continue;
+  // Verify if permission string is valid, since maps file changes frequently, invalid types may be read
+  int protect = ParseProtect(p);
+  if (protect == kMPInvalid || p[4] != ' ') {
+    return false;
+  }
+  p += 5;
+  if (!ParseHex(p, offset) || *p++ != ' ') {
+    return false;
+  }
+  // Skip the device number
+  while (*p != ' ' && *p != '\0') {
+    ++p;
+  }
+  if (*p++ != ' ' || !ParseDecimal(p, inode)) {
+    return false;
+  }
+  while (*p == ' ' || *p == '\t') {
+    ++p;
+  }
+  char *path_end = p;
+  while (*path_end != '\0' && *path_end != ' ' && *path_end != '\t') {
+    ++path_end;
+  }
+  *path_end = '\0';
+  entry.start = start;
+  entry.end = end;
+  entry.file_offset = offset;
+  entry.inode = static_cast<int32_t>(inode);
+  entry.protect = static_cast<uint8_t>(protect);
+  path = p;
+  return true;
+}
+
+
+static std::atomic<uint32_t> g_maps_generation = 1;
+// Bumped whenever a MapsHelper starts changing page protections, a snapshot parsed meanwhile is not cached
+static std::atomic<uint32_t> g_unlock_epoch = 0;
+static std::atomic<int> g_unlocked_helpers = 0;
+static std::shared_ptr<const MapsSnapshot> g_maps_snapshot;
+
+std::shared_ptr<const MapsSnapshot> MapsSnapshot::Get(bool refresh, bool *created) {
+  if (created != nullptr) {
+    *created = false;
+  }
+  uint32_t generation = g_maps_generation.load();
+  uint32_t epoch = g_unlock_epoch.load();
+  bool cacheable = g_unlocked_helpers.load() == 0;
+  if (cacheable && !refresh) {
+    std::shared_ptr<const MapsSnapshot> current = std::atomic_load(&g_maps_snapshot);
+    if (current && current->generation_ == generation) {
+      return current;
     }
-    if (end_address_ <= target) {
+  }
+  std::shared_ptr<MapsSnapshot> snapshot(new MapsSnapshot());
+  snapshot->generation_ = generation;
+  if (!snapshot->Load()) {
+    LOGE("read %s failed: %s", MAPS_PATH, strerror(errno));
+    return nullptr;
+  }
+  if (created != nullptr) {
+    *created = true;
+  }
+  if (cacheable && g_unlocked_helpers.load() == 0 && g_unlock_epoch.load() == epoch) {
+    std::atomic_store(&g_maps_snapshot, std::shared_ptr<const MapsSnapshot>(std::move(snapshot)));
+    return std::atomic_load(&g_maps_snapshot);
+  }
+  return snapshot;
+}
+
+std::shared_ptr<const MapsSnapshot> MapsSnapshot::Cached() {
+  if (g_unlocked_helpers.load() != 0) {
+    return nullptr;
+  }
+  std::shared_ptr<const MapsSnapshot> current = std::atomic_load(&g_maps_snapshot);
+  if (current && current->generation_ == g_maps_generation.load()) {
+    return current;
+  }
+  return nullptr;
+}
+
+void MapsSnapshot::Invalidate() { g_maps_generation.fetch_add(1); }
+
+bool MapsSnapshot::Load() {
+  MapsReader reader;
+  if (!reader.Open()) {
+    return false;
+  }
+  std::unordered_map<std::string, uint32_t> interned;
+  // Offset 0 is the empty path of anonymous mappings
+  strings_.push_back('\0');
+  uint32_t last_path = 0;
+  MapsEntry entry;
+  const char *path;
+  while (reader.NextLine()) {
+    if (!reader.ParseLine(entry, path)) {
       continue;
     }
-    if (start_address_ >= end) {
+    if (*path == '\0') {
+      entry.path = 0;
+    } else if (last_path != 0 && strcmp(strings_.data() + last_path, path) == 0) {
+      // Segments of the same file are adjacent
+      entry.path = last_path;
+    } else {
+      auto [itr, inserted] = interned.try_emplace(path, strings_.size());
+      if (inserted) {
+        strings_.append(path, strlen(path) + 1);
+      }
+      entry.path = itr->second;
+      last_path = entry.path;
+    }
+    entries_.push_back(entry);
+  }
+  // The kernel lists mappings in address order, but the file can change while it is being read
+  if (!std::is_sorted(entries_.begin(), entries_.end(), [](const MapsEntry &a, const MapsEntry &b) {
+        return a.start < b.start;
+      })) {
+    std::sort(entries_.begin(), entries_.end(), [](const MapsEntry &a, const MapsEntry &b) {
+      return a.start < b.start;
+    });
+  }
+  return true;
+}
+
+size_t MapsSnapshot::Find(Address address) const {
+  return std::partition_point(entries_.begin(), entries_.end(),
+                              [address](const MapsEntry &entry) {
+                                return entry.end <= address;
+                              }) -
+         entries_.begin();
+}
+
+const char *MapsSnapshot::FindFile(Address address, Address *base, bool *mapped) const {
+  size_t index = Find(address);
+  bool inside = index < entries_.size() && entries_[index].start <= address;
+  if (mapped != nullptr) {
+    *mapped = inside;
+  }
+  if (!inside || entries_[index].path == 0) {
+    return nullptr;
+  }
+  uint32_t file = entries_[index].path;
+  while (index > 0 && entries_[index - 1].path == file) {
+    index--;
+  }
+  if (base != nullptr) {
+    *base = entries_[index].start;
+  }
+  return strings_.data() + file;
+}
+
+static constexpr int kProcmapUnsupported = -2;
+static pthread_mutex_t g_procmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<int> g_procmap_fd = kProcmapUnsupported;
+// /proc/self resolves when it is opened, a descriptor inherited through fork describes the parent
+static std::atomic<pid_t> g_procmap_pid = 0;
+static std::atomic<bool> g_procmap_enabled = true;
+
+static int ProcmapFd() {
+  if (!g_procmap_enabled.load(std::memory_order_relaxed)) {
+    return kProcmapUnsupported;
+  }
+  pid_t pid = getpid();
+  if (g_procmap_pid.load(std::memory_order_acquire) == pid) {
+    return g_procmap_fd.load(std::memory_order_relaxed);
+  }
+  pthread_mutex_lock(&g_procmap_mutex);
+  if (g_procmap_pid.load(std::memory_order_relaxed) != pid) {
+    int old_fd = g_procmap_fd.load(std::memory_order_relaxed);
+    if (old_fd >= 0) {
+      close(old_fd);
+    }
+    int fd = open(MAPS_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      procmap_query query{};
+      query.size = sizeof(query);
+      query.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+      if (ioctl(fd, PROCMAP_QUERY, &query) != 0) {
+        LOGD("PROCMAP_QUERY is not supported: %s", strerror(errno));
+        close(fd);
+        fd = kProcmapUnsupported;
+      }
+    } else {
+      fd = kProcmapUnsupported;
+    }
+    g_procmap_fd.store(fd, std::memory_order_relaxed);
+    g_procmap_pid.store(pid, std::memory_order_release);
+  }
+  pthread_mutex_unlock(&g_procmap_mutex);
+  return g_procmap_fd.load(std::memory_order_relaxed);
+}
+
+bool MapsHelper::SupportProcmapQuery() { return ProcmapFd() >= 0; }
+
+void MapsHelper::SetProcmapQueryEnabled(bool enable) { g_procmap_enabled.store(enable, std::memory_order_relaxed); }
+
+static constexpr size_t kPathBlockSize = 16 * 1024;
+static constexpr size_t kMaxPooledArenas = 8;
+
+/*
+ * Storage of query results, kept across queries. Up to kMaxPooledArenas helpers alive at the same time reuse
+ * pooled storage and do not allocate once it has grown, further helpers get an arena of their own that is freed
+ * on destruction. Helpers nest on one thread (unlock and verify while another query is open), so the pool is
+ * process-wide rather than one arena per thread
+ */
+struct MapsArena {
+  std::vector<PageProtect> pages;
+  std::string library_name;
+  // Blocks never move, interned paths stay valid until the pool is reset
+  std::vector<std::unique_ptr<char[]>> path_blocks;
+  size_t path_block = 0;
+  size_t path_used = 0;
+  const char *last_path = nullptr;
+  std::unique_ptr<char[]> procmap_name;
+
+  void ResetPaths() {
+    path_block = 0;
+    path_used = 0;
+    last_path = nullptr;
+  }
+};
+
+static pthread_mutex_t g_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MapsArena *g_free_arenas[kMaxPooledArenas];
+static size_t g_free_arena_count = 0;
+
+static MapsArena *AcquireArena() {
+  MapsArena *arena = nullptr;
+  pthread_mutex_lock(&g_arena_mutex);
+  if (g_free_arena_count > 0) {
+    arena = g_free_arenas[--g_free_arena_count];
+  }
+  pthread_mutex_unlock(&g_arena_mutex);
+  return arena ? arena : new MapsArena();
+}
+
+static void ReleaseArena(MapsArena *arena) {
+  arena->pages.clear();
+  arena->ResetPaths();
+  pthread_mutex_lock(&g_arena_mutex);
+  if (g_free_arena_count < kMaxPooledArenas) {
+    g_free_arenas[g_free_arena_count++] = arena;
+    arena = nullptr;
+  }
+  pthread_mutex_unlock(&g_arena_mutex);
+  delete arena;
+}
+
+MapsHelper::MapsHelper() : arena_(AcquireArena()) {
+  pages_.swap(arena_->pages);
+  library_name_.swap(arena_->library_name);
+}
+
+MapsHelper::MapsHelper(const char *library_name) : MapsHelper() { GetLibraryProtect(library_name); }
+
+MapsHelper::~MapsHelper() {
+  if (unlocked_) {
+    // Destroyed without recovery, the protection change is permanent
+    MapsSnapshot::Invalidate();
+    EndUnlock();
+  }
+  CloseMaps();
+  pages_.swap(arena_->pages);
+  library_name_.swap(arena_->library_name);
+  ReleaseArena(arena_);
+}
+
+const char *MapsHelper::InternPath(const char *path) {
+  if (path[0] == '\0') {
+    return "";
+  }
+  MapsArena &arena = *arena_;
+  // Mappings of the same file are adjacent, comparing with the last path removes most duplicates
+  if (arena.last_path && strcmp(arena.last_path, path) == 0) {
+    return arena.last_path;
+  }
+  size_t len = std::min(strlen(path) + 1, kPathBlockSize);
+  if (arena.path_block < arena.path_blocks.size() && arena.path_used + len > kPathBlockSize) {
+    arena.path_block++;
+    arena.path_used = 0;
+  }
+  if (arena.path_block == arena.path_blocks.size()) {
+    arena.path_blocks.emplace_back(new char[kPathBlockSize]);
+  }
+  char *result = arena.path_blocks[arena.path_block].get() + arena.path_used;
+  memcpy(result, path, len - 1);
+  result[len - 1] = '\0';
+  arena.path_used += len;
+  arena.last_path = result;
+  return result;
+}
+
+void MapsHelper::AddPage() {
+  if (pages_.empty()) {
+    // No record refers to the interned paths any more
+    arena_->ResetPaths();
+  }
+  PageProtect page;
+  page.start = start_address_;
+  page.end = end_address_;
+  page.file_offset = file_offset_;
+  page.old_protect = protect_;
+  page.inode = inode_;
+  page.path = InternPath(path_);
+  pages_.push_back(page);
+}
+
+bool MapsHelper::GetMemoryProtect(void *address, uint64_t size) {
+  auto target = reinterpret_cast<Address>(address);
+  auto end = target + (size == 0 ? 1 : size);
+  if (OpenProcmap(target)) {
+    pages_.clear();
+    while (GetMapsLine() && start_address_ < end) {
+      AddPage();
+      if (end_address_ >= end) {
+        break;
+      }
+    }
+    return !pages_.empty();
+  }
+  for (bool refresh = false;; refresh = true) {
+    if (!OpenMaps(refresh)) {
+      return false;
+    }
+    pages_.clear();
+    cursor_ = snapshot_->Find(target);
+    Address covered = target;
+    while (GetMapsLine() && start_address_ < end) {
+      if (start_address_ <= covered) {
+        covered = std::max(covered, end_address_);
+      }
+      AddPage();
+    }
+    // A range that is not fully mapped in the snapshot may have been mapped afterwards
+    if (covered >= end || snapshot_created_) {
       return !pages_.empty();
     }
-    PageProtect page;
-    page.start = start_address_;
-    page.end = end_address_;
-    page.file_offset = file_offset_;
-    page.old_protect = FormatProtect();
-    page.inode = inode_;
-    page.path = path_;
-    pages_.push_back(page);
   }
-  return false;
 }
 
 bool MapsHelper::ReadLibraryMap() {
@@ -87,13 +576,11 @@ bool MapsHelper::ReadLibraryMap() {
   int protect = 0;
   while (GetMapsLine()) {
     if (!started) {
-      if (!FormatLine() || !MatchPath() || inode_ == 0 || file_offset_ != 0) {
+      if (!MatchPath() || inode_ == 0 || file_offset_ != 0) {
         continue;
       }
       found_inode = inode_;
       started = true;
-    } else if (!FormatLine()) {
-      break;
     }
     // Library mapping may be discontinuous, but there will be no crossing
     if (found_inode != inode_ && inode_ != 0) {
@@ -110,18 +597,11 @@ bool MapsHelper::ReadLibraryMap() {
     if (inode_ == 0) {
       continue;
     }
-    PageProtect page;
-    page.start = start_address_;
-    page.end = end_address_;
-    page.old_protect = FormatProtect();
-    protect |= page.old_protect;
-    page.file_offset = file_offset_;
-    page.inode = inode_;
-    page.path = path_;
-    pages_.push_back(page);
+    protect |= protect_;
+    AddPage();
   }
   if (pages_.empty()) {
-    // File has been read completely
+    // Snapshot has been read completely
     return true;
   }
   return VerifyLibraryMap();
@@ -135,6 +615,12 @@ bool MapsHelper::GetLibraryProtect(const char *library_name) {
   do {
     pages_.clear();
   } while (!ReadLibraryMap());
+  // The library may have been loaded after the snapshot was taken
+  if (pages_.empty() && !snapshot_created_ && OpenMaps(true)) {
+    do {
+      pages_.clear();
+    } while (!ReadLibraryMap());
+  }
   if (!pages_.empty()) {
     LOGD("find library: %s\n %s", library_name, ToString().c_str());
   }
@@ -153,47 +639,55 @@ bool MapsHelper::UnlockAddressProtect(void *address, uint64_t size) {
   }
   page.new_protect = page.old_protect | kMPRead | kMPWrite;
   // only change rwx protect
+  mprotect_count_++;
   if (int code = mprotect(reinterpret_cast<void *>(page.start), page.end - page.start, page.new_protect & kMPRWX)) {
     LOGE("change protect memory failed: %s, new %s, error: %d", FormatPageProtect(page).c_str(),
          FormatProt(page.new_protect).c_str(), code);
     return false;
   }
+  MapsSnapshot::Invalidate();
   return true;
 }
 
 Address MapsHelper::FindLibraryBase(const char *library_name) {
   Address result = 0;
-  if (!library_name || !OpenMaps()) {
+  if (!library_name) {
     return result;
   }
-
-  int protect = 0;
   MakeLibraryName(library_name);
-  while (GetMapsLine()) {
-    if (!FormatLine()) {
-      continue;
-    }
-    if (path_[0] == '[') {
-      continue;
-    }
-    if (!MatchPath()) {
-      continue;
-    }
-    if (file_offset_ == 0) {
-      result = start_address_;
-      protect = 0;
-    }
-    protect |= FormatProtect();
-    if ((protect & (kMPRead | kMPExecute)) != (kMPRead | kMPExecute) && result != 0) {
+  // Name lookups visit every mapping, the snapshot does that without one PROCMAP_QUERY per mapping.
+  // The library may have been loaded after the shared snapshot was taken, parse again once if it is missing
+  for (bool refresh = false; result == 0; refresh = true) {
+    if ((refresh && snapshot_created_) || !OpenMaps(refresh)) {
       break;
     }
+    int protect = 0;
+    while (GetMapsLine()) {
+      if (path_[0] == '[') {
+        continue;
+      }
+      if (!MatchPath()) {
+        continue;
+      }
+      if (file_offset_ == 0) {
+        result = start_address_;
+        protect = 0;
+      }
+      protect |= protect_;
+      if ((protect & (kMPRead | kMPExecute)) != (kMPRead | kMPExecute) && result != 0) {
+        break;
+      }
+    }
   }
   return result;
 }
 
 bool MapsHelper::CheckAddressPageProtect(const Address address, uint64_t size, uint8_t prot) {
   if (pages_.empty()) {
-    return false;
+    // Nothing queried before, ask for the range itself
+    MapsHelper query;
+    return query.GetMemoryProtect(reinterpret_cast<void *>(address), size) &&
+           query.CheckAddressPageProtect(address, size, prot);
   }
   Address start = address;
   Address end = address + size;
@@ -238,21 +732,21 @@ std::string MapsHelper::GetLibraryRealPath(const char *library_name) {
   }
   MakeLibraryName(library_name);
   while (GetMapsLine()) {
-    if (!FormatLine()) {
-      continue;
-    }
     if (path_[0] == '[' || !MatchPath()) {
       continue;
     }
     result = path_;
     break;
   }
+  if (result.empty() && !snapshot_created_ && OpenMaps(true)) {
+    return GetLibraryRealPath(library_name);
+  }
   return result;
 }
 
 std::string MapsHelper::GetCurrentRealPath() const {
   for (auto &page : pages_) {
-    if (!page.path.empty() && page.inode != 0) {
+    if (page.path[0] != '\0' && page.inode != 0) {
       return page.path;
     }
   }
@@ -270,21 +764,56 @@ std::string MapsHelper::ToString() const {
   return result;
 }
 
+void MapsHelper::SetPageProtect(const PageProtect *pages, size_t count) {
+  pages_.clear();
+  for (size_t i = 0; i < count; ++i) {
+    start_address_ = pages[i].start;
+    end_address_ = pages[i].end;
+    file_offset_ = pages[i].file_offset;
+    protect_ = pages[i].old_protect;
+    inode_ = pages[i].inode;
+    path_ = pages[i].path;
+    AddPage();
+  }
+  path_ = "";
+}
+
 bool MapsHelper::UnlockPageProtect(MapsProt prot) {
   if (pages_.empty() || prot == MapsProt::kMPInvalid) {
     return false;
   }
-  for (PageProtect &pp : pages_) {
-    if ((pp.old_protect & prot) != prot) {
-      pp.new_protect = pp.old_protect | prot;
-      if (int code = mprotect(reinterpret_cast<void *>(pp.start), pp.end - pp.start, pp.new_protect & kMPRWX)) {
-        LOGE("change protect memory failed: %s, new %s, error: %d", FormatPageProtect(pp).c_str(),
-             FormatProt(pp.new_protect).c_str(), code);
-        return false;
-      }
-    } else {
-      pp.new_protect = pp.old_protect;
+  for (size_t i = 0; i < pages_.size();) {
+    PageProtect &first = pages_[i];
+    if ((first.old_protect & prot) == prot) {
+      // Already satisfies the request
+      first.new_protect = first.old_protect;
+      ++i;
+      continue;
+    }
+    // Merge the following adjacent pages that end up with the same protection, pages that already have it are
+    // covered by the same call but stay unchanged for recovery
+    const int target = (first.old_protect | prot) & kMPRWX;
+    size_t last = i;
+    while (last + 1 < pages_.size() && pages_[last + 1].start == pages_[last].end &&
+           ((pages_[last + 1].old_protect | prot) & kMPRWX) == target) {
+      ++last;
+    }
+    if (!unlocked_) {
+      // Announce the change before it happens, so that concurrent parses are not cached
+      unlocked_ = true;
+      g_unlock_epoch.fetch_add(1);
+      g_unlocked_helpers.fetch_add(1);
+    }
+    for (size_t k = i; k <= last; ++k) {
+      pages_[k].new_protect = pages_[k].old_protect | prot;
+    }
+    mprotect_count_++;
+    if (int code = mprotect(reinterpret_cast<void *>(first.start), pages_[last].end - first.start, target)) {
+      LOGE("change protect memory failed: %s, new %s, error: %d", FormatPageProtect(first).c_str(),
+           FormatProt(first.new_protect).c_str(), code);
+      return false;
     }
+    i = last + 1;
   }
   return true;
 }
@@ -293,81 +822,123 @@ bool MapsHelper::RecoveryPageProtect() {
   if (pages_.empty()) {
     return false;
   }
-  for (PageProtect &pp : pages_) {
-    if (pp.old_protect != pp.new_protect) {
-      if (int code = mprotect(reinterpret_cast<void *>(pp.start), pp.end - pp.start, pp.old_protect & kMPRWX)) {
-        LOGE("change protect memory failed: %s, new %s, error: %d", FormatPageProtect(pp).c_str(),
-             FormatProt(pp.new_protect).c_str(), code);
-        return false;
-      }
-      pp.new_protect = pp.old_protect;
+  uint32_t unlock_count = mprotect_count_;
+  for (size_t i = 0; i < pages_.size();) {
+    PageProtect &first = pages_[i];
+    if (first.old_protect == first.new_protect) {
+      ++i;
+      continue;
+    }
+    // Only restore what was changed, adjacent changed pages with the same original protection share one call
+    size_t last = i;
+    while (last + 1 < pages_.size() && pages_[last + 1].start == pages_[last].end &&
+           pages_[last + 1].old_protect != pages_[last + 1].new_protect &&
+           (pages_[last + 1].old_protect & kMPRWX) == (first.old_protect & kMPRWX)) {
+      ++last;
+    }
+    mprotect_count_++;
+    if (int code =
+          mprotect(reinterpret_cast<void *>(first.start), pages_[last].end - first.start, first.old_protect & kMPRWX)) {
+      LOGE("change protect memory failed: %s, new %s, error: %d", FormatPageProtect(first).c_str(),
+           FormatProt(first.new_protect).c_str(), code);
+      return false;
+    }
+    for (size_t k = i; k <= last; ++k) {
+      pages_[k].new_protect = pages_[k].old_protect;
     }
+    i = last + 1;
   }
+  LOGD("recovery %zu mappings, mprotect calls: %u unlock, %u recovery", pages_.size(), unlock_count,
+       mprotect_count_ - unlock_count);
+  // Everything is back to the state described by the snapshot
+  EndUnlock();
   return true;
 }
 
-bool MapsHelper::GetMapsLine() { return fgets(line_, sizeof(line_), maps_fd_) != nullptr; }
-
-bool MapsHelper::FormatLine() {
-  int num = sscanf(line_, "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 "%*s %" SCNi32 " %1023s", &start_address_,
-                   &end_address_, protect_, &file_offset_, &inode_, path_);
-  if (num == 5) {
-    path_[0] = '\0';
+bool MapsHelper::GetMapsLine() {
+  if (procmap_fd_ >= 0) {
+    return NextProcmapVma();
   }
-  // Verify if permission string is valid
-  if (FormatProtect() == kMPInvalid) {
-    // Since maps file changes frequently, invalid types may be read
+  if (cursor_ >= snapshot_->size()) {
     return false;
   }
-  return num == 6 || num == 5;
+  const MapsEntry &entry = (*snapshot_)[cursor_++];
+  start_address_ = entry.start;
+  end_address_ = entry.end;
+  file_offset_ = entry.file_offset;
+  inode_ = entry.inode;
+  protect_ = entry.protect;
+  path_ = snapshot_->path(entry);
+  return true;
 }
 
-int MapsHelper::FormatProtect() {
-  int port = kMPNone;
-  for (int i = 0; i < sizeof(protect_) && protect_[i] != '\0'; ++i) {
-    switch (protect_[i]) {
-    case 'r':
-      port |= kMPRead;
-      break;
-    case 'w':
-      port |= kMPWrite;
-      break;
-    case 'x':
-      port |= kMPExecute;
-      break;
-    case 's':
-      port |= kMPShared;
-      break;
-    case 'p':
-      port |= kMPPrivate;
-      break;
-    case '-':
-      break;
-    default:
-      return kMPInvalid;
-    }
-  }
-  return port;
-};
-
 bool MapsHelper::MatchPath() {
-  char *p = strstr(path_, library_name_.c_str());
+  const char *p = strstr(path_, library_name_.c_str());
   return p != nullptr && strlen(p) == library_name_.length();
 }
 
-bool MapsHelper::OpenMaps() {
-  if (maps_fd_ != nullptr) {
-    fseeko(maps_fd_, 0, SEEK_SET);
-    return true;
+bool MapsHelper::OpenProcmap(Address address) {
+  procmap_fd_ = ProcmapFd();
+  if (procmap_fd_ < 0) {
+    return false;
   }
-  maps_fd_ = fopen(MAPS_PATH, "re");
-  return maps_fd_ != nullptr;
+  if (!arena_->procmap_name) {
+    arena_->procmap_name.reset(new char[kProcmapNameSize]);
+  }
+  procmap_next_ = address;
+  return true;
 }
 
-void MapsHelper::CloseMaps() {
-  if (maps_fd_ != nullptr) {
-    fclose(maps_fd_);
-    maps_fd_ = nullptr;
+bool MapsHelper::NextProcmapVma() {
+  procmap_query query{};
+  query.size = sizeof(query);
+  query.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+  query.query_addr = procmap_next_;
+  query.vma_name_addr = reinterpret_cast<uintptr_t>(arena_->procmap_name.get());
+  query.vma_name_size = kProcmapNameSize;
+  // ENOENT after the last mapping
+  if (ioctl(procmap_fd_, PROCMAP_QUERY, &query) != 0 || query.vma_end <= procmap_next_) {
+    return false;
+  }
+  procmap_next_ = query.vma_end;
+  start_address_ = query.vma_start;
+  end_address_ = query.vma_end;
+  file_offset_ = query.vma_offset;
+  inode_ = static_cast<int32_t>(query.inode);
+  protect_ = (query.vma_flags & PROCMAP_QUERY_VMA_SHARED) ? kMPShared : kMPPrivate;
+  if (query.vma_flags & PROCMAP_QUERY_VMA_READABLE) {
+    protect_ |= kMPRead;
+  }
+  if (query.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) {
+    protect_ |= kMPWrite;
+  }
+  if (query.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) {
+    protect_ |= kMPExecute;
+  }
+  char *name = arena_->procmap_name.get();
+  if (query.vma_name_size == 0) {
+    name[0] = '\0';
+  } else {
+    // Same as the text parser, the path ends at the first blank
+    name[strcspn(name, " \t")] = '\0';
+  }
+  path_ = name;
+  return true;
+}
+
+bool MapsHelper::OpenMaps(bool refresh) {
+  procmap_fd_ = -1;
+  snapshot_ = MapsSnapshot::Get(refresh, &snapshot_created_);
+  cursor_ = 0;
+  return snapshot_ != nullptr;
+}
+
+void MapsHelper::CloseMaps() { snapshot_.reset(); }
+
+void MapsHelper::EndUnlock() {
+  if (unlocked_) {
+    unlocked_ = false;
+    g_unlocked_helpers.fetch_sub(1);
   }
 }
 
@@ -62,6 +62,28 @@ typedef struct {
   void **backup_method;
 } HookRegisterNativeUnit;
 
+typedef struct {
+  jclass clazz;
+  HookRegisterNativeUnit *items;
+  size_t len;
+} HookJavaClassUnit;
+
+/**
+ * @brief Manual relocation statistics of a library or of the whole process
+ */
+typedef struct {
+  uint64_t scanned_jump_slot; /**< JUMP_SLOT relocations scanned */
+  uint64_t scanned_glob_dat;  /**< GLOB_DAT relocations scanned */
+  uint64_t scanned_absolute;  /**< ABSOLUTE relocations scanned */
+  uint64_t scanned_other;     /**< Other relocations scanned */
+  uint64_t patched_slots;     /**< Slots whose value was changed */
+  uint64_t blacklist_skipped; /**< Exported symbols excluded by the relocation blacklist */
+  uint64_t unprotected_pages; /**< Pages whose protection was changed to writable */
+  uint64_t relink_count;      /**< Number of relocation operations */
+  uint64_t time_ns;           /**< Wall time spent, in nanoseconds */
+  uint64_t mprotect_calls;    /**< mprotect system calls made to unlock and restore the pages */
+} RelocationStats;
+
 #define FunPtr(Ret, Name, ...) Ret (*Name)(__VA_ARGS__)
 
 typedef void *SoinfoPtr;    // soinfo raw pointer
@@ -427,17 +449,85 @@ typedef struct {
   FunPtr(SymbolAddress, soinfo_get_export_symbol_address_by_prefix, SoinfoPtr soinfo_ptr, const char *name,
          int *out_error);
 
+  /**
+   * @brief Update a single symbol in a library that has been manually relocated. Only the slots
+   * recorded by the previous relocation are written, the relocation tables are not scanned again
+   *
+   * @param  target      Manually relocated target library
+   * @param  symbol_name Symbol name to update
+   * @param  address     New symbol address, nullptr restores the original address
+   * @return Return true if the slots are updated successfully
+   */
+  FunPtr(bool, update_manual_relocation_symbol, SoinfoPtr target, const char *symbol_name, SymbolAddress address);
+
+  /**
+   * @brief Restore all slots changed by manual relocations of the target library to their original values
+   *
+   * @param  target      Manually relocated target library
+   * @return Return true if the restore is successful
+   */
+  FunPtr(bool, call_manual_unrelocation, SoinfoPtr target);
+
+  /**
+   * @brief Automatically relocate libraries loaded afterwards to the symbols exported by global_lib, blacklisted
+   * symbols at the time of the call are excluded. Each new library is relocated once after loading, so its
+   * constructors still see the original symbols. Unloading global_lib disables it.
+   * Android 8.0+ covers every dlopen, android_dlopen_ext and System.loadLibrary by redirecting the imports of
+   * libdl.so, below Android 8.0 only libraries loaded by call_dlopen_inside are relocated
+   *
+   * @param  global_lib  Specify a library as a global library, nullptr disables automatic relocation
+   * @return Return true if the setting is successful
+   */
+  FunPtr(bool, set_auto_relocation, SoinfoPtr global_lib);
+
+  /**
+   * @brief Get manual relocation statistics
+   *
+   * @param       target  Relocated library, nullptr gets the statistics of the whole process
+   * @param[out]  last    Statistics of the last relocation of the target, can be nullptr, not filled in when
+   * the target is nullptr
+   * @param[out]  total   Cumulative statistics, can be nullptr
+   * @return Return error code or kErrorNo
+   */
+  FunPtr(int, get_relocation_stats, SoinfoPtr target, RelocationStats *last, RelocationStats *total);
+
+  /**
+   * @brief Print a one-line summary after each manual relocation
+   *
+   * @param  enable      Whether to print the summary
+   */
+  FunPtr(void, set_relocation_stats_log, bool enable);
+
+  /**
+   * @brief Compute the relocation of the target library to the symbols exported by global_lib without
+   * changing memory. The plan records the build-id, symbol names and slot offsets of the target, it can be
+   * saved and applied again in a later process
+   *
+   * @param       global_lib  Specify a library as a global library
+   * @param       target      Target library to relocate
+   * @param[out]  out_size    Size of the returned plan
+   * @return Serialized plan or nullptr
+   * @note that free_inside_memory is called to release memory after use
+   */
+  FunPtr(MEMORY_FREE void *, plan_manual_relocation, SoinfoPtr global_lib, SoinfoPtr target, size_t *out_size);
+
+  /**
+   * @brief Apply a plan made by plan_manual_relocation. The symbol addresses are resolved again from global_lib,
+   * every slot must still hold the value seen while planning, rebased on the library that value points into,
+   * otherwise nothing is written. The build-ids of the target and of those libraries must match the plan
+   *
+   * @param  global_lib  Specify a library as a global library
+   * @param  target      Target library to relocate
+   * @param  plan        Serialized plan
+   * @param  size        Size of the plan
+   * @return Return true if the whole plan is applied
+   */
+  FunPtr(bool, apply_manual_relocation_plan, SoinfoPtr global_lib, SoinfoPtr target, const void *plan, size_t size);
+
   /**
    * @brief New version expansion reserved slot
    *
    */
-  FunPtr(void, unused1);
-  FunPtr(void, unused2);
-  FunPtr(void, unused3);
-  FunPtr(void, unused4);
-  FunPtr(void, unused5);
-  FunPtr(void, unused6);
-  FunPtr(void, unused7);
   FunPtr(void, unused8);
   FunPtr(void, unused9);
 
@@ -774,13 +864,38 @@ typedef struct {
    */
   FunPtr(int, hook_java_native_functions, JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len);
 
+  /**
+   * @brief Queue a Jni method hook without writing it, @see hook_jni_native_function
+   * The parameters are checked immediately, a later hook of the same offset replaces the queued one
+   *
+   * @return Parameter check error code
+   */
+  FunPtr(FakeLinkerError, queue_jni_native_function, int func_offset, void *hook_method, void **backup_method);
+
+  /**
+   * @brief Write all queued Jni method hooks together, the table is unlocked and restored only once
+   *
+   * @return Number of successful hooks, -1 if the table protection could not be changed
+   */
+  FunPtr(int, commit_jni_native_functions);
+
+  /**
+   * @brief Hook the native methods of several classes together, @see hook_java_native_functions
+   * The methods of each class are resolved first and registered with a single RegisterNatives call
+   *
+   * @param  env            JNIEnv pointer
+   * @param  classes        Classes and the methods to hook in each of them
+   * @param  len            Number of classes
+   * @param  direct_entry   Store the hook atomically into the jni entrypoint of the ArtMethod instead of calling
+   * RegisterNatives, falls back to RegisterNatives when the entrypoint offset cannot be found
+   * @return Number of successful hooks
+   */
+  FunPtr(int, hook_java_native_classes, JNIEnv *env, HookJavaClassUnit *classes, size_t len, bool direct_entry);
+
   /**
    * @brief New version expansion reserved slot
    *
    */
-  FunPtr(void, unused20);
-  FunPtr(void, unused21);
-  FunPtr(void, unused22);
   FunPtr(void, unused23);
   FunPtr(void, unused24);
   FunPtr(void, unused25);
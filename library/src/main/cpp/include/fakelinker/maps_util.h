@@ -5,12 +5,17 @@
 
 #include <sys/mman.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "macros.h"
 
 namespace fakelinker {
+/*
+ * Fixed size record, the path is interned in the arena of the MapsHelper that produced it and is valid until the
+ * next query of that helper or its destruction
+ */
 struct PageProtect {
   Address start = 0;
   Address end;
@@ -18,9 +23,11 @@ struct PageProtect {
   uint8_t new_protect;
   uint64_t file_offset;
   int32_t inode;
-  std::string path;
+  const char *path = "";
 };
 
+struct MapsArena;
+
 enum MapsProt {
   kMPNone = PROT_NONE,
   kMPRead = PROT_READ,
@@ -34,11 +41,65 @@ enum MapsProt {
   kMPInvalid = -1,
 };
 
+struct MapsEntry {
+  Address start;
+  Address end;
+  uint64_t file_offset;
+  int32_t inode;
+  // Offset of the interned path in the snapshot string pool
+  uint32_t path;
+  uint8_t protect;
+};
+
+/*
+ * Immutable parsed copy of /proc/self/maps shared by all MapsHelper queries. Entries are sorted by address and
+ * equal paths are stored once. The cached snapshot is dropped when fake-linker changes the memory layout itself
+ * (dlopen, permanent mprotect) or MapsHelper::Refresh is called, while some MapsHelper has pages unlocked every
+ * query parses the file again
+ */
+class MapsSnapshot {
+public:
+  static std::shared_ptr<const MapsSnapshot> Get(bool refresh = false, bool *created = nullptr);
+
+  /*
+   * The cached snapshot if it is still current, never parses
+   */
+  static std::shared_ptr<const MapsSnapshot> Cached();
+
+  static void Invalidate();
+
+  size_t size() const { return entries_.size(); }
+
+  const MapsEntry &operator[](size_t index) const { return entries_[index]; }
+
+  const char *path(const MapsEntry &entry) const { return strings_.data() + entry.path; }
+
+  /*
+   * Index of the first entry that ends after address
+   */
+  size_t Find(Address address) const;
+
+  /*
+   * Path of the file mapping containing address and the start of the first adjacent mapping of that file,
+   * nullptr for anonymous memory. *mapped tells whether address is inside any mapping of the snapshot
+   */
+  const char *FindFile(Address address, Address *base, bool *mapped = nullptr) const;
+
+private:
+  MapsSnapshot() = default;
+
+  bool Load();
+
+  std::vector<MapsEntry> entries_;
+  std::string strings_;
+  uint32_t generation_ = 0;
+};
+
 class MapsHelper {
 public:
   using iterator = std::vector<PageProtect>::iterator;
   using const_iterator = std::vector<PageProtect>::const_iterator;
-  MapsHelper() = default;
+  MapsHelper();
 
   ~MapsHelper();
 
@@ -62,10 +123,35 @@ public:
 
   std::string ToString() const;
 
+  /*
+   * Use protections resolved by an earlier query instead of reading maps, only for memory whose mapping and
+   * protection are known not to change in between
+   */
+  void SetPageProtect(const PageProtect *pages, size_t count);
+
   bool UnlockPageProtect(MapsProt prot = MapsProt::kMPReadWrite);
 
   bool RecoveryPageProtect();
 
+  /*
+   * Number of mprotect calls made by this helper, adjacent mappings are changed together
+   */
+  uint32_t MprotectCount() const { return mprotect_count_; }
+
+  /*
+   * Drop the shared maps snapshot, required after memory was mapped or protected outside of fake-linker
+   */
+  static void Refresh() { MapsSnapshot::Invalidate(); }
+
+  /*
+   * Whether the PROCMAP_QUERY ioctl (Linux 6.11+) answers address queries, GetMemoryProtect and
+   * CheckAddressPageProtect fall back to the text parser without it. Lookups by library name always use the
+   * snapshot, they visit every mapping anyway. Disabling is mainly for comparison tests
+   */
+  static bool SupportProcmapQuery();
+
+  static void SetProcmapQueryEnabled(bool enable);
+
   operator bool() const { return !pages_.empty(); }
 
   bool empty() const { return pages_.empty(); }
@@ -81,16 +167,22 @@ public:
 private:
   bool GetMapsLine();
 
-  bool FormatLine();
+  bool MatchPath();
 
-  int FormatProtect();
+  bool OpenMaps(bool refresh = false);
 
-  bool MatchPath();
+  bool OpenProcmap(Address address);
 
-  bool OpenMaps();
+  bool NextProcmapVma();
 
   void CloseMaps();
 
+  void EndUnlock();
+
+  void AddPage();
+
+  const char *InternPath(const char *path);
+
   bool ReadLibraryMap();
 
   bool MakeLibraryName(const char *library_name);
@@ -98,10 +190,20 @@ private:
   bool VerifyLibraryMap();
 
 private:
-  char line_[4096 + 256 + 1]{};
-  char path_[1024]{};
-  char protect_[5]{'\0'};
-  FILE *maps_fd_ = nullptr;
+  std::shared_ptr<const MapsSnapshot> snapshot_;
+  // The current snapshot was parsed by this query, a miss does not need another parse
+  bool snapshot_created_ = false;
+  size_t cursor_ = 0;
+  // When the ioctl backend is open GetMapsLine walks the kernel VMAs starting at procmap_next_
+  int procmap_fd_ = -1;
+  Address procmap_next_ = 0;
+  // Records, paths and buffers are borrowed from a process-wide pool of arenas and returned on destruction,
+  // an arena allocated while the pool is empty is freed instead once the pool is full
+  MapsArena *arena_;
+  bool unlocked_ = false;
+  uint32_t mprotect_count_ = 0;
+  const char *path_ = "";
+  int protect_ = kMPNone;
   std::string library_name_;
   Address start_address_ = 0;
   Address end_address_ = 0;
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <pthread.h>
+
+#include <atomic>
 #include <cstdint>
 #include <map>
 #include <string>
 
+#include "trace_epoch.h"
+
 namespace fakelinker {
 class SymbolResolver {
 public:
@@ -16,15 +21,40 @@ public:
     uintptr_t offset = UINTPTR_MAX;
     // Library name
     const char *name;
+    // Nearest function symbol at or before the address, nullptr if unknown or function symbols are disabled
+    const char *symbol = nullptr;
+    // Offset of the current address relative to the symbol
+    uintptr_t symbol_offset = 0;
   };
 
+  /**
+   * Formatted addresses kept by the cache when function symbols are enabled, an address replaces the one in its slot
+   */
+  static constexpr size_t kFormatCacheSize = 1024;
+
+  SymbolResolver() = default;
+
+  ~SymbolResolver();
+
+  SymbolResolver(const SymbolResolver &) = delete;
+
+  SymbolResolver &operator=(const SymbolResolver &) = delete;
+
   bool AddLibrary(const std::string &name);
 
   bool AddAddressRange(const std::string &name, uintptr_t start, uintptr_t end);
 
+  /**
+   * @brief Resolve addresses to the nearest function symbol from .dynsym, .symtab and .gnu_debugdata.
+   * The symbols of a library are read on its first query without holding a lock, formatted results are cached
+   * and read without locks
+   */
+  void SetFunctionSymbols(bool enable) { function_symbols_.store(enable, std::memory_order_relaxed); }
+
   /**
    * @brief Format address as follows:
    *         head address [library_name!offset]
+   *         head address [library_name!function+offset] with function symbols
    *
    * @param  address        Address to be formatted
    * @param  default_format Whether to format as head address if not in monitoring range
@@ -66,15 +96,38 @@ public:
   }
 
 private:
+  struct FunctionTable;
+
+  struct FormatEntry {
+    uintptr_t address;
+    std::string location;
+  };
+
   struct LibraryItem {
-    uintptr_t start;
-    uintptr_t end;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
     std::string name;
+    // Published once by the first thread that finished reading it, never replaced
+    std::atomic<const FunctionTable *> functions{nullptr};
+
+    ~LibraryItem();
   };
 
   LibraryItem *FindLibrary(uintptr_t address);
 
+  static const FunctionTable *LoadFunctionTable(const char *library);
+
+  const char *FindFunction(LibraryItem *item, uintptr_t address, uintptr_t &offset);
+
+  // The "library!function+offset" part of the formatted address, valid while the caller holds a ReadGuard
+  const std::string &FormatLocation(LibraryItem *item, uintptr_t address);
 
   std::map<uintptr_t, LibraryItem> libraries_;
+  std::atomic<bool> function_symbols_{false};
+  // Entries are immutable, a replaced entry is freed once no reader holds a ReadGuard of its epoch
+  std::atomic<const FormatEntry *> format_cache_[kFormatCacheSize]{};
+  pthread_mutex_t retired_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  // Protected by retired_mutex_
+  TraceRetireList<FormatEntry> retired_entries_;
 };
 } // namespace fakelinker
\ No newline at end of file
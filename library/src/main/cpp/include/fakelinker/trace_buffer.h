@@ -0,0 +1,103 @@
+//
+// Binary records of traced JNI calls, collected in per-thread rings and drained by a background thread
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fakelinker {
+
+/**
+ * @brief Type of a value stored in a TraceRecord, decides how it is formatted afterwards
+ */
+enum TraceValueType : uint8_t {
+  kTVNone = 0,
+  kTVInt,      /**< Signed integer */
+  kTVUnsigned, /**< Unsigned integer, jboolean and jchar */
+  kTVFloat,    /**< jfloat, the bits are stored in the low 32 bits */
+  kTVDouble,   /**< jdouble bits */
+  kTVPointer,  /**< Any other pointer */
+  kTVObject,   /**< jobject and its subclasses except the following */
+  kTVClass,    /**< jclass */
+  kTVString,   /**< jstring */
+  kTVMethodID, /**< jmethodID */
+  kTVFieldID,  /**< jfieldID */
+  kTVCString,  /**< const char *, only the pointer is recorded */
+  kTVVaList,   /**< va_list, not recorded */
+};
+
+/**
+ * @brief One traced JNI call
+ *
+ * Only raw values are recorded, local references are no longer valid when the record is formatted
+ * so objects can only be shown as handles
+ */
+struct TraceRecord {
+  uint64_t timestamp_ns; /**< CLOCK_MONOTONIC time after the call returned */
+  uint64_t caller;       /**< Return address of the JNI call */
+  uint64_t result;       /**< Return value */
+  uint64_t args[4];      /**< The first four arguments after JNIEnv */
+  uint32_t tid;          /**< Calling thread */
+  uint8_t function;      /**< Index of the function in JNINativeInterface */
+  uint8_t result_type;   /**< TraceValueType of result */
+  uint16_t arg_types;    /**< TraceValueType of each argument, 4 bits each starting from the low bits */
+
+  TraceValueType ArgType(int index) const { return static_cast<TraceValueType>((arg_types >> (index * 4)) & 0xf); }
+};
+
+static_assert(sizeof(TraceRecord) == 64, "TraceRecord must stay one cache line");
+
+/**
+ * @brief Name of the JNINativeInterface function at index, nullptr for reserved or invalid indexes
+ */
+const char *GetJNIFunctionName(size_t index);
+
+/**
+ * @brief Index of the named function in JNINativeInterface, -1 if there is no such function
+ */
+int FindJNIFunctionIndex(const char *name);
+
+/**
+ * @brief Receives drained records on the drain thread, records of one thread are in order
+ */
+using TraceRecordSink = void (*)(const TraceRecord *records, size_t count, void *opaque);
+
+class TraceBuffer {
+public:
+  /**
+   * Records each thread can hold before the drain thread catches up, further records are dropped
+   */
+  static constexpr size_t kRingCapacity = 4096;
+
+  /**
+   * @brief Start the drain thread, it wakes up every interval_ms and passes all pending records to sink
+   */
+  static bool Start(TraceRecordSink sink, void *opaque, uint32_t interval_ms = 20);
+
+  /**
+   * @brief Stop the drain thread after the pending records were passed to the sink
+   */
+  static void Stop();
+
+  static bool IsRunning();
+
+  /**
+   * @brief Append a record to the ring of the calling thread, never blocks
+   *
+   * @return false if the record was dropped because the ring is full or no drain thread is running
+   */
+  static bool Record(const TraceRecord &record);
+
+  /**
+   * @brief Records dropped since the process started
+   */
+  static uint64_t DroppedRecords();
+
+  /**
+   * @brief Records passed to a sink since the process started
+   */
+  static uint64_t DrainedRecords();
+};
+
+} // namespace fakelinker
@@ -0,0 +1,89 @@
+//
+// Aggregated JNI call graph: caller, JNI function and the Java method or field it works on
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "trace_buffer.h"
+
+namespace fakelinker {
+
+/**
+ * @brief The jmethodID or jfieldID argument of a JNI call, type kTVNone if the function has none
+ */
+struct TraceMember {
+  TraceValueType type;
+  uint64_t value;
+};
+
+struct TraceCallGraphEntry {
+  uint64_t caller;        /**< Return address of the JNI call */
+  TraceMember member;     /**< Java method or field */
+  uint8_t function;       /**< Index of the function in JNINativeInterface */
+  uint64_t count;         /**< Number of calls */
+  uint64_t total_ns;      /**< Cumulative duration of the original calls */
+};
+
+/**
+ * @brief Describes a jmethodID or jfieldID for reports, the result must stay valid during the dump
+ */
+using TraceMemberDescriber = const char *(*)(TraceMember member, void *opaque);
+
+/**
+ * @brief Counts calls per (caller pc, JNI function, jmethodID/jfieldID) in one concurrent hash table
+ *
+ * A call costs one hash probe and two relaxed atomic adds on the slot of its tuple. Slots are
+ * claimed once and never moved, callers can group them by library when reporting.
+ */
+class TraceCallGraph {
+public:
+  /**
+   * Distinct tuples that can be counted, later tuples are counted as overflow
+   */
+  static constexpr size_t kCapacity = 16384;
+
+  static void SetEnabled(bool enable);
+
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  static void Record(size_t function_index, const void *caller, TraceMember member, uint64_t duration_ns);
+
+  /**
+   * @brief Tuples with at least one call since the last reset. A tuple first recorded by racing threads
+   * may be split over two entries
+   */
+  static std::vector<TraceCallGraphEntry> Snapshot();
+
+  /**
+   * @brief Set all counters to zero, the claimed slots are kept
+   */
+  static void Reset();
+
+  static uint64_t Overflow();
+
+  /**
+   * @brief The top_n tuples by count as a text table, callers are grouped by library when by_library is set
+   *
+   * @param describe Describes the Java members, nullptr prints the raw ids
+   */
+  static std::string DumpTop(size_t top_n, bool by_library, TraceMemberDescriber describe, void *opaque);
+
+  /**
+   * @brief Write "caller;function;member count" lines, the folded stack input of flamegraph.pl and speedscope
+   *
+   * @param weight_by_time Use the cumulative nanoseconds as the weight instead of the call count
+   */
+  static bool WriteFolded(const char *path, bool by_library, bool weight_by_time, TraceMemberDescriber describe,
+                          void *opaque);
+
+private:
+  static std::atomic<bool> enabled_;
+};
+
+} // namespace fakelinker
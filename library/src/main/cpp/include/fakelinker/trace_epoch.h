@@ -0,0 +1,91 @@
+//
+// Epoch based reclamation of the immutable tables that tracing threads read without locks
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace fakelinker {
+
+struct TraceEpochSlot;
+
+/**
+ * @brief Decides when a table that was replaced is no longer read by any thread
+ *
+ * A reader announces the global epoch in its own slot while it holds a ReadGuard, before it loads
+ * the published pointer. A writer swaps the pointer first, then Advance returns the epoch to tag the
+ * old table with. The table can be freed once every thread inside a ReadGuard announces a later
+ * epoch. Readers only write their own slot, writers scan all slots under a lock.
+ */
+class TraceEpoch {
+public:
+  class ReadGuard {
+  public:
+    ReadGuard();
+
+    ~ReadGuard();
+
+    ReadGuard(const ReadGuard &) = delete;
+
+    ReadGuard &operator=(const ReadGuard &) = delete;
+
+  private:
+    TraceEpochSlot *slot_;
+  };
+
+  /**
+   * @brief Move to the next epoch after a table was unpublished
+   *
+   * @return The epoch the unpublished table is tagged with
+   */
+  static uint64_t Advance();
+
+  /**
+   * @brief The oldest epoch announced by a thread inside a ReadGuard, UINT64_MAX if there is none
+   */
+  static uint64_t OldestActive();
+};
+
+/**
+ * @brief Tables unpublished by one writer, each freed once the readers moved past its epoch
+ *
+ * Not thread safe, callers hold the lock of the writer side.
+ */
+template <typename T>
+class TraceRetireList {
+public:
+  /**
+   * @brief Take ownership of a table that was just unpublished and free the tables no thread reads any more
+   */
+  void Retire(const T *table) {
+    if (table != nullptr) {
+      items_.emplace_back(TraceEpoch::Advance(), std::unique_ptr<const T>(table));
+    }
+    Reclaim();
+  }
+
+  void Reclaim() {
+    if (items_.empty()) {
+      return;
+    }
+    uint64_t oldest = TraceEpoch::OldestActive();
+    items_.erase(std::remove_if(items_.begin(), items_.end(), [oldest](const auto &item) { return item.first < oldest; }),
+                 items_.end());
+  }
+
+  /**
+   * @brief Tables still waiting for a reader
+   */
+  size_t Pending() const { return items_.size(); }
+
+private:
+  std::vector<std::pair<uint64_t, std::unique_ptr<const T>>> items_;
+};
+
+} // namespace fakelinker
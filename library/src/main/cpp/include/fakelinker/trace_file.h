@@ -0,0 +1,115 @@
+//
+// Compact append-only trace file for drained JNI trace records, decode it with tools/jni_trace_decoder.py
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bitset>
+#include <string>
+#include <unordered_map>
+
+#include "macros.h"
+#include "trace_buffer.h"
+#include "trace_sampler.h"
+
+namespace fakelinker {
+
+/**
+ * @brief Chunk tags of the trace file, every chunk starts with one tag byte followed by LEB128 varints
+ *
+ * The file starts with TraceFileHeader. A zero tag marks the end, it is also what the decoder
+ * finds after the last complete chunk if the process died before the file was closed.
+ */
+enum TraceFileTag : uint8_t {
+  kTFEnd = 0,
+  kTFString = 1,     /**< id, length, bytes */
+  kTFFunction = 2,   /**< function index, string id of its name */
+  kTFSymbol = 3,     /**< TraceValueType, value, string id. Describes a caller, jmethodID or jfieldID value */
+  kTFEvent = 4,      /**< zigzag timestamp delta, tid, function byte, result type byte, argument types, caller,
+                        the arguments and the result, kTVInt values are zigzag encoded */
+  kTFDropped = 5,    /**< number of records dropped before the following events */
+  kTFSuppressed = 6, /**< calls suppressed by TraceSampler since the last report: sampled, caller and global limited */
+};
+
+struct TraceFileHeader {
+  char magic[4];          /**< "FLJT" */
+  uint16_t version;       /**< kVersion */
+  uint16_t header_size;   /**< sizeof(TraceFileHeader) */
+  uint64_t start_ns;      /**< CLOCK_MONOTONIC when the file was opened, base of the first timestamp delta */
+  uint64_t start_wall_ns; /**< CLOCK_REALTIME at the same time */
+
+  static constexpr uint16_t kVersion = 1;
+};
+
+static_assert(sizeof(TraceFileHeader) == 24, "TraceFileHeader layout is part of the file format");
+
+/**
+ * @brief Writes trace records into a mmapped file
+ *
+ * Strings such as the function names, caller symbols and method or field descriptions are written
+ * once and referenced by id afterwards, timestamps are stored as deltas and all integers as varints,
+ * a typical event takes 15 to 30 bytes. Only one thread may write, normally the drain thread of TraceBuffer.
+ */
+class TraceFileWriter {
+public:
+  TraceFileWriter() = default;
+  ~TraceFileWriter() { Close(); }
+
+  /**
+   * @brief Create or truncate path, reserve bytes are mapped up front and the mapping grows on demand
+   */
+  bool Open(const char *path, size_t reserve = 4 * 1024 * 1024);
+
+  /**
+   * @brief Truncate the file to the written size and unmap it
+   */
+  void Close();
+
+  bool IsOpen() const { return data_ != nullptr; }
+
+  /**
+   * @brief Whether a description was already written for the value of the given type
+   */
+  bool HasSymbol(TraceValueType type, uint64_t value) const;
+
+  /**
+   * @brief Describe a caller address (kTVPointer), jmethodID or jfieldID value.
+   * Method and field descriptions are deduplicated by content, desc is copied
+   */
+  bool AddSymbol(TraceValueType type, uint64_t value, const char *desc);
+
+  bool WriteRecord(const TraceRecord &record);
+
+  bool WriteDropped(uint64_t count);
+
+  bool WriteSuppressed(const TraceSuppressedCounts &counts);
+
+  /**
+   * @brief Bytes written including the header
+   */
+  size_t Size() const { return size_; }
+
+  uint64_t Events() const { return events_; }
+
+private:
+  uint32_t AddString(const char *str, size_t length);
+  bool Reserve(size_t length);
+  void PutVarint(uint64_t value);
+
+  int fd_ = -1;
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+  uint64_t last_timestamp_ = 0;
+  uint64_t events_ = 0;
+  uint32_t next_string_id_ = 1;
+  std::bitset<256> functions_;
+  std::unordered_map<std::string, uint32_t> strings_;
+  std::unordered_map<uint64_t, uint32_t> symbols_[3];
+
+  DISALLOW_COPY_AND_ASSIGN(TraceFileWriter);
+};
+
+} // namespace fakelinker
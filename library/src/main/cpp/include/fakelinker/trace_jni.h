@@ -4,9 +4,17 @@
 #pragma once
 
 #include <cinttypes>
+#include <cstdarg>
+#include <cstring>
 #include <jni.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <memory>
 #include <string_view>
 #include <type_traits>
 #include <vector>
@@ -15,7 +23,14 @@
 #include "jni_helper.h"
 #include "macros.h"
 #include "proxy_jni.h"
+#include "scoped_local_ref.h"
 #include "symbol_resolver.h"
+#include "trace_buffer.h"
+#include "trace_callgraph.h"
+#include "trace_epoch.h"
+#include "trace_file.h"
+#include "trace_latency.h"
+#include "trace_sampler.h"
 #include "type.h"
 
 
@@ -30,6 +45,69 @@ struct _is_valid_container<
     : std::is_same<typename T::value_type, size_t> {};
 
 
+/**
+ * @brief Formatting buffer of a trace context, taken from a per-thread arena on the first line
+ *
+ * Contexts only live on the stack, so the buffers are released in reverse order and the arena is
+ * a bump allocator. Nested contexts beyond the arena fall back to malloc.
+ */
+class TraceMessage {
+public:
+  static constexpr uint32_t kCapacity = 4096;
+
+  TraceMessage() = default;
+
+  ~TraceMessage() {
+    if (data_ != nullptr) {
+      ReleaseBuffer(data_);
+    }
+  }
+
+  bool empty() const { return length_ == 0; }
+
+  uint32_t length() const { return length_; }
+
+  /**
+   * @brief Append the formatted line and a line break, the rest of a too long message is cut off
+   */
+  void AppendLine(const char *format, va_list args) {
+    if (data_ == nullptr) {
+      data_ = AcquireBuffer();
+      if (data_ == nullptr) {
+        return;
+      }
+    }
+    // One byte is kept for the terminator added by Finish
+    if (length_ < kCapacity - 1) {
+      int len = vsnprintf(data_ + length_, kCapacity - 1 - length_, format, args);
+      if (len > 0) {
+        length_ = std::min<uint32_t>(length_ + len, kCapacity - 2);
+      }
+      data_[length_++] = '\n';
+    }
+  }
+
+  /**
+   * @brief Null terminated message
+   */
+  std::string_view Finish() {
+    if (data_ == nullptr) {
+      return std::string_view("", 0);
+    }
+    data_[length_] = '\0';
+    return std::string_view(data_, length_);
+  }
+
+private:
+  static char *AcquireBuffer();
+  static void ReleaseBuffer(char *buffer);
+
+  char *data_ = nullptr;
+  uint32_t length_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceMessage);
+};
+
 /**
  * @struct TraceInvokeContext
  * @brief Context structure for tracing JNI method invocations.
@@ -43,8 +121,8 @@ struct _is_valid_container<
  * - caller: Address of the entity invoking the JNI method.
  * - result: The result type of the JNI call, if applicable.
  * - method: The JNI method ID, used when the method has variable arguments.
- * - message: Buffer to store trace or debug messages (up to 4096 characters).
- * - message_length: The current length of the message stored in the buffer.
+ * - message: Lines formatted so far, the buffer is only taken when the first line is formatted,
+ *   so callbacks that do not log keep the context at a few words.
  *
  * Constructor:
  * - Initializes the context with the given result type, JNI environment, and caller address.
@@ -61,8 +139,7 @@ struct TraceInvokeContext {
   // Specific method when there are variable arguments va_list
   jmethodID method;
   // Store messages
-  char message[4096];
-  uint32_t message_length = 0;
+  TraceMessage message;
 
   TraceInvokeContext(jtype result, JNIEnv *env, void *caller) :
       env(env), caller(caller), result(result), method(nullptr) {}
@@ -75,8 +152,7 @@ struct TraceInvokeContext<void, true> {
   // Caller's address
   void *caller;
   jmethodID method;
-  char message[4096];
-  uint32_t message_length = 0;
+  TraceMessage message;
 
   TraceInvokeContext(JNIEnv *env, void *caller) : env(env), caller(caller), method(nullptr) {}
 };
@@ -108,8 +184,177 @@ extern JNINativeInterface hook_jni;
 extern void *monitor;
 extern void *callback;
 extern JNIEnv org_env;
+// Private writable copy of the function table, installed per thread through env->functions
+extern JNINativeInterface shadow_jni;
+// The table ART installed in env->functions before tracing
+extern const JNINativeInterface *art_jni;
+extern JNIInvokeInterface shadow_invoke;
+extern const JNIInvokeInterface *art_invoke;
+// Non-null value for threads that opted out of the shadow table
+extern pthread_key_t opt_out_key;
+// Monitored calls are recorded into TraceBuffer instead of being formatted on the calling thread
+extern std::atomic<bool> async_trace;
+// One bit per JNINativeInterface slot, hooked functions whose bit is clear call the original function directly
+extern std::atomic<uint64_t> enabled_functions[4];
+static_assert(sizeof(JNINativeInterface) / sizeof(void *) <= 4 * 64, "enabled_functions has a bit per function");
+
+inline bool IsFunctionEnabled(size_t index) {
+  return (enabled_functions[index / 64].load(std::memory_order_relaxed) >> (index % 64)) & 1;
+}
 } // namespace jni_trace
 
+struct TraceVoid {};
+
+template <typename T>
+constexpr TraceValueType TraceValueTypeOf() {
+  using V = std::remove_cv_t<std::remove_reference_t<T>>;
+  if constexpr (std::is_same_v<V, jmethodID>) {
+    return kTVMethodID;
+  } else if constexpr (std::is_same_v<V, jfieldID>) {
+    return kTVFieldID;
+  } else if constexpr (std::is_same_v<V, jclass>) {
+    return kTVClass;
+  } else if constexpr (std::is_same_v<V, jstring>) {
+    return kTVString;
+  } else if constexpr (std::is_convertible_v<V, jobject> && !std::is_same_v<V, std::nullptr_t>) {
+    return kTVObject;
+  } else if constexpr (std::is_same_v<V, const char *> || std::is_same_v<V, char *>) {
+    return kTVCString;
+  } else if constexpr (std::is_same_v<V, jfloat>) {
+    return kTVFloat;
+  } else if constexpr (std::is_same_v<V, jdouble>) {
+    return kTVDouble;
+  } else if constexpr (std::is_integral_v<V>) {
+    return std::is_signed_v<V> ? kTVInt : kTVUnsigned;
+  } else if constexpr (std::is_enum_v<V>) {
+    return kTVInt;
+  } else if constexpr (std::is_pointer_v<V>) {
+    return kTVPointer;
+  } else {
+    return kTVNone;
+  }
+}
+
+template <typename T>
+inline uint64_t TraceWordOf(const T &value) {
+  using V = std::remove_cv_t<std::remove_reference_t<T>>;
+  if constexpr (std::is_same_v<V, jfloat>) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  } else if constexpr (std::is_same_v<V, jdouble>) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  } else if constexpr (std::is_integral_v<V> || std::is_enum_v<V>) {
+    return static_cast<uint64_t>(static_cast<int64_t>(value));
+  } else if constexpr (std::is_pointer_v<V>) {
+    return reinterpret_cast<uintptr_t>(value);
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * @brief Record a monitored call with its raw values, nothing is formatted on the calling thread
+ */
+template <typename Ret, typename... Args>
+inline void RecordJNICall(size_t offset, void *caller, const Ret &result, const Args &...args) {
+  static thread_local uint32_t tid = 0;
+  if (__predict_false(tid == 0)) {
+    tid = static_cast<uint32_t>(gettid());
+  }
+  TraceRecord record{};
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record.timestamp_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+  record.caller = reinterpret_cast<uintptr_t>(caller);
+  record.tid = tid;
+  record.function = static_cast<uint8_t>(offset / sizeof(void *));
+  if constexpr (!std::is_same_v<Ret, TraceVoid>) {
+    record.result = TraceWordOf(result);
+    record.result_type = TraceValueTypeOf<Ret>();
+  }
+  if constexpr (sizeof...(Args) > 0) {
+    const uint64_t words[] = {TraceWordOf(args)...};
+    const TraceValueType types[] = {TraceValueTypeOf<Args>()...};
+    for (size_t i = 0; i < sizeof...(Args) && i < 4; ++i) {
+      record.args[i] = words[i];
+      record.arg_types |= static_cast<uint16_t>(types[i] << (i * 4));
+    }
+  }
+  TraceBuffer::Record(record);
+}
+
+/**
+ * @brief The first jmethodID or jfieldID argument, the Java member a call graph entry is keyed by
+ */
+template <typename... Args>
+inline TraceMember TraceMemberOf(const Args &...args) {
+  TraceMember member{kTVNone, 0};
+  if constexpr (sizeof...(Args) > 0) {
+    auto pick = [&member](auto &&value) {
+      constexpr TraceValueType type = TraceValueTypeOf<decltype(value)>();
+      if constexpr (type == kTVMethodID || type == kTVFieldID) {
+        if (member.type == kTVNone) {
+          member = TraceMember{type, TraceWordOf(value)};
+        }
+      }
+    };
+    (pick(args), ...);
+  }
+  return member;
+}
+
+// Durations are recorded for every intercepted call, independent of the address filter
+#define MONITOR_LATENCY_END(name, ...)                                                                                 \
+  if (latency_start != 0) {                                                                                            \
+    uint64_t latency = TraceLatencyStats::End(offsetof(JNINativeInterface, name) / sizeof(void *),                    \
+                                              __builtin_return_address(0), latency_start);                             \
+    if (TraceCallGraph::IsEnabled()) {                                                                                 \
+      TraceCallGraph::Record(offsetof(JNINativeInterface, name) / sizeof(void *), __builtin_return_address(0),         \
+                             TraceMemberOf(__VA_ARGS__), latency);                                                     \
+    }                                                                                                                  \
+  }
+
+// The address filter first, then the member filter, the sampler only sees monitored calls
+#define MONITOR_SHOULD_TRACE(name, ...)                                                                                \
+  (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0)) &&           \
+   reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsTracingMember(TraceMemberOf(__VA_ARGS__)) &&         \
+   TraceSampler::Admit(offsetof(JNINativeInterface, name) / sizeof(void *), __builtin_return_address(0)))
+
+// Checked first in every hook, a disabled function costs one relaxed load on top of the original call.
+// hooked is the slot the hook is installed in, the variadic trampolines forward to the va_list function name
+#define MONITOR_PASS_THROUGH_AS(hooked, name, ...)                                                                     \
+  if (__predict_false(!jni_trace::IsFunctionEnabled(offsetof(JNINativeInterface, hooked) / sizeof(void *)))) {         \
+    return jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                                  \
+  }
+
+#define MONITOR_PASS_THROUGH(name, ...) MONITOR_PASS_THROUGH_AS(name, name, ##__VA_ARGS__)
+
+#define MONITOR_RECORD_ASYNC(name, result, ...)                                                                        \
+  if (jni_trace::async_trace.load(std::memory_order_relaxed)) {                                                        \
+    RecordJNICall(offsetof(JNINativeInterface, name), __builtin_return_address(0), result, ##__VA_ARGS__);             \
+    return result;                                                                                                     \
+  }
+
+#define MONITOR_VOID_RECORD_ASYNC(name, ...)                                                                           \
+  if (jni_trace::async_trace.load(std::memory_order_relaxed)) {                                                        \
+    RecordJNICall(offsetof(JNINativeInterface, name), __builtin_return_address(0), TraceVoid{}, ##__VA_ARGS__);        \
+    return;                                                                                                            \
+  }
+
+enum class JNITraceMode {
+  /**
+   * Patch the function pointers of ART's JNINativeInterface, affects all threads and requires mprotect
+   */
+  kPatchTable,
+  /**
+   * Swap env->functions to a private copy of the table, only threads that installed it are traced
+   */
+  kShadowTable,
+};
+
 struct ScopedVAArgs {
   explicit ScopedVAArgs(va_list *args) : args(args) {}
 
@@ -123,9 +368,14 @@ private:
   va_list *args;
 };
 
-#define MONITOR_CALL(name, ...)                                                                                        \
+#define MONITOR_CALL_AS(hooked, name, ...)                                                                             \
+  MONITOR_PASS_THROUGH_AS(hooked, name, ##__VA_ARGS__)                                                                 \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   auto result = jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                             \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_RECORD_ASYNC(name, result, ##__VA_ARGS__)                                                                  \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<return_type_object_trait_t<decltype(&JNIEnv::name)>> context(                                   \
       result, reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                                          \
     reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                    \
@@ -133,12 +383,19 @@ private:
   }                                                                                                                    \
   return result;
 
+#define MONITOR_CALL(name, ...) MONITOR_CALL_AS(name, name, ##__VA_ARGS__)
+
 #define MONITOR_CALL_VA_LIST(name, methodID, args, ...)                                                                \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__, args)                                                                      \
   va_list args_copy;                                                                                                   \
   va_copy(args_copy, args);                                                                                            \
   ScopedVAArgs scoped_args(&args_copy);                                                                                \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   auto result = jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__, args);                       \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_RECORD_ASYNC(name, result, ##__VA_ARGS__)                                                                  \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<return_type_object_trait_t<decltype(&JNIEnv::name)>> context(                                   \
       result, reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                                          \
     context.method = methodID;                                                                                         \
@@ -148,8 +405,13 @@ private:
   return result;
 
 #define MONITOR_CALL_INVOKE(name, methodID, ...)                                                                       \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__)                                                                            \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   auto result = jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                             \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_RECORD_ASYNC(name, result, ##__VA_ARGS__)                                                                  \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<return_type_object_trait_t<decltype(&JNIEnv::name)>> context(                                   \
       result, reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                                          \
     context.method = methodID;                                                                                         \
@@ -160,8 +422,13 @@ private:
 
 
 #define MONITOR_CALL_INVALID_ARGS(name, ...)                                                                           \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__)                                                                            \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   auto result = jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                             \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_RECORD_ASYNC(name, result, ##__VA_ARGS__)                                                                  \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<return_type_object_trait_t<decltype(&JNIEnv::name)>, false> context(                            \
       result, reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                                          \
     reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                    \
@@ -170,38 +437,63 @@ private:
   return result;
 
 
-#define MONITOR_VOID_CALL(name, ...)                                                                                   \
+#define MONITOR_VOID_CALL_AS(hooked, name, ...)                                                                        \
+  MONITOR_PASS_THROUGH_AS(hooked, name, ##__VA_ARGS__)                                                                 \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                                           \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_VOID_RECORD_ASYNC(name, ##__VA_ARGS__)                                                                     \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<void> context(reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                   \
     reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                    \
   }
 
+#define MONITOR_VOID_CALL(name, ...) MONITOR_VOID_CALL_AS(name, name, ##__VA_ARGS__)
+
 #define MONITOR_VOID_CALL_INVOKE(name, methodID, ...)                                                                  \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__)                                                                            \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                                           \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_VOID_RECORD_ASYNC(name, ##__VA_ARGS__)                                                                     \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<void> context(reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                   \
     context.method = methodID;                                                                                         \
     reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                    \
   }
 
 #define MONITOR_VOID_CALL_VA_LIST(name, methodID, args, ...)                                                           \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__, args)                                                                      \
   va_list args_copy;                                                                                                   \
   va_copy(args_copy, args);                                                                                            \
   ScopedVAArgs scoped_args(&args_copy);                                                                                \
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
   jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__, args);                                     \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)                                                                             \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    MONITOR_VOID_RECORD_ASYNC(name, ##__VA_ARGS__)                                                                     \
+    TraceEpoch::ReadGuard epoch_guard;                                                                                 \
     TraceInvokeContext<void> context(reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                   \
     context.method = methodID;                                                                                         \
     reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__, args_copy);                         \
   }
 
 #define MONITOR_VOID_CALL_AFTER(name, ...)                                                                             \
-  if (reinterpret_cast<JNIMonitor<Derived> *>(jni_trace::monitor)->IsMonitoring(__builtin_return_address(0))) {        \
-    TraceInvokeContext<void> context(reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                   \
-    reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                    \
+  MONITOR_PASS_THROUGH(name, ##__VA_ARGS__)                                                                            \
+  if (MONITOR_SHOULD_TRACE(name, ##__VA_ARGS__)) {                                                                     \
+    if (jni_trace::async_trace.load(std::memory_order_relaxed)) {                                                      \
+      RecordJNICall(offsetof(JNINativeInterface, name), __builtin_return_address(0), TraceVoid{}, ##__VA_ARGS__);      \
+    } else {                                                                                                           \
+      TraceEpoch::ReadGuard epoch_guard;                                                                               \
+      TraceInvokeContext<void> context(reinterpret_cast<JNIEnv *>(this), __builtin_return_address(0));                 \
+      reinterpret_cast<Derived *>(jni_trace::callback)->name(context, ##__VA_ARGS__);                                  \
+    }                                                                                                                  \
   }                                                                                                                    \
-  jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);
+  const uint64_t latency_start = TraceLatencyStats::Begin();                                                           \
+  jni_trace::org_jni->name(reinterpret_cast<JNIEnv *>(this), ##__VA_ARGS__);                                           \
+  MONITOR_LATENCY_END(name, ##__VA_ARGS__)
 
 
 template <typename From, typename To>
@@ -523,7 +815,7 @@ private:
     va_list args;
     va_start(args, methodID);
     ScopedVAArgs scoped_args(&args);
-    MONITOR_CALL(NewObjectV, clazz, methodID, args);
+    MONITOR_CALL_AS(NewObject, NewObjectV, clazz, methodID, args);
   }
 
   jobject NewObjectV(jclass clazz, jmethodID methodID, va_list args) {
@@ -547,7 +839,7 @@ private:
     va_list args;                                                                                                      \
     va_start(args, methodID);                                                                                          \
     ScopedVAArgs scoped_args(&args);                                                                                   \
-    MONITOR_CALL(Call##_jname##MethodV, obj, methodID, args)                                                           \
+    MONITOR_CALL_AS(Call##_jname##Method, Call##_jname##MethodV, obj, methodID, args)                                  \
   }
 
 #define PROXY_CALL_TYPE_METHODV(_jtype, _jname)                                                                        \
@@ -587,7 +879,7 @@ private:
     va_list args;
     va_start(args, methodID);
     ScopedVAArgs scoped_args(&args);
-    MONITOR_VOID_CALL(CallVoidMethodV, obj, methodID, args);
+    MONITOR_VOID_CALL_AS(CallVoidMethod, CallVoidMethodV, obj, methodID, args);
   }
 
   void CallVoidMethodV(jobject obj, jmethodID methodID, va_list args) {
@@ -603,7 +895,7 @@ private:
     va_list args;                                                                                                      \
     va_start(args, methodID);                                                                                          \
     ScopedVAArgs scoped_args(&args);                                                                                   \
-    MONITOR_CALL(CallNonvirtual##_jname##MethodV, obj, clazz, methodID, args)                                          \
+    MONITOR_CALL_AS(CallNonvirtual##_jname##Method, CallNonvirtual##_jname##MethodV, obj, clazz, methodID, args)       \
   }
 #define PROXY_CALL_NONVIRT_TYPE_METHODV(_jtype, _jname)                                                                \
   _jtype CallNonvirtual##_jname##MethodV(jobject obj, jclass clazz, jmethodID methodID, va_list args) {                \
@@ -642,7 +934,7 @@ private:
     va_list args;
     va_start(args, methodID);
     ScopedVAArgs scoped_args(&args);
-    MONITOR_VOID_CALL(CallNonvirtualVoidMethodV, obj, clazz, methodID, args);
+    MONITOR_VOID_CALL_AS(CallNonvirtualVoidMethod, CallNonvirtualVoidMethodV, obj, clazz, methodID, args);
   }
 
   void CallNonvirtualVoidMethodV(jobject obj, jclass clazz, jmethodID methodID, va_list args) {
@@ -716,7 +1008,7 @@ private:
     va_list args;                                                                                                      \
     va_start(args, methodID);                                                                                          \
     ScopedVAArgs scoped_args(&args);                                                                                   \
-    MONITOR_CALL(CallStatic##_jname##MethodV, clazz, methodID, args);                                                  \
+    MONITOR_CALL_AS(CallStatic##_jname##Method, CallStatic##_jname##MethodV, clazz, methodID, args);                   \
   }
 #define PROXY_CALL_STATIC_TYPE_METHODV(_jtype, _jname)                                                                 \
   _jtype CallStatic##_jname##MethodV(jclass clazz, jmethodID methodID, va_list args) {                                 \
@@ -754,7 +1046,7 @@ private:
     va_list args;
     va_start(args, methodID);
     ScopedVAArgs scoped_args(&args);
-    MONITOR_VOID_CALL(CallStaticVoidMethodV, clazz, methodID, args);
+    MONITOR_VOID_CALL_AS(CallStaticVoidMethod, CallStaticVoidMethodV, clazz, methodID, args);
   }
 
   void CallStaticVoidMethodV(jclass clazz, jmethodID methodID, va_list args) {
@@ -1044,27 +1336,111 @@ private:
 };
 
 #undef MONITOR_CALL
+#undef MONITOR_CALL_AS
 #undef MONITOR_CALL_VA_LIST
 #undef MONITOR_CALL_INVOKE
 #undef MONITOR_CALL_INVALID_ARGS
 #undef MONITOR_VOID_CALL
+#undef MONITOR_VOID_CALL_AS
 #undef MONITOR_VOID_CALL_INVOKE
 #undef MONITOR_VOID_CALL_VA_LIST
 #undef MONITOR_VOID_CALL_AFTER
+#undef MONITOR_PASS_THROUGH
+#undef MONITOR_PASS_THROUGH_AS
+#undef MONITOR_RECORD_ASYNC
+#undef MONITOR_VOID_RECORD_ASYNC
+#undef MONITOR_SHOULD_TRACE
+#undef MONITOR_LATENCY_END
 
 template <typename Derived>
 class JNIMonitor {
 public:
   JNIMonitor() = default;
 
+  ~JNIMonitor() {
+    delete filter_.load(std::memory_order_relaxed);
+    delete member_filter_.load(std::memory_order_relaxed);
+  }
+
   static bool InitHookJNI(JNIEnv *env) {
     JNIHelper::Init(env);
     memcpy(&jni_trace::backup_jni, env->functions, sizeof(JNINativeInterface));
     ProxyJNIEnv::SetBackupFunctions(&jni_trace::backup_jni);
     jni_trace::org_jni = &jni_trace::backup_jni;
+    if (!jni_trace::art_jni) {
+      jni_trace::art_jni = env->functions;
+      memcpy(&jni_trace::shadow_jni, env->functions, sizeof(JNINativeInterface));
+      if (pthread_key_create(&jni_trace::opt_out_key, nullptr) != 0) {
+        LOGE("create jni shadow table key failed");
+        return false;
+      }
+    }
     return true;
   }
 
+  /**
+   * @brief Select how StartTrace installs the hooks, must be called before StartTrace
+   */
+  void SetTraceMode(JNITraceMode mode) { mode_ = mode; }
+
+  JNITraceMode GetTraceMode() const { return mode_; }
+
+  /**
+   * @brief Let the thread of env use the shadow table, a single pointer store
+   *
+   * @return Whether env now uses the shadow table
+   */
+  static bool AttachThread(JNIEnv *env) {
+    pthread_setspecific(jni_trace::opt_out_key, nullptr);
+    if (env->functions == jni_trace::art_jni) {
+      env->functions = &jni_trace::shadow_jni;
+    }
+    return env->functions == &jni_trace::shadow_jni;
+  }
+
+  /**
+   * @brief Switch the thread of env back to ART's table, it is also skipped by AttachAllThreads afterwards
+   */
+  static void DetachThread(JNIEnv *env) {
+    pthread_setspecific(jni_trace::opt_out_key, reinterpret_cast<void *>(1));
+    if (env->functions == &jni_trace::shadow_jni) {
+      env->functions = jni_trace::art_jni;
+    }
+  }
+
+  /**
+   * @brief Install the shadow table in every thread that gets its JNIEnv from vm afterwards
+   *
+   * The invoke interface of vm is replaced by a copy whose GetEnv, AttachCurrentThread and
+   * AttachCurrentThreadAsDaemon install the shadow table. Threads that only use the JNIEnv passed to
+   * native methods and never ask vm for it need AttachThread
+   */
+  static bool AttachAllThreads(JavaVM *vm) {
+    if (!jni_trace::art_jni) {
+      LOGE("InitHookJNI must be called before attaching the jni shadow table");
+      return false;
+    }
+    if (vm->functions != &jni_trace::shadow_invoke) {
+      jni_trace::art_invoke = vm->functions;
+      memcpy(&jni_trace::shadow_invoke, vm->functions, sizeof(JNIInvokeInterface));
+      jni_trace::shadow_invoke.GetEnv = ShadowGetEnv;
+      jni_trace::shadow_invoke.AttachCurrentThread = ShadowAttachCurrentThread;
+      jni_trace::shadow_invoke.AttachCurrentThreadAsDaemon = ShadowAttachCurrentThreadAsDaemon;
+      vm->functions = &jni_trace::shadow_invoke;
+    }
+    JNIEnv *env = nullptr;
+    return vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) == JNI_OK;
+  }
+
+  /**
+   * @brief Stop installing the shadow table for new threads, threads that already use it keep it until DetachThread
+   */
+  static void DetachAllThreads(JavaVM *vm) {
+    if (vm->functions == &jni_trace::shadow_invoke) {
+      vm->functions = jni_trace::art_invoke;
+    }
+  }
+
   template <typename T>
   bool AddTraceFunctions(const T &elem) {
     bool res = true;
@@ -1089,24 +1465,122 @@ public:
     return true;
   }
 
+  /**
+   * @brief Let StartTrace hook every JNI function, only the added trace functions start enabled and
+   * the others can be enabled later without patching the table again. Must be called before StartTrace
+   */
+  void SetHookAllFunctions(bool hook_all) { hook_all_ = hook_all; }
+
   bool StartTrace(Derived *trace_callback) {
-    if (trace_offsets_.empty()) {
+    if (trace_offsets_.empty() && !hook_all_) {
       LOGE("Trace jni items is empty");
       return false;
     }
     jni_trace::monitor = this;
     trace_callback->SetOriginalEnv(&jni_trace::org_env);
     jni_trace::callback = trace_callback;
-    std::vector<HookJniUnit> hooks;
+    std::vector<size_t> offsets;
+    if (hook_all_) {
+      for (size_t offset = offsetof(JNINativeInterface, GetVersion);
+           offset <= offsetof(JNINativeInterface, GetObjectRefType); offset += sizeof(void *)) {
+        offsets.push_back(offset);
+      }
+    } else {
+      offsets = trace_offsets_;
+    }
+    offsets.erase(std::remove_if(offsets.begin(), offsets.end(),
+                                 [this](size_t offset) {
+                                   return IsInstalled(offset / sizeof(void *)) ||
+                                          *reinterpret_cast<void **>((char *)&jni_trace::hook_jni + offset) == nullptr;
+                                 }),
+                  offsets.end());
+    if (mode_ == JNITraceMode::kShadowTable) {
+      // The shadow table is private memory, each hook is one pointer store
+      for (auto offset : offsets) {
+        *reinterpret_cast<void **>((char *)&jni_trace::shadow_jni + offset) =
+          *reinterpret_cast<void **>((char *)&jni_trace::hook_jni + offset);
+        installed_[offset / sizeof(void *)].store(true, std::memory_order_release);
+      }
+    } else if (!offsets.empty()) {
+      std::vector<HookJniUnit> hooks;
+      for (auto offset : offsets) {
+        hooks.push_back(HookJniUnit{.offset = static_cast<int>(offset),
+                                    .hook_method = reinterpret_cast<void *>(
+                                      *reinterpret_cast<uintptr_t *>(((char *)&jni_trace::hook_jni + offset))),
+                                    .backup_method = nullptr});
+      }
+      get_fakelinker()->hook_jni_native_functions(&hooks[0], static_cast<int>(hooks.size()));
+      // Only the number of written slots is returned, the table tells which hooks are in place
+      for (auto &hook : hooks) {
+        if (*reinterpret_cast<void **>((char *)jni_trace::art_jni + hook.offset) == hook.hook_method) {
+          installed_[hook.offset / sizeof(void *)].store(true, std::memory_order_release);
+        } else {
+          LOGE("hook jni function %s failed", GetJNIFunctionName(hook.offset / sizeof(void *)));
+        }
+      }
+    }
+    // Enable the functions whose hook is in place, the others stay queued so a later StartTrace retries them
+    bool success = true;
+    std::vector<size_t> pending;
     for (auto offset : trace_offsets_) {
-      hooks.push_back(HookJniUnit{.offset = static_cast<int>(offset),
-                                  .hook_method = reinterpret_cast<void *>(
-                                    *reinterpret_cast<uintptr_t *>(((char *)&jni_trace::hook_jni + offset))),
-                                  .backup_method = nullptr});
+      size_t index = offset / sizeof(void *);
+      if (IsInstalled(index)) {
+        SetFunctionEnabled(index, true);
+      } else if (*reinterpret_cast<void **>((char *)&jni_trace::hook_jni + offset) != nullptr) {
+        pending.push_back(offset);
+        success = false;
+      }
     }
-    int num = get_fakelinker()->hook_jni_native_functions(&hooks[0], static_cast<int>(hooks.size()));
-    trace_offsets_.clear();
-    return num == hooks.size();
+    trace_offsets_.swap(pending);
+    for (auto offset : offsets) {
+      success &= IsInstalled(offset / sizeof(void *));
+    }
+    return success;
+  }
+
+  /**
+   * @brief Start or stop tracing a hooked function, a single atomic bit flip that any thread may do while tracing
+   *
+   * @return false if the function at offset was never hooked, see SetHookAllFunctions
+   */
+  bool EnableTraceFunction(size_t offset, bool enable) {
+    if (offset < offsetof(JNINativeInterface, GetVersion) || offset > offsetof(JNINativeInterface, GetObjectRefType)) {
+      LOGE("invalid jni function offset: 0x%zx", offset);
+      return false;
+    }
+    if (!IsInstalled(offset / sizeof(void *))) {
+      LOGE("jni function %s is not hooked", GetJNIFunctionName(offset / sizeof(void *)));
+      return false;
+    }
+    SetFunctionEnabled(offset / sizeof(void *), enable);
+    return true;
+  }
+
+  /**
+   * @brief Same as above by the function name, such as "CallObjectMethodV", or "*" for all hooked functions
+   */
+  bool EnableTraceFunction(const char *name, bool enable) {
+    if (name == nullptr) {
+      return false;
+    }
+    if (strcmp(name, "*") == 0) {
+      for (size_t index = 0; index < kFunctionSlots; ++index) {
+        if (IsInstalled(index)) {
+          SetFunctionEnabled(index, enable);
+        }
+      }
+      return true;
+    }
+    int index = FindJNIFunctionIndex(name);
+    if (index < 0) {
+      LOGE("unknown jni function: %s", name);
+      return false;
+    }
+    return EnableTraceFunction(index * sizeof(void *), enable);
+  }
+
+  static bool IsTraceFunctionEnabled(size_t offset) {
+    return offset < sizeof(JNINativeInterface) && jni_trace::IsFunctionEnabled(offset / sizeof(void *));
   }
 
   bool AddMonitorLibrary(std::string_view name, bool exclude) {
@@ -1141,47 +1615,564 @@ public:
     if (end < start) {
       return false;
     }
+    LOGD("add jni monitor address start: 0x%" PRIxPTR " end: 0x%" PRIxPTR " exclude: %d", start, end, exclude);
+    pthread_mutex_lock(&monitors_mutex_);
     if (exclude != exclude_) {
       exclude_ = exclude;
       monitors_.clear();
     }
-    LOGD("add jni monitor address start: 0x%" PRIxPTR " end: 0x%" PRIxPTR " exclude: %d", start, end, exclude);
     monitors_[start] = end;
+    PublishFilter();
+    pthread_mutex_unlock(&monitors_mutex_);
     return true;
   }
 
   bool RemoveMonitorAddress(uintptr_t start, uintptr_t end) {
+    bool removed = false;
+    pthread_mutex_lock(&monitors_mutex_);
     auto itr = monitors_.find(start);
     if (itr != monitors_.end() && itr->second == end) {
       monitors_.erase(itr);
-      return true;
+      PublishFilter();
+      removed = true;
     }
-    return false;
+    pthread_mutex_unlock(&monitors_mutex_);
+    return removed;
+  }
+
+  /**
+   * @brief Remove all ranges of either mode, nothing is monitored until a range is added again
+   */
+  void Clear() {
+    pthread_mutex_lock(&monitors_mutex_);
+    monitors_.clear();
+    const MonitorFilter *old_filter = filter_.exchange(nullptr, std::memory_order_acq_rel);
+    filter_generation_.store(0, std::memory_order_release);
+    retired_filters_.Retire(old_filter);
+    pthread_mutex_unlock(&monitors_mutex_);
+  }
+
+  /*
+   * Called on every intercepted jni call, the per-thread cache remembers the last range or gap that was hit
+   * in the current filter, so repeated calls from the same library neither search nor touch the filter
+   */
+  bool IsMonitoring(uintptr_t addr) {
+    static thread_local MonitorHitCache cache;
+    uint64_t generation = filter_generation_.load(std::memory_order_acquire);
+    if (generation == 0) {
+      return false;
+    }
+    if (cache.generation == generation && addr - cache.start <= cache.end - cache.start) {
+      return cache.result;
+    }
+    TraceEpoch::ReadGuard guard;
+    const MonitorFilter *filter = filter_.load(std::memory_order_acquire);
+    if (filter == nullptr) {
+      return false;
+    }
+    return LookupFilter(filter, addr, cache);
   }
 
-  void Clear() { monitors_.clear(); }
+  bool IsMonitoring(void *addr) { return IsMonitoring(reinterpret_cast<uintptr_t>(addr)); }
 
-  bool IsMonitoring(uintptr_t addr) {
-    auto itr = monitors_.upper_bound(addr);
-    if (itr == monitors_.begin()) {
+  /**
+   * @brief Only trace the calls on the given jmethodIDs, jfieldIDs and classes
+   *
+   * The member filter is checked after the address filter. Calls without a jmethodID or jfieldID
+   * argument are not affected, and every member is traced while the filter is empty.
+   */
+  void AddTraceMethod(jmethodID method) { AddTraceMembers({MemberKey(kTVMethodID, method)}); }
+
+  void AddTraceField(jfieldID field) { AddTraceMembers({MemberKey(kTVFieldID, field)}); }
+
+  /**
+   * @brief Trace the declared methods, constructors and fields of class_name, such as "java/lang/String".
+   * The members are resolved to ids once here, InitHookJNI must be called first
+   */
+  bool AddTraceClass(JNIEnv *env, const char *class_name) {
+    if (!jni_trace::art_jni) {
+      LOGE("InitHookJNI must be called before adding trace classes");
       return false;
     }
-    --itr;
-    return addr <= itr->second && !exclude_;
+    std::vector<uint64_t> keys;
+    {
+      GuardJNIEnv guard(env, &jni_trace::org_env);
+      if (!ResolveClassMembers(env, class_name, keys)) {
+        return false;
+      }
+    }
+    LOGD("add jni trace class %s with %zu members", class_name, keys.size());
+    AddTraceMembers(keys);
+    return true;
   }
 
-  bool IsMonitoring(void *addr) { return IsMonitoring(reinterpret_cast<uintptr_t>(addr)); }
+  void ClearTraceMembers() {
+    pthread_mutex_lock(&monitors_mutex_);
+    members_.clear();
+    PublishMemberFilter();
+    pthread_mutex_unlock(&monitors_mutex_);
+  }
+
+  /*
+   * Called on every intercepted jni call that passed the address filter, calls without a member
+   * are decided at compile time
+   */
+  bool IsTracingMember(TraceMember member) {
+    if (member.type == kTVNone) {
+      return true;
+    }
+    // Most traces have no member filter, only the pointer is checked without the read guard
+    if (member_filter_.load(std::memory_order_relaxed) == nullptr) {
+      return true;
+    }
+    TraceEpoch::ReadGuard guard;
+    const MemberFilter *filter = member_filter_.load(std::memory_order_acquire);
+    if (filter == nullptr) {
+      return true;
+    }
+    uint64_t key = member.value << 1 | (member.type == kTVFieldID);
+    for (size_t i = MemberHash(key) & filter->mask;; i = (i + 1) & filter->mask) {
+      uint64_t current = filter->slots[i];
+      if (current == 0) {
+        return false;
+      }
+      if (current == key) {
+        return true;
+      }
+    }
+  }
 
 private:
+  static void InstallShadowTable(void *env) {
+    auto *jni_env = static_cast<JNIEnv *>(env);
+    if (jni_env->functions == jni_trace::art_jni && !pthread_getspecific(jni_trace::opt_out_key)) {
+      jni_env->functions = &jni_trace::shadow_jni;
+    }
+  }
+
+  static jint ShadowGetEnv(JavaVM *vm, void **env, jint version) {
+    jint result = jni_trace::art_invoke->GetEnv(vm, env, version);
+    // Other versions such as jvmti return a different kind of environment
+    if (result == JNI_OK && (version & 0xffff0000) == 0x00010000) {
+      InstallShadowTable(*env);
+    }
+    return result;
+  }
+
+  static jint ShadowAttachCurrentThread(JavaVM *vm, JNIEnv **env, void *args) {
+    jint result = jni_trace::art_invoke->AttachCurrentThread(vm, env, args);
+    if (result == JNI_OK) {
+      InstallShadowTable(*env);
+    }
+    return result;
+  }
+
+  static jint ShadowAttachCurrentThreadAsDaemon(JavaVM *vm, JNIEnv **env, void *args) {
+    jint result = jni_trace::art_invoke->AttachCurrentThreadAsDaemon(vm, env, args);
+    if (result == JNI_OK) {
+      InstallShadowTable(*env);
+    }
+    return result;
+  }
+
+  /*
+   * Immutable sorted and merged ranges, replaced as a whole when the monitors change
+   */
+  struct MonitorFilter {
+    std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+    bool exclude;
+    // Never reused, unlike the address of a freed filter
+    uint64_t generation;
+  };
+
+  /*
+   * Immutable open addressing set of member keys, at most half full so lookups stop at an empty slot
+   */
+  struct MemberFilter {
+    std::vector<uint64_t> slots;
+    size_t mask;
+  };
+
+  // jmethodIDs and jfieldIDs may both be small indices, the lowest bit keeps them apart
+  static uint64_t MemberKey(TraceValueType type, const void *id) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(id)) << 1 | (type == kTVFieldID);
+  }
+
+  static size_t MemberHash(uint64_t key) { return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32); }
+
+  void AddTraceMembers(const std::vector<uint64_t> &keys) {
+    pthread_mutex_lock(&monitors_mutex_);
+    for (uint64_t key : keys) {
+      // Null ids are never traced
+      if (key > 1) {
+        members_.push_back(key);
+      }
+    }
+    std::sort(members_.begin(), members_.end());
+    members_.erase(std::unique(members_.begin(), members_.end()), members_.end());
+    PublishMemberFilter();
+    pthread_mutex_unlock(&monitors_mutex_);
+  }
+
+  // Called with monitors_mutex_ held
+  void PublishMemberFilter() {
+    MemberFilter *filter = nullptr;
+    if (!members_.empty()) {
+      size_t capacity = 16;
+      while (capacity < members_.size() * 2) {
+        capacity *= 2;
+      }
+      filter = new MemberFilter{std::vector<uint64_t>(capacity, 0), capacity - 1};
+      for (uint64_t key : members_) {
+        size_t i = MemberHash(key) & filter->mask;
+        while (filter->slots[i] != 0) {
+          i = (i + 1) & filter->mask;
+        }
+        filter->slots[i] = key;
+      }
+    }
+    retired_member_filters_.Retire(member_filter_.exchange(filter, std::memory_order_acq_rel));
+  }
+
+  static bool ResolveClassMembers(JNIEnv *env, const char *class_name, std::vector<uint64_t> &keys) {
+    ScopedLocalRef<jclass> clazz(env, env->FindClass(class_name));
+    if (!clazz) {
+      JNIHelper::PrintAndClearException(env);
+      LOGE("find trace class failed: %s", class_name);
+      return false;
+    }
+    ScopedLocalRef<jclass> class_class(env, env->GetObjectClass(clazz.get()));
+    static const struct {
+      const char *name;
+      const char *signature;
+      TraceValueType type;
+    } kGetters[] = {
+      {"getDeclaredMethods", "()[Ljava/lang/reflect/Method;", kTVMethodID},
+      {"getDeclaredConstructors", "()[Ljava/lang/reflect/Constructor;", kTVMethodID},
+      {"getDeclaredFields", "()[Ljava/lang/reflect/Field;", kTVFieldID},
+    };
+    for (auto &getter : kGetters) {
+      jmethodID method = env->GetMethodID(class_class.get(), getter.name, getter.signature);
+      if (method == nullptr) {
+        JNIHelper::PrintAndClearException(env);
+        return false;
+      }
+      ScopedLocalRef<jobjectArray> members(env,
+                                           static_cast<jobjectArray>(env->CallObjectMethod(clazz.get(), method)));
+      if (!members) {
+        JNIHelper::PrintAndClearException(env);
+        LOGE("get members of trace class failed: %s", class_name);
+        return false;
+      }
+      jsize length = env->GetArrayLength(members.get());
+      for (jsize i = 0; i < length; ++i) {
+        ScopedLocalRef<jobject> member(env, env->GetObjectArrayElement(members.get(), i));
+        if (getter.type == kTVFieldID) {
+          keys.push_back(MemberKey(kTVFieldID, env->FromReflectedField(member.get())));
+        } else {
+          keys.push_back(MemberKey(kTVMethodID, env->FromReflectedMethod(member.get())));
+        }
+      }
+    }
+    return true;
+  }
+
+  static constexpr size_t kFunctionSlots = sizeof(JNINativeInterface) / sizeof(void *);
+
+  bool IsInstalled(size_t index) const { return installed_[index].load(std::memory_order_acquire); }
+
+  static void SetFunctionEnabled(size_t index, bool enable) {
+    uint64_t bit = 1ULL << (index % 64);
+    if (enable) {
+      jni_trace::enabled_functions[index / 64].fetch_or(bit, std::memory_order_relaxed);
+    } else {
+      jni_trace::enabled_functions[index / 64].fetch_and(~bit, std::memory_order_relaxed);
+    }
+  }
+
+  struct MonitorHitCache {
+    uint64_t generation = 0;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    bool result = false;
+  };
+
+  // Called with monitors_mutex_ held
+  void PublishFilter() {
+    std::unique_ptr<MonitorFilter> filter(new MonitorFilter());
+    filter->exclude = exclude_;
+    filter->generation = filter_generations_.fetch_add(1, std::memory_order_relaxed) + 1;
+    for (auto &[start, end] : monitors_) {
+      if (!filter->ranges.empty() && start <= filter->ranges.back().second) {
+        filter->ranges.back().second = std::max(filter->ranges.back().second, end);
+      } else {
+        filter->ranges.emplace_back(start, end);
+      }
+    }
+    uint64_t generation = filter->generation;
+    const MonitorFilter *old_filter = filter_.exchange(filter.release(), std::memory_order_acq_rel);
+    filter_generation_.store(generation, std::memory_order_release);
+    // Readers may still use the previous filter, it is freed once they left their read guard
+    retired_filters_.Retire(old_filter);
+  }
+
+  static bool LookupFilter(const MonitorFilter *filter, uintptr_t addr, MonitorHitCache &cache) {
+    size_t len = filter->ranges.size();
+    cache.generation = filter->generation;
+    if (len == 0) {
+      // Removing the last excluded range traces everything, removing the last included one traces nothing
+      cache.start = 0;
+      cache.end = UINTPTR_MAX;
+      cache.result = filter->exclude;
+      return cache.result;
+    }
+    const auto *first = filter->ranges.data();
+    const auto *base = first;
+    // Branchless search of the last range starting at or before addr
+    while (len > 1) {
+      size_t half = len / 2;
+      base = base[half].first <= addr ? base + half : base;
+      len -= half;
+    }
+    bool inside;
+    if (addr < base->first) {
+      inside = false;
+      cache.start = 0;
+      cache.end = base->first - 1;
+    } else if (addr <= base->second) {
+      inside = true;
+      cache.start = base->first;
+      cache.end = base->second;
+    } else {
+      inside = false;
+      cache.start = base->second + 1;
+      cache.end = base + 1 < first + filter->ranges.size() ? base[1].first - 1 : UINTPTR_MAX;
+    }
+    // Included ranges are traced, excluded ranges are traced everywhere else
+    cache.result = inside != filter->exclude;
+    return cache.result;
+  }
+
   std::vector<size_t> trace_offsets_;
+  JNITraceMode mode_ = JNITraceMode::kPatchTable;
+  bool hook_all_ = false;
+  // Functions whose hook is installed, only set by StartTrace and read by EnableTraceFunction from any thread
+  std::atomic<bool> installed_[kFunctionSlots] = {};
+  // Writer side of the filter, protected by monitors_mutex_
+  pthread_mutex_t monitors_mutex_ = PTHREAD_MUTEX_INITIALIZER;
   std::map<uintptr_t, uintptr_t> monitors_;
   bool exclude_ = true;
-  uintptr_t last_start_ = 0;
-  uintptr_t last_end_ = 0;
+  std::atomic<const MonitorFilter *> filter_ = nullptr;
+  // Generation of filter_, 0 without a filter, the hit cache only compares it
+  std::atomic<uint64_t> filter_generation_ = 0;
+  TraceRetireList<MonitorFilter> retired_filters_;
+  // The hit cache is shared by all monitors of this type
+  static inline std::atomic<uint64_t> filter_generations_ = 0;
+  // Keys of the member filter, protected by monitors_mutex_
+  std::vector<uint64_t> members_;
+  std::atomic<const MemberFilter *> member_filter_ = nullptr;
+  TraceRetireList<MemberFilter> retired_member_filters_;
   bool initialized_ = false;
   DISALLOW_COPY_AND_ASSIGN(JNIMonitor);
 };
 
+/**
+ * @brief Concurrent cache of jmethodID/jfieldID descriptions
+ *
+ * Lookups are lock-free, inserts lock one of the shards. The strings are copied into an arena per shard.
+ * Tables replaced by a grow and the arenas dropped by Clear are freed once the threads that may still
+ * read them left their TraceEpoch::ReadGuard, a returned pointer stays valid while the caller holds one.
+ */
+template <typename Key>
+class DescriptionCache {
+public:
+  DescriptionCache() {
+    for (Shard &shard : shards_) {
+      shard.current.reset(NewTable(kInitialCapacity));
+      shard.table.store(shard.current.get(), std::memory_order_relaxed);
+    }
+  }
+
+  const char *Find(Key key) {
+    if (key == nullptr) {
+      return nullptr;
+    }
+    TraceEpoch::ReadGuard guard;
+    static thread_local LastHit last;
+    uint32_t generation = generation_.load(std::memory_order_acquire);
+    if (last.cache == this && last.generation == generation && last.key == key) {
+      return last.value;
+    }
+    uint64_t hash = Hash(key);
+    const Table *table = shards_[hash >> (64 - kShardBits)].table.load(std::memory_order_acquire);
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Key current = table->slots[i].key.load(std::memory_order_acquire);
+      if (current == key) {
+        const char *value = table->slots[i].value.load(std::memory_order_relaxed);
+        last = LastHit{this, generation, key, value};
+        return value;
+      }
+      if (current == nullptr) {
+        return nullptr;
+      }
+    }
+  }
+
+  /**
+   * @brief Store the description of key, if another thread was faster its description is returned.
+   * Null keys are never cached and return nullptr
+   */
+  const char *Insert(Key key, std::string_view desc) {
+    if (key == nullptr) {
+      return nullptr;
+    }
+    uint64_t hash = Hash(key);
+    Shard &shard = shards_[hash >> (64 - kShardBits)];
+    pthread_mutex_lock(&shard.mutex);
+    const char *value = nullptr;
+    Table *table = shard.current.get();
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Key current = table->slots[i].key.load(std::memory_order_relaxed);
+      if (current == key) {
+        value = table->slots[i].value.load(std::memory_order_relaxed);
+        break;
+      }
+      if (current == nullptr) {
+        break;
+      }
+    }
+    if (value == nullptr) {
+      value = Intern(shard, desc);
+      if ((table->size + 1) * 2 > table->capacity) {
+        table = Grow(shard, table);
+      }
+      Put(table, hash, key, value);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+    return value;
+  }
+
+  void Clear() {
+    std::vector<std::unique_ptr<Garbage>> garbage;
+    for (Shard &shard : shards_) {
+      pthread_mutex_lock(&shard.mutex);
+      std::unique_ptr<Garbage> old(new Garbage{std::move(shard.current), std::move(shard.blocks)});
+      shard.current.reset(NewTable(kInitialCapacity));
+      shard.table.store(shard.current.get(), std::memory_order_release);
+      shard.blocks.clear();
+      shard.block_used = kBlockSize;
+      pthread_mutex_unlock(&shard.mutex);
+      garbage.push_back(std::move(old));
+    }
+    // The per-thread last hits must be invalid before their strings can be freed
+    generation_.fetch_add(1, std::memory_order_acq_rel);
+    for (size_t i = 0; i < garbage.size(); ++i) {
+      pthread_mutex_lock(&shards_[i].mutex);
+      shards_[i].retired.Retire(garbage[i].release());
+      pthread_mutex_unlock(&shards_[i].mutex);
+    }
+  }
+
+private:
+  static constexpr int kShardBits = 4;
+  static constexpr size_t kInitialCapacity = 64;
+  static constexpr size_t kBlockSize = 16 * 1024;
+
+  struct Slot {
+    std::atomic<Key> key{nullptr};
+    std::atomic<const char *> value{nullptr};
+  };
+
+  struct Table {
+    size_t capacity;
+    size_t size = 0;
+    std::unique_ptr<Slot[]> slots;
+  };
+
+  // A replaced table or the arena of a cleared shard, kept while readers may use it
+  struct Garbage {
+    std::unique_ptr<Table> table;
+    std::vector<std::unique_ptr<char[]>> blocks;
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::atomic<Table *> table{nullptr};
+    // The fields below are protected by mutex
+    std::unique_ptr<Table> current;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used = kBlockSize;
+    TraceRetireList<Garbage> retired;
+  };
+
+  struct LastHit {
+    const DescriptionCache *cache;
+    uint32_t generation;
+    Key key;
+    const char *value;
+  };
+
+  static uint64_t Hash(Key key) { return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key)) * 0x9e3779b97f4a7c15ULL; }
+
+  static Table *NewTable(size_t capacity) {
+    return new Table{capacity, 0, std::unique_ptr<Slot[]>(new Slot[capacity])};
+  }
+
+  static void Put(Table *table, uint64_t hash, Key key, const char *value) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].key.load(std::memory_order_relaxed) != nullptr) {
+      i = (i + 1) & mask;
+    }
+    table->slots[i].value.store(value, std::memory_order_relaxed);
+    // Publishes the value together with the key
+    table->slots[i].key.store(key, std::memory_order_release);
+    table->size++;
+  }
+
+  static Table *Grow(Shard &shard, Table *table) {
+    Table *bigger = NewTable(table->capacity * 2);
+    for (size_t i = 0; i < table->capacity; ++i) {
+      Key key = table->slots[i].key.load(std::memory_order_relaxed);
+      if (key != nullptr) {
+        Put(bigger, Hash(key), key, table->slots[i].value.load(std::memory_order_relaxed));
+      }
+    }
+    std::unique_ptr<Table> old = std::move(shard.current);
+    shard.current.reset(bigger);
+    shard.table.store(bigger, std::memory_order_release);
+    // The strings stay in the arena, only the replaced index is retired
+    shard.retired.Retire(new Garbage{std::move(old), {}});
+    return bigger;
+  }
+
+  static const char *Intern(Shard &shard, std::string_view desc) {
+    size_t len = desc.size() + 1;
+    char *dst;
+    if (len > kBlockSize / 4) {
+      // Large strings get their own block, the current block keeps serving small ones
+      shard.blocks.emplace(shard.blocks.begin(), new char[len]);
+      dst = shard.blocks.front().get();
+    } else {
+      if (shard.block_used + len > kBlockSize) {
+        shard.blocks.emplace_back(new char[kBlockSize]);
+        shard.block_used = 0;
+      }
+      dst = shard.blocks.back().get() + shard.block_used;
+      shard.block_used += len;
+    }
+    memcpy(dst, desc.data(), desc.size());
+    dst[desc.size()] = '\0';
+    return dst;
+  }
+
+  Shard shards_[1 << kShardBits];
+  std::atomic<uint32_t> generation_ = 0;
+  DISALLOW_COPY_AND_ASSIGN(DescriptionCache);
+};
+
 /**
  * @class BaseTraceJNICallback
  * @brief A base class for tracing and logging JNI calls in a custom JNIEnv wrapper.
@@ -1196,7 +2187,7 @@ private:
  * - Intercepts all major JNI function calls, including method/field access, object creation, array operations, etc.
  * - Formats and logs method/field IDs, arguments, return values, and JNI object types.
  * - Supports strict mode for enhanced safety and validation.
- * - Maintains caches for method and field descriptions to improve performance.
+ * - Maintains concurrent caches for method and field descriptions to improve performance.
  * - Provides utilities for formatting JNI types, classes, strings, and objects.
  * - Integrates with Android logging via __android_log_print.
  * - Supports registration of trace hooks for a wide range of JNI functions.
@@ -1220,6 +2211,58 @@ private:
  *    tracer.DefaultRegister(); // Registers default JNI functions and start tracing
  *    @endcode
  *
+ *    To switch functions on and off while tracing, hook all of them up front, toggling is a single atomic bit flip:
+ *    @code
+ *    tracer->SetHookAllFunctions(true);
+ *    tracer.DefaultRegister(); // Only the default functions start enabled
+ *    tracer->EnableTraceFunction("CallObjectMethodV", false);
+ *    tracer->EnableTraceFunction("GetStaticFieldID", true);
+ *    @endcode
+ *
+ *    To trace only a few Java methods or fields of the monitored libraries, add them to the member filter:
+ *    @code
+ *    tracer->AddTraceClass(env, "com/example/Crypto"); // All declared methods, constructors and fields
+ *    tracer->AddTraceMethod(env->GetMethodID(clazz, "run", "()V"));
+ *    @endcode
+ *
+ *    To leave ART's table untouched, select the shadow table before registering and install it
+ *    for the threads to trace:
+ *    @code
+ *    tracer->SetTraceMode(JNITraceMode::kShadowTable);
+ *    tracer.DefaultRegister();
+ *    JNIMonitor<DefaultTraceJNICallback>::AttachThread(env); // or AttachAllThreads(vm)
+ *    @endcode
+ *
+ *    To keep the traced threads fast, record the calls and format them on a background thread,
+ *    or write them to a compact file for tools/jni_trace_decoder.py:
+ *    @code
+ *    tracer.StartAsyncTrace(); // or tracer.StartFileTrace("/data/local/tmp/jni.trace")
+ *    ...
+ *    tracer.StopAsyncTrace();
+ *    @endcode
+ *
+ *    To bound the overhead, sample or rate limit the traced calls, the suppressed calls are reported periodically:
+ *    @code
+ *    TraceSampler::SetSampleRate("GetObjectClass", 100); // 1 in 100 calls
+ *    TraceSampler::SetCallerRateLimit(50, 10);          // per caller address, bursts of 10
+ *    TraceSampler::SetGlobalRateLimit(2000, 200);
+ *    @endcode
+ *
+ *    To find out which libraries are JNI bound without tracing single calls, aggregate the call durations:
+ *    @code
+ *    TraceLatencyStats::SetEnabled(true);
+ *    ...
+ *    tracer.DumpLatencyStats(20); // or TraceLatencyStats::Snapshot()
+ *    @endcode
+ *
+ *    To see which call sites hit which Java methods and fields, count the calls per caller, function and member:
+ *    @code
+ *    TraceCallGraph::SetEnabled(true);
+ *    ...
+ *    tracer.DumpCallGraph(env, 50);
+ *    tracer.WriteCallGraphFlamegraph(env, "/data/local/tmp/jni.folded"); // flamegraph.pl or speedscope input
+ *    @endcode
+ *
  * 3. Optionally, use SetStrictMode, SetOriginalEnv, or ClearCache as needed.
  *
  * ## Important Methods
@@ -1230,9 +2273,8 @@ private:
  * - TraceLog/TraceLine: Logging utilities for trace output.
  *
  * ## Thread Safety
- * JNI callbacks use independent Context instances to achieve thread safety, but
- * JNIMonitor element addition is not thread-safe. It is recommended to complete
- * adding monitoring addresses before starting the trace.
+ * JNI callbacks use independent Context instances to achieve thread safety. Monitoring
+ * addresses can be added and removed while tracing, the new ranges are published atomically.
  *
  * ## Example
  * See DefaultTraceJNICallback in default_trace_jni.h for a minimal implementation.
@@ -1249,43 +2291,38 @@ public:
 
   bool InitTrace(JNIEnv *env) {
     this->BindMethod();
+    // The drain thread of the async trace attaches itself to describe the method and field IDs
+    if (env->GetJavaVM(&java_vm_) != JNI_OK) {
+      java_vm_ = nullptr;
+    }
     return JNIMonitor<Derived>::InitHookJNI(env);
   }
 
+  /**
+   * @brief The cached description of method, the result stays valid while the caller holds a TraceEpoch::ReadGuard.
+   * The trace callbacks and the record consumers already run inside one
+   */
   const char *FormatMethodID(JNIEnv *env, jmethodID method, bool check = true) {
-    if (check && !method) {
+    // Null ids are not cached, check only decides whether JNI would have been asked about them
+    if (!method) {
       return "(null method)";
     }
-    if (method == last_method_) {
-      return last_method_desc_;
-    }
-    auto itr = cache_methods_.find(method);
-    if (itr != cache_methods_.end()) {
-      return itr->second.c_str();
+    if (const char *desc = cache_methods_.Find(method)) {
+      return desc;
     }
     GuardJNIEnv guard(env, original_env);
-    auto result = cache_methods_.emplace(method, JNIHelper::PrettyMethod(env, method, check)).first->second.c_str();
-    last_method_ = method;
-    last_method_desc_ = result;
-    return result;
+    return cache_methods_.Insert(method, JNIHelper::PrettyMethod(env, method, check));
   }
 
   const char *FormatFieldID(JNIEnv *env, jfieldID field, bool check = true) {
-    if (check && !field) {
+    if (!field) {
       return "(null field)";
     }
-    if (field == last_field_) {
-      return last_field_desc_;
-    }
-    auto itr = cache_fields_.find(field);
-    if (itr != cache_fields_.end()) {
-      return itr->second.c_str();
+    if (const char *desc = cache_fields_.Find(field)) {
+      return desc;
     }
     GuardJNIEnv guard(env, original_env);
-    auto result = cache_fields_.emplace(field, JNIHelper::PrettyField(env, field, check)).first->second.c_str();
-    last_field_ = field;
-    last_field_desc_ = result;
-    return result;
+    return cache_fields_.Insert(field, JNIHelper::PrettyField(env, field, check));
   }
 
   std::string GetMethodShorty(JNIEnv *env, jmethodID method, bool check = true) {
@@ -1332,12 +2369,15 @@ public:
     return JNIHelper::ToString(env, obj, check);
   }
 
+  /**
+   * @brief Drop the cached descriptions, their memory is freed once no trace callback may still use them
+   */
   void ClearCache(bool clear_methods = true, bool clear_fields = true) {
     if (clear_methods) {
-      cache_methods_.clear();
+      cache_methods_.Clear();
     }
     if (clear_fields) {
-      cache_fields_.clear();
+      cache_fields_.Clear();
     }
   }
 
@@ -1351,6 +2391,193 @@ public:
 
   SymbolResolver &GetSymbolResolver() { return symbol_resolver_; }
 
+  /**
+   * @brief Record monitored calls into per-thread rings and format them on a background thread
+   *
+   * Objects can only be shown as handles because their local references are gone when the records are
+   * formatted, method and field IDs stay valid and are described on the drain thread
+   */
+  bool StartAsyncTrace(uint32_t interval_ms = 20) {
+    if (!TraceBuffer::Start(&BaseTraceJNICallback::DrainTraceRecords, static_cast<Derived *>(this), interval_ms)) {
+      LOGE("start async jni trace failed");
+      return false;
+    }
+    jni_trace::async_trace.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Go back to formatting on the calling thread, the pending records are still formatted
+   */
+  void StopAsyncTrace() {
+    jni_trace::async_trace.store(false, std::memory_order_release);
+    TraceBuffer::Stop();
+    trace_file_.Close();
+  }
+
+  /**
+   * @brief Like StartAsyncTrace, but the records are written to a compact binary file instead of TraceLog.
+   * Decode it on the host with tools/jni_trace_decoder.py, StopAsyncTrace finishes the file
+   */
+  bool StartFileTrace(const char *path, uint32_t interval_ms = 20) {
+    if (TraceBuffer::IsRunning()) {
+      LOGE("async jni trace is already running");
+      return false;
+    }
+    if (!trace_file_.Open(path)) {
+      return false;
+    }
+    if (!StartAsyncTrace(interval_ms)) {
+      trace_file_.Close();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Describe the method and field IDs of drained records that no trace callback has formatted yet.
+   * Called on the drain thread, which is attached to the VM only while a batch has such IDs
+   */
+  void DescribeTraceMembers(const TraceRecord *records, size_t count) {
+    JNIEnv *env = nullptr;
+    const JNINativeInterface *functions = nullptr;
+    bool attached = false;
+    for (size_t i = 0; i < count; ++i) {
+      const TraceRecord &record = records[i];
+      for (int j = 0; j < 5; ++j) {
+        TraceValueType type = j < 4 ? record.ArgType(j) : static_cast<TraceValueType>(record.result_type);
+        auto *pointer = reinterpret_cast<void *>(static_cast<uintptr_t>(j < 4 ? record.args[j] : record.result));
+        if (pointer == nullptr || (type != kTVMethodID && type != kTVFieldID)) {
+          continue;
+        }
+        if (type == kTVMethodID ? cache_methods_.Find(static_cast<jmethodID>(pointer)) != nullptr
+                                : cache_fields_.Find(static_cast<jfieldID>(pointer)) != nullptr) {
+          continue;
+        }
+        if (env == nullptr) {
+          if (java_vm_ == nullptr) {
+            return;
+          }
+          if (java_vm_->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) != JNI_OK) {
+            JavaVMAttachArgs args{JNI_VERSION_1_6, "jni_trace_drain", nullptr};
+            if (java_vm_->AttachCurrentThread(&env, &args) != JNI_OK) {
+              LOGW("attach the jni trace drain thread failed");
+              return;
+            }
+            attached = true;
+          }
+          // The calls made to describe the IDs must not be traced themselves
+          functions = env->functions;
+          env->functions = jni_trace::org_jni;
+        }
+        if (type == kTVMethodID) {
+          auto method = static_cast<jmethodID>(pointer);
+          cache_methods_.Insert(method, JNIHelper::PrettyMethod(env, method, strict_mode_));
+        } else {
+          auto field = static_cast<jfieldID>(pointer);
+          cache_fields_.Insert(field, JNIHelper::PrettyField(env, field, strict_mode_));
+        }
+      }
+    }
+    if (env != nullptr) {
+      env->functions = functions;
+      if (attached) {
+        java_vm_->DetachCurrentThread();
+      }
+    }
+  }
+
+  /**
+   * @brief Write drained records to the trace file, called on the drain thread.
+   * Callers and method or field descriptions are written the first time they are seen
+   */
+  void WriteTraceRecords(const TraceRecord *records, size_t count) {
+    TraceEpoch::ReadGuard epoch_guard;
+    for (size_t i = 0; i < count && trace_file_.IsOpen(); ++i) {
+      const TraceRecord &record = records[i];
+      if (!trace_file_.HasSymbol(kTVPointer, record.caller)) {
+        trace_file_.AddSymbol(kTVPointer, record.caller,
+                              symbol_resolver_.FormatAddress(record.caller, true).c_str());
+      }
+      for (int j = 0; j < 5; ++j) {
+        TraceValueType type = j < 4 ? record.ArgType(j) : static_cast<TraceValueType>(record.result_type);
+        uint64_t value = j < 4 ? record.args[j] : record.result;
+        if (type == kTVMethodID && !trace_file_.HasSymbol(type, value)) {
+          trace_file_.AddSymbol(type, value, cache_methods_.Find(reinterpret_cast<jmethodID>(value)));
+        } else if (type == kTVFieldID && !trace_file_.HasSymbol(type, value)) {
+          trace_file_.AddSymbol(type, value, cache_fields_.Find(reinterpret_cast<jfieldID>(value)));
+        }
+      }
+      trace_file_.WriteRecord(record);
+    }
+    uint64_t dropped = TraceBuffer::DroppedRecords();
+    if (dropped != reported_drops_) {
+      trace_file_.WriteDropped(dropped - reported_drops_);
+      reported_drops_ = dropped;
+    }
+    ReportSuppressed();
+  }
+
+  /**
+   * @brief Format drained records, called on the drain thread. Lines are batched into few TraceLog calls
+   */
+  void FormatTraceRecords(const TraceRecord *records, size_t count) {
+    TraceEpoch::ReadGuard epoch_guard;
+    char buffer[3072];
+    size_t length = 0;
+    auto flush = [&]() {
+      if (length > 0) {
+        buffer[length] = '\0';
+        static_cast<Derived *>(this)->TraceLog(std::string_view(buffer, length));
+        length = 0;
+      }
+    };
+    char line[512];
+    for (size_t i = 0; i < count; ++i) {
+      size_t line_length = static_cast<Derived *>(this)->FormatTraceRecord(records[i], line, sizeof(line));
+      if (length + line_length + 2 > sizeof(buffer)) {
+        flush();
+      }
+      memcpy(buffer + length, line, line_length);
+      length += line_length;
+      buffer[length++] = '\n';
+    }
+    uint64_t dropped = TraceBuffer::DroppedRecords();
+    if (dropped != reported_drops_) {
+      if (length + 64 > sizeof(buffer)) {
+        flush();
+      }
+      length += snprintf(buffer + length, 64, "dropped %" PRIu64 " jni trace records\n", dropped - reported_drops_);
+      reported_drops_ = dropped;
+    }
+    flush();
+    ReportSuppressed();
+  }
+
+  size_t FormatTraceRecord(const TraceRecord &record, char *buffer, size_t size) {
+    char *p = buffer;
+    char *end = buffer + size;
+    const char *name = GetJNIFunctionName(record.function);
+    AppendTrace(p, end, "[%u] %s ", record.tid, name ? name : "unknown");
+    if (end - p > 64) {
+      symbol_resolver_.FormatAddressFromBuffer(p, end - p, record.caller, true);
+      p = std::min(p, end - 1);
+    }
+    AppendTrace(p, end, " (");
+    for (int i = 0; i < 4 && record.ArgType(i) != kTVNone; ++i) {
+      if (i > 0) {
+        AppendTrace(p, end, ", ");
+      }
+      FormatTraceValue(p, end, record.ArgType(i), record.args[i]);
+    }
+    AppendTrace(p, end, ")");
+    if (record.result_type != kTVNone) {
+      AppendTrace(p, end, " -> ");
+      FormatTraceValue(p, end, static_cast<TraceValueType>(record.result_type), record.result);
+    }
+    return p - buffer;
+  }
+
 
   bool DefaultRegister() {
 #define REGISTER_METHOD(name) offsetof(JNINativeInterface, name)
@@ -1532,31 +2759,61 @@ public:
   template <typename ReturnType, bool AllowAccessArgs>
   void TraceEnd(TraceInvokeContext<ReturnType, AllowAccessArgs> &context) {
     static_cast<Derived *>(this)->TraceLine(context, "----------------- End -----------------");
-    constexpr size_t max_message_length = sizeof(TraceInvokeContext<ReturnType, AllowAccessArgs>::message);
-    if (context.message_length < max_message_length) {
-      context.message[context.message_length] = '\0';
-    } else {
-      context.message[max_message_length - 1] = '\0';
-      context.message_length = max_message_length - 1;
+    if (!context.message.empty()) {
+      static_cast<Derived *>(this)->TraceLog(context.message.Finish());
+    }
+    ReportSuppressed();
+  }
+
+  /**
+   * @brief Log the merged latency histograms, the max_lines functions with the highest total time or all
+   */
+  void DumpLatencyStats(size_t max_lines = 0) { LogLines(TraceLatencyStats::Dump(max_lines)); }
+
+  /**
+   * @brief Log the top_n (caller, function, member) tuples by call count, callers are grouped by library when
+   * by_library is set. The members are described through env, so call it from an attached thread
+   */
+  void DumpCallGraph(JNIEnv *env, size_t top_n = 50, bool by_library = false) {
+    TraceEpoch::ReadGuard epoch_guard;
+    MemberDescriber describer{static_cast<Derived *>(this), env};
+    LogLines(TraceCallGraph::DumpTop(top_n, by_library, DescribeMember, &describer));
+  }
+
+  /**
+   * @brief Write the call graph as folded stacks, weighted by call count or by cumulative time
+   */
+  bool WriteCallGraphFlamegraph(JNIEnv *env, const char *path, bool by_library = false, bool weight_by_time = false) {
+    TraceEpoch::ReadGuard epoch_guard;
+    MemberDescriber describer{static_cast<Derived *>(this), env};
+    return TraceCallGraph::WriteFolded(path, by_library, weight_by_time, DescribeMember, &describer);
+  }
+
+  /**
+   * @brief Log the calls suppressed by TraceSampler, at most once a second.
+   * Checked after traced calls and on every drain when tracing asynchronously
+   */
+  void ReportSuppressed() {
+    TraceSuppressedCounts counts;
+    if (!TraceSampler::TakeReport(counts)) {
+      return;
     }
-    static_cast<Derived *>(this)->TraceLog(std::string_view(context.message, context.message_length));
+    if (trace_file_.IsOpen()) {
+      trace_file_.WriteSuppressed(counts);
+      return;
+    }
+    char buffer[160];
+    snprintf(buffer, sizeof(buffer),
+             "suppressed jni trace calls, sampled: %" PRIu64 ", caller limited: %" PRIu64 ", global limited: %" PRIu64,
+             counts.sampled, counts.caller_limited, counts.global_limited);
+    static_cast<Derived *>(this)->TraceLog(buffer);
   }
 
   template <typename ReturnType, bool AllowAccessArgs>
   void TraceLine(TraceInvokeContext<ReturnType, AllowAccessArgs> &context, std::string_view line, ...) {
-    constexpr size_t max_message_length = sizeof(TraceInvokeContext<ReturnType, AllowAccessArgs>::message);
     va_list args;
     va_start(args, line);
-    if (context.message_length < max_message_length) {
-      int len = vsnprintf(context.message + context.message_length, max_message_length - context.message_length,
-                          line.data(), args);
-      if (len > 0) {
-        context.message_length += len;
-      }
-      if (context.message_length < max_message_length) {
-        context.message[context.message_length++] = '\n';
-      }
-    }
+    context.message.AppendLine(line.data(), args);
     va_end(args);
   }
 
@@ -2705,12 +3962,118 @@ protected:
 
 private:
   SymbolResolver symbol_resolver_;
-  std::map<jmethodID, std::string> cache_methods_;
-  std::map<jfieldID, std::string> cache_fields_;
-  jmethodID last_method_ = nullptr;
-  const char *last_method_desc_ = nullptr;
-  jfieldID last_field_ = nullptr;
-  const char *last_field_desc_ = nullptr;
+  static void DrainTraceRecords(const TraceRecord *records, size_t count, void *opaque) {
+    auto *self = static_cast<Derived *>(opaque);
+    self->DescribeTraceMembers(records, count);
+    if (self->trace_file_.IsOpen()) {
+      self->WriteTraceRecords(records, count);
+    } else {
+      self->FormatTraceRecords(records, count);
+    }
+  }
+
+  struct MemberDescriber {
+    Derived *self;
+    JNIEnv *env;
+  };
+
+  static const char *DescribeMember(TraceMember member, void *opaque) {
+    auto *describer = static_cast<MemberDescriber *>(opaque);
+    auto *pointer = reinterpret_cast<void *>(static_cast<uintptr_t>(member.value));
+    if (member.type == kTVMethodID) {
+      return describer->self->FormatMethodID(describer->env, static_cast<jmethodID>(pointer),
+                                             describer->self->strict_mode_);
+    }
+    return describer->self->FormatFieldID(describer->env, static_cast<jfieldID>(pointer),
+                                          describer->self->strict_mode_);
+  }
+
+  void LogLines(const std::string &text) {
+    size_t start = 0;
+    while (start < text.size()) {
+      size_t end = text.find('\n', start);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      std::string line = text.substr(start, end - start);
+      static_cast<Derived *>(this)->TraceLog(line);
+      start = end + 1;
+    }
+  }
+
+  static void AppendTrace(char *&p, char *end, const char *fmt, ...) {
+    if (end - p <= 1) {
+      return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(p, end - p, fmt, args);
+    va_end(args);
+    if (len > 0) {
+      p += std::min<ptrdiff_t>(len, end - p - 1);
+    }
+  }
+
+  void FormatTraceValue(char *&p, char *end, TraceValueType type, uint64_t value) {
+    auto *pointer = reinterpret_cast<void *>(static_cast<uintptr_t>(value));
+    switch (type) {
+    case kTVInt:
+      AppendTrace(p, end, "%" PRId64, static_cast<int64_t>(value));
+      break;
+    case kTVUnsigned:
+      AppendTrace(p, end, "%" PRIu64, value);
+      break;
+    case kTVFloat: {
+      uint32_t bits = static_cast<uint32_t>(value);
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      AppendTrace(p, end, "%f", f);
+      break;
+    }
+    case kTVDouble: {
+      double d;
+      memcpy(&d, &value, sizeof(d));
+      AppendTrace(p, end, "%f", d);
+      break;
+    }
+    case kTVObject:
+      AppendTrace(p, end, "jobject %p", pointer);
+      break;
+    case kTVClass:
+      AppendTrace(p, end, "jclass %p", pointer);
+      break;
+    case kTVString:
+      AppendTrace(p, end, "jstring %p", pointer);
+      break;
+    case kTVMethodID:
+      if (const char *desc = cache_methods_.Find(static_cast<jmethodID>(pointer))) {
+        AppendTrace(p, end, "%s", desc);
+      } else {
+        AppendTrace(p, end, "jmethodID %p", pointer);
+      }
+      break;
+    case kTVFieldID:
+      if (const char *desc = cache_fields_.Find(static_cast<jfieldID>(pointer))) {
+        AppendTrace(p, end, "%s", desc);
+      } else {
+        AppendTrace(p, end, "jfieldID %p", pointer);
+      }
+      break;
+    case kTVCString:
+      AppendTrace(p, end, "char* %p", pointer);
+      break;
+    default:
+      AppendTrace(p, end, "%p", pointer);
+      break;
+    }
+  }
+
+  DescriptionCache<jmethodID> cache_methods_;
+  DescriptionCache<jfieldID> cache_fields_;
+  JavaVM *java_vm_ = nullptr;
+  // Only used by the drain thread
+  uint64_t reported_drops_ = 0;
+  TraceFileWriter trace_file_;
 };
 
 } // namespace fakelinker
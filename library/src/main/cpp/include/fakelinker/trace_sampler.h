@@ -0,0 +1,91 @@
+//
+// Sampling and rate limiting of traced JNI calls
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace fakelinker {
+
+/**
+ * @brief Calls suppressed by TraceSampler, either since the process started or since the last report
+ */
+struct TraceSuppressedCounts {
+  uint64_t sampled;       /**< Skipped by the 1-in-N sampling of the function */
+  uint64_t caller_limited; /**< Over the rate limit of the caller address */
+  uint64_t global_limited; /**< Over the events per second ceiling of the process */
+
+  uint64_t Total() const { return sampled + caller_limited + global_limited; }
+};
+
+/**
+ * @brief Decides whether a monitored call is traced, before any trace context is built
+ *
+ * The checks run from the cheapest to the most expensive one: a per-thread countdown of the
+ * function sample rate, a token bucket per caller address and a token bucket of the whole process.
+ * The buckets use the coarse monotonic clock and only one compare and swap, nothing is checked
+ * until one of the limits is configured. Suppressed counts are kept per thread, Suppressed adds
+ * up the counts of all live threads and the ones that already exited.
+ */
+class TraceSampler {
+public:
+  /**
+   * Number of caller addresses with their own bucket, later callers share one bucket
+   */
+  static constexpr size_t kCallerSlots = 1024;
+
+  /**
+   * @brief Trace one of every rate calls of the JNINativeInterface function at index, 0 or 1 traces every call
+   */
+  static void SetSampleRate(size_t function_index, uint32_t rate);
+
+  /**
+   * @brief Same as above by the function name, such as "CallObjectMethodV", or "*" for all functions
+   */
+  static bool SetSampleRate(const char *function, uint32_t rate);
+
+  /**
+   * @brief Every caller address may trace events_per_second calls with bursts up to burst calls, 0 disables
+   */
+  static void SetCallerRateLimit(uint32_t events_per_second, uint32_t burst);
+
+  /**
+   * @brief Ceiling of traced calls per second of the whole process, 0 disables
+   */
+  static void SetGlobalRateLimit(uint32_t events_per_second, uint32_t burst);
+
+  /**
+   * @brief Remove all sample rates and limits, the suppressed counts are kept
+   */
+  static void Reset();
+
+  static bool IsActive() { return active_.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Whether the call of the function at function_index from caller should be traced
+   */
+  static bool Admit(size_t function_index, const void *caller) {
+    return !active_.load(std::memory_order_relaxed) || AdmitSlow(function_index, reinterpret_cast<uintptr_t>(caller));
+  }
+
+  static TraceSuppressedCounts Suppressed();
+
+  /**
+   * @brief At most once per interval_ms over all threads, get the calls suppressed since the last report
+   *
+   * @return false if no limit is active, the interval did not pass yet or nothing was suppressed
+   */
+  static bool TakeReport(TraceSuppressedCounts &counts, uint32_t interval_ms = 1000);
+
+private:
+  static bool AdmitSlow(size_t function_index, uintptr_t caller);
+
+  static void UpdateActive();
+
+  static std::atomic<bool> active_;
+};
+
+} // namespace fakelinker
@@ -4,7 +4,14 @@
 
 #include "hook_jni_native_interface_impl.h"
 
+#include <dlfcn.h>
 #include <jni.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 #include <fakelinker/jni_helper.h>
 #include <fakelinker/linker_macros.h>
@@ -12,6 +19,8 @@
 #include <fakelinker/maps_util.h>
 #include <fakelinker/scoped_local_ref.h>
 
+#include "../scoped_pthread_mutex_locker.h"
+
 C_API JNINativeInterface *original_functions;
 
 static int api;
@@ -21,80 +30,139 @@ static constexpr uint32_t kAccNative = 0x0100;         // method
 
 namespace fakelinker {
 
-FakeLinkerError HookJniNativeInterface(int function_offset, void *hook_method, void **backup_method) {
-  if (function_offset < offsetof(JNINativeInterface, reserved0) ||
-      function_offset > offsetof(JNINativeInterface, GetObjectRefType)) {
+// Protects the JNINativeInterface table writes, the cached protection and the queued hooks
+static pthread_mutex_t jni_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The table never moves, its protection is resolved once and trimmed to the pages it occupies
+static std::vector<PageProtect> jni_table_pages;
+static std::vector<HookJniUnit> jni_pending_hooks;
+
+static FakeLinkerError CheckJniHookUnit(const HookJniUnit &item) {
+  if (item.offset < offsetof(JNINativeInterface, reserved0) ||
+      item.offset > offsetof(JNINativeInterface, GetObjectRefType)) {
     return kHJErrorOffset;
   }
-  if (!ALIGN_CHECK(sizeof(void *), function_offset)) {
+  if (!ALIGN_CHECK(sizeof(void *), item.offset)) {
     return kHJErrorOffset;
   }
-  if (hook_method == nullptr) {
+  if (item.hook_method == nullptr) {
     return kHJErrorMethodNull;
   }
-  void **target = (void **)(((char *)original_functions) + function_offset);
-  if (*target == hook_method) {
-    return kHJErrorRepeatOperation;
-  }
-  MapsHelper util;
-  if (!util.GetMemoryProtect(target, 8)) {
-    LOGE("The specified memory protection permission is not obtained: %p", target);
-    return kHJErrorExec;
-  }
-  if (!util.UnlockPageProtect()) {
-    LOGE("Unlock address protect error: %p", target);
-    return kHJErrorExec;
-  }
-  if (backup_method != nullptr) {
-    *backup_method = *target;
-  }
-  *target = hook_method;
-  util.RecoveryPageProtect();
-  LOGD("replace target method ptr address: %p, old ptr: %p, new ptr: %p", target, *backup_method, hook_method);
   return kHJErrorNO;
 }
 
-int HookJniNativeInterfaces(HookJniUnit *items, int len) {
-  if (len < 1 || items == nullptr) {
-    return 0;
+static bool ResolveJniTableProtect() {
+  if (!jni_table_pages.empty()) {
+    return true;
   }
-
-  void **target;
-  size_t min, max;
-  int num = 0;
-  HookJniUnit *item = &items[0];
-
   MapsHelper util;
   if (!util.GetMemoryProtect(original_functions, sizeof(JNINativeInterface))) {
     LOGE("The specified memory protection permission is not obtained: %p", original_functions);
+    return false;
+  }
+  Address start = PAGE_START(reinterpret_cast<Address>(original_functions));
+  Address end = PAGE_END(reinterpret_cast<Address>(original_functions) + sizeof(JNINativeInterface));
+  for (PageProtect page : util) {
+    page.start = std::max(page.start, start);
+    page.end = std::min(page.end, end);
+    page.path = "";
+    jni_table_pages.push_back(page);
+  }
+  return true;
+}
+
+/*
+ * All table writes share one unlock/write/relock sequence, items that cannot be applied are skipped
+ * and their error is stored in errors when it is not null
+ */
+static int WriteJniNativeInterfaces(HookJniUnit *items, int len, FakeLinkerError *errors) {
+  ScopedPthreadMutexLocker locker(&jni_table_mutex);
+  if (!ResolveJniTableProtect()) {
     return -1;
   }
-  min = offsetof(JNINativeInterface, reserved0);
-  max = offsetof(JNINativeInterface, GetObjectRefType);
+  MapsHelper util;
+  util.SetPageProtect(jni_table_pages.data(), jni_table_pages.size());
   if (!util.UnlockPageProtect()) {
     LOGE("Unlock address protect error: %p", original_functions);
+    // Resolve again next time in case the protection was changed by someone else
+    jni_table_pages.clear();
+    util.RecoveryPageProtect();
     return -1;
   }
-  while (len-- > 0) {
-    if (item->offset < min || item->offset > max || item->hook_method == nullptr) {
-      continue;
-    }
+  int num = 0;
+  for (int i = 0; i < len; ++i) {
+    HookJniUnit &item = items[i];
+    FakeLinkerError error = CheckJniHookUnit(item);
+    void **target = reinterpret_cast<void **>((char *)original_functions + item.offset);
     // Check if the method is already hooked to prevent infinite loops from multiple identical calls
-    target = reinterpret_cast<void **>((char *)original_functions + item->offset);
-    if (*target == item->hook_method) {
+    if (error == kHJErrorNO && *target == item.hook_method) {
+      error = kHJErrorRepeatOperation;
+    }
+    if (errors != nullptr) {
+      errors[i] = error;
+    }
+    if (error != kHJErrorNO) {
       continue;
     }
-    if (item->backup_method != nullptr) {
-      *item->backup_method = *target;
+    if (item.backup_method != nullptr) {
+      *item.backup_method = *target;
     }
-    *target = item->hook_method;
-    item++;
+    LOGD("replace target method ptr address: %p, old ptr: %p, new ptr: %p", target, *target, item.hook_method);
+    *target = item.hook_method;
     num++;
   }
   util.RecoveryPageProtect();
   return num;
 }
 
+FakeLinkerError HookJniNativeInterface(int function_offset, void *hook_method, void **backup_method) {
+  HookJniUnit item{function_offset, hook_method, backup_method};
+  FakeLinkerError error = CheckJniHookUnit(item);
+  if (error != kHJErrorNO) {
+    return error;
+  }
+  if (WriteJniNativeInterfaces(&item, 1, &error) < 0) {
+    return kHJErrorExec;
+  }
+  return error;
+}
+
+int HookJniNativeInterfaces(HookJniUnit *items, int len) {
+  if (len < 1 || items == nullptr) {
+    return 0;
+  }
+  return WriteJniNativeInterfaces(items, len, nullptr);
+}
+
+FakeLinkerError QueueJniNativeInterface(int function_offset, void *hook_method, void **backup_method) {
+  HookJniUnit item{function_offset, hook_method, backup_method};
+  FakeLinkerError error = CheckJniHookUnit(item);
+  if (error != kHJErrorNO) {
+    return error;
+  }
+  ScopedPthreadMutexLocker locker(&jni_table_mutex);
+  for (HookJniUnit &pending : jni_pending_hooks) {
+    if (pending.offset == function_offset) {
+      // The last queued hook of a function wins
+      pending = item;
+      return kHJErrorNO;
+    }
+  }
+  jni_pending_hooks.push_back(item);
+  return kHJErrorNO;
+}
+
+int CommitJniNativeInterfaces() {
+  std::vector<HookJniUnit> items;
+  {
+    ScopedPthreadMutexLocker locker(&jni_table_mutex);
+    items.swap(jni_pending_hooks);
+  }
+  if (items.empty()) {
+    return 0;
+  }
+  return WriteJniNativeInterfaces(items.data(), static_cast<int>(items.size()), nullptr);
+}
+
 inline static bool IsIndexId(jmethodID mid) { return ((reinterpret_cast<uintptr_t>(mid) % 2) != 0); }
 
 static jfieldID field_art_method = nullptr;
@@ -119,11 +187,11 @@ static void *GetArtMethod(JNIEnv *env, jclass clazz, jmethodID methodId) {
   }
   if (android_api >= __ANDROID_API_R__) {
     if (IsIndexId(methodId)) {
-      jobject method = env->ToReflectedMethod(clazz, methodId, true);
-      if (!method) {
+      ScopedLocalRef<jobject> method(env, env->ToReflectedMethod(clazz, methodId, true));
+      if (!method.get()) {
         return nullptr;
       }
-      return reinterpret_cast<void *>(env->GetLongField(method, field_art_method));
+      return reinterpret_cast<void *>(env->GetLongField(method.get(), field_art_method));
     }
   }
   return methodId;
@@ -176,6 +244,67 @@ bool InitJniFunctionOffset(JNIEnv *env, jclass clazz, jmethodID methodId, void *
   return success;
 }
 
+struct ArtMethodLayout {
+  int min_api;
+  int max_api;
+  // Byte offset of ArtMethod::access_flags_
+  int access_flags_offset;
+  // Pointer sized word index of the jni entrypoint (ArtMethod::data_)
+  int jni_offset;
+};
+
+/*
+ * Known ArtMethod layouts, the fields before ptr_sized_fields_ change between versions and the pointer sized
+ * fields are aligned to the pointer size. Android 5.x ArtMethod is still a mirror object and is left to the scanner
+ */
+static constexpr ArtMethodLayout kArtMethodLayouts[] = {
+#if defined(__LP64__)
+  {__ANDROID_API_M__, __ANDROID_API_M__, 12, 5},
+  {__ANDROID_API_N__, __ANDROID_API_N_MR1__, 4, 5},
+  {__ANDROID_API_O__, __ANDROID_API_O_MR1__, 4, 4},
+  {__ANDROID_API_P__, __ANDROID_API_Q__, 4, 3},
+  {__ANDROID_API_R__, INT_MAX, 4, 2},
+#else
+  {__ANDROID_API_M__, __ANDROID_API_M__, 12, 8},
+  {__ANDROID_API_N__, __ANDROID_API_N_MR1__, 4, 7},
+  {__ANDROID_API_O__, __ANDROID_API_O_MR1__, 4, 6},
+  {__ANDROID_API_P__, __ANDROID_API_Q__, 4, 5},
+  {__ANDROID_API_R__, INT_MAX, 4, 4},
+#endif
+};
+
+/*
+ * Check the layout of the current api against a registered native method, the access flags must match and the
+ * jni entrypoint must point into the library that registered it
+ */
+static bool InitJniFunctionOffsetFromLayout(const uintptr_t *artMethod, uint32_t flags, uint32_t unmask,
+                                            const char *native_library) {
+  for (const ArtMethodLayout &layout : kArtMethodLayouts) {
+    if (api < layout.min_api || api > layout.max_api) {
+      continue;
+    }
+    uint32_t value =
+      *reinterpret_cast<const uint32_t *>(reinterpret_cast<const char *>(artMethod) + layout.access_flags_offset);
+    if ((value & 0xffff) != (flags & 0xffff) || (value & unmask) != 0) {
+      LOGW("art method access flags of api %d do not match the known layout: 0x%x", api, value);
+      return false;
+    }
+    Dl_info info;
+    void *native = reinterpret_cast<void *>(artMethod[layout.jni_offset]);
+    if (native == nullptr || dladdr(native, &info) == 0 || info.dli_fname == nullptr ||
+        strstr(info.dli_fname, native_library) == nullptr) {
+      LOGW("art method jni entrypoint of api %d does not match the known layout: %p", api, native);
+      return false;
+    }
+    jni_offset = layout.jni_offset;
+    access_flags_art_method_offset = layout.access_flags_offset;
+    LOGD("use known art method layout, jni offset: %d, access flags offset: %d", jni_offset,
+         access_flags_art_method_offset);
+    return true;
+  }
+  return false;
+}
+
 static void HookNativeFinishInit() { CHECK(false); }
 
 bool DefaultInitJniFunctionOffset(JNIEnv *env) {
@@ -199,6 +328,15 @@ bool DefaultInitJniFunctionOffset(JNIEnv *env) {
   if (!artMethod) {
     return false;
   }
+  // private static final native
+  // kAccConstructor | kAccDeclaredSynchronized | kAccClassIsProxy | kAccSkipAccessChecks |  kAccSkipHiddenapiChecks |
+  // kAccCopied kAccDefault
+  constexpr uint32_t flags = 0x11a;
+  constexpr uint32_t unmask = 0xf0000 | 0x80000000;
+  if (InitJniFunctionOffsetFromLayout(artMethod, flags, unmask, "libandroid_runtime.so")) {
+    return true;
+  }
+  // Unknown layout, re-register the method and scan for the new entrypoint
   uintptr_t backup[30];
   for (int i = 0; i < 30; ++i) {
     backup[i] = artMethod[i];
@@ -207,10 +345,7 @@ bool DefaultInitJniFunctionOffset(JNIEnv *env) {
     LOGE("Cannot re-register RuntimeInit.nativeFinishInit");
     return false;
   }
-  // private static final native
-  // kAccConstructor | kAccDeclaredSynchronized | kAccClassIsProxy | kAccSkipAccessChecks |  kAccSkipHiddenapiChecks |
-  // kAccCopied kAccDefault
-  if (InitJniFunctionOffset(env, clazz.get(), methodId, method.fnPtr, 0x11a, 0xf0000 | 0x80000000)) {
+  if (InitJniFunctionOffset(env, clazz.get(), methodId, method.fnPtr, flags, unmask)) {
     // recovery pointer
     artMethod[jni_offset] = backup[jni_offset];
     return true;
@@ -275,14 +410,19 @@ inline static bool ClearFastNativeFlag(char *art_method) {
   return api < __ANDROID_API_P__ && ClearAccessFlag(art_method, kAccFastNative);
 }
 
-int HookJavaNativeFunctions(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len) {
-  if (clazz == nullptr || items == nullptr || len < 1) {
-    LOGE("Registration class or method cannot be empty");
-    return -1;
-  }
-  int success = 0;
-  JNINativeMethod methods[1];
-  for (int i = 0; i < len; ++i) {
+struct PendingNativeHook {
+  HookRegisterNativeUnit *item;
+  char *art_method;
+  JNINativeMethod hook;
+  bool restore_fast_native;
+};
+
+/*
+ * Resolve the ArtMethod of every item once, items that cannot be hooked are dropped with a log
+ */
+static void ResolveNativeHooks(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len,
+                               std::vector<PendingNativeHook> &pending) {
+  for (size_t i = 0; i < len; ++i) {
     JNINativeMethod hook = items[i].hook_method;
     const char *sign = hook.signature;
     if (sign[0] == '!') {
@@ -297,7 +437,8 @@ int HookJavaNativeFunctions(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *i
     }
     void *artMethod = GetArtMethod(env, clazz, methodId);
     if (!artMethod) {
-      return false;
+      LOGE("Find art method failed, name: %s, signature: %s", hook.name, hook.signature);
+      continue;
     }
     void *backup = GetOriginalNativeFunction(static_cast<uintptr_t *>(artMethod));
     if (backup == hook.fnPtr) {
@@ -315,34 +456,114 @@ int HookJavaNativeFunctions(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *i
            hook.name, hook.signature, items[i].is_static);
       continue;
     }
-    bool restore = ClearFastNativeFlag(reinterpret_cast<char *>(artMethod));
     if (api >= __ANDROID_API_O__) {
       hook.signature = sign;
     }
-    methods[0] = hook;
-    if (env->RegisterNatives(clazz, methods, 1) == JNI_OK) {
+    pending.push_back(PendingNativeHook{&items[i], static_cast<char *>(artMethod), hook, false});
+  }
+}
+
+/*
+ * Write the JNI entrypoint of the ArtMethod directly, skipping RegisterNatives. The store is atomic so that
+ * concurrent callers either see the old or the new function
+ */
+static int WriteNativeEntrypoints(std::vector<PendingNativeHook> &pending) {
+  for (PendingNativeHook &entry : pending) {
+    __atomic_store_n(reinterpret_cast<uintptr_t *>(entry.art_method) + jni_offset,
+                     reinterpret_cast<uintptr_t>(entry.hook.fnPtr), __ATOMIC_RELEASE);
+  }
+  return static_cast<int>(pending.size());
+}
+
+static bool RegisterNativeHook(JNIEnv *env, jclass clazz, PendingNativeHook &entry) {
+  if (env->RegisterNatives(clazz, &entry.hook, 1) == JNI_OK) {
+    return true;
+  }
+  LOGE("register native function failed, method name: %s, sign: %s, is "
+       "static: %d",
+       entry.hook.name, entry.hook.signature, entry.item->is_static);
+  JNIHelper::PrintAndClearException(env);
+  return false;
+}
+
+static int RegisterNativeHooks(JNIEnv *env, jclass clazz, std::vector<PendingNativeHook> &pending) {
+  std::vector<JNINativeMethod> methods;
+  methods.reserve(pending.size());
+  for (PendingNativeHook &entry : pending) {
+    entry.restore_fast_native = ClearFastNativeFlag(entry.art_method);
+    methods.push_back(entry.hook);
+  }
+  // One transition for the whole class, ART stops at the first method it cannot register
+  bool all_registered = env->RegisterNatives(clazz, methods.data(), static_cast<jint>(methods.size())) == JNI_OK;
+  if (!all_registered) {
+    JNIHelper::PrintAndClearException(env);
+  }
+  int success = 0;
+  for (PendingNativeHook &entry : pending) {
+    bool registered =
+      all_registered || GetOriginalNativeFunction(reinterpret_cast<uintptr_t *>(entry.art_method)) == entry.hook.fnPtr ||
+      RegisterNativeHook(env, clazz, entry);
+    if (registered) {
       success++;
       /*
        * Android 8.0, 8.1 must clear the FastNative flag to register successfully,
        * so if it originally contained the FastNative flag, it must be restored,
        * otherwise calling the original method may cause problems
        */
-      if (restore && (api == __ANDROID_API_O__ || api == __ANDROID_API_O_MR1__)) {
-        AddAccessFlag(reinterpret_cast<char *>(artMethod), kAccFastNative);
+      if (entry.restore_fast_native && (api == __ANDROID_API_O__ || api == __ANDROID_API_O_MR1__)) {
+        AddAccessFlag(entry.art_method, kAccFastNative);
       }
     } else {
-      LOGE("register native function failed, method name: %s, sign: %s, is "
-           "static: %d",
-           hook.name, hook.signature, items[i].is_static);
-      JNIHelper::PrintAndClearException(env);
-      if (restore) {
-        AddAccessFlag(reinterpret_cast<char *>(artMethod), kAccFastNative);
+      if (entry.restore_fast_native) {
+        AddAccessFlag(entry.art_method, kAccFastNative);
       }
-      if (items[i].backup_method != nullptr) {
-        *(items[i].backup_method) = nullptr;
+      if (entry.item->backup_method != nullptr) {
+        *(entry.item->backup_method) = nullptr;
       }
     }
   }
   return success;
 }
+
+static int HookJavaNativeClass(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len,
+                               bool direct_entry) {
+  std::vector<PendingNativeHook> pending;
+  pending.reserve(len);
+  ResolveNativeHooks(env, clazz, items, len, pending);
+  if (pending.empty()) {
+    return 0;
+  }
+  if (direct_entry) {
+    return WriteNativeEntrypoints(pending);
+  }
+  return RegisterNativeHooks(env, clazz, pending);
+}
+
+int HookJavaNativeFunctions(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len) {
+  if (clazz == nullptr || items == nullptr || len < 1) {
+    LOGE("Registration class or method cannot be empty");
+    return -1;
+  }
+  return HookJavaNativeClass(env, clazz, items, len, false);
+}
+
+int HookJavaNativeClasses(JNIEnv *env, HookJavaClassUnit *classes, size_t len, bool direct_entry) {
+  if (env == nullptr || classes == nullptr || len < 1) {
+    LOGE("Registration classes cannot be empty");
+    return -1;
+  }
+  if (direct_entry && jni_offset == -1 && !DefaultInitJniFunctionOffset(env)) {
+    LOGW("The jni entrypoint offset of art method is unknown, fall back to RegisterNatives");
+    direct_entry = false;
+  }
+  int success = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (classes[i].clazz == nullptr || classes[i].items == nullptr || classes[i].len < 1) {
+      LOGE("Registration class or method cannot be empty, index: %zu", i);
+      continue;
+    }
+    success += HookJavaNativeClass(env, classes[i].clazz, classes[i].items, classes[i].len, direct_entry);
+  }
+  return success;
+}
 } // namespace fakelinker
\ No newline at end of file
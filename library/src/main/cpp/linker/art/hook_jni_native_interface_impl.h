@@ -20,8 +20,30 @@ FakeLinkerError HookJniNativeInterface(int function_offset, void *hook_method, v
 
 int HookJniNativeInterfaces(HookJniUnit *items, int len);
 
+/**
+ * @brief Queue a JNINativeInterface hook, nothing is written until CommitJniNativeInterfaces
+ *
+ * @return FakeLinkerError    Return the parameter check error code
+ */
+FakeLinkerError QueueJniNativeInterface(int function_offset, void *hook_method, void **backup_method);
+
+/**
+ * @brief Write all queued hooks with a single unlock of the table
+ *
+ * @return int    Number of successful hooks, -1 if the table could not be unlocked
+ */
+int CommitJniNativeInterfaces();
+
 int HookJavaNativeFunctions(JNIEnv *env, jclass clazz, HookRegisterNativeUnit *items, size_t len);
 
+/**
+ * @brief Hook the native methods of several classes, each class is registered with a single RegisterNatives
+ *
+ * @param  direct_entry    Write the jni entrypoint of the ArtMethod directly instead of calling RegisterNatives
+ * @return int             Number of successful hooks, -1 if the parameters are invalid
+ */
+int HookJavaNativeClasses(JNIEnv *env, HookJavaClassUnit *classes, size_t len, bool direct_entry);
+
 bool InitJniFunctionOffset(JNIEnv *env, jclass clazz, jmethodID methodId, void *native, uint32_t flags,
                            uint32_t unmask);
 
@@ -1,9 +1,109 @@
 #include <fakelinker/alog.h>
+#include <fakelinker/elf_reader.h>
 #include <fakelinker/symbol_resolver.h>
 
+#include <cxxabi.h>
+
+#include <algorithm>
+
 #include "../linker_globals.h"
 
 namespace fakelinker {
+
+struct FunctionSymbol {
+  uintptr_t address;
+  uintptr_t size;
+  const char *name;
+};
+
+struct SymbolResolver::FunctionTable {
+  // Sorted by address, one symbol per address
+  std::vector<FunctionSymbol> symbols;
+  // Owns the .symtab strings, .dynsym strings live in the loaded library
+  ElfReader disk;
+};
+
+// .dynsym has no size in the dynamic section, count it through the hash table
+static size_t DynamicSymbolCount(const ElfReader &reader) {
+  if (reader.nbucket_ != 0) {
+    return reader.nchain_;
+  }
+  if (reader.gnu_nbucket_ == 0) {
+    return 0;
+  }
+  uint32_t last = 0;
+  for (size_t i = 0; i < reader.gnu_nbucket_; ++i) {
+    last = std::max(last, reader.gnu_bucket_[i]);
+  }
+  if (last < reader.gnu_symbias_) {
+    return reader.gnu_symbias_;
+  }
+  // The last symbol of a chain has the lowest bit set
+  while ((reader.gnu_chain_[last] & 1) == 0) {
+    ++last;
+  }
+  return last + 1;
+}
+
+static void AddFunctionSymbol(std::vector<FunctionSymbol> &symbols, ElfW(Addr) load_bias, const ElfW(Sym) * sym,
+                              const char *name) {
+  auto st_type = ELF_ST_TYPE(sym->st_info);
+  if ((st_type != STT_FUNC && st_type != STT_GNU_IFUNC) || sym->st_shndx == SHN_UNDEF || sym->st_value == 0 ||
+      name == nullptr || name[0] == '\0') {
+    return;
+  }
+  uintptr_t address = static_cast<uintptr_t>(load_bias + sym->st_value);
+#if defined(__arm__)
+  // Thumb functions have the lowest bit set
+  address &= ~static_cast<uintptr_t>(1);
+#endif
+  symbols.push_back(FunctionSymbol{.address = address, .size = static_cast<uintptr_t>(sym->st_size), .name = name});
+}
+
+const SymbolResolver::FunctionTable *SymbolResolver::LoadFunctionTable(const char *library) {
+  auto table = new FunctionTable();
+  ElfReader memory;
+  if (memory.LoadFromMemory(library)) {
+    size_t count = DynamicSymbolCount(memory);
+    for (size_t i = 0; i < count; ++i) {
+      const ElfW(Sym) *sym = memory.symtab_ + i;
+      AddFunctionSymbol(table->symbols, memory.load_bias(), sym, memory.get_string(sym->st_name));
+    }
+  }
+  // Local functions are only in .symtab, or in the .symtab of .gnu_debugdata of stripped libraries
+  if (table->disk.LoadFromDisk(library)) {
+    table->disk.IterateInternalSymbols([&](std::string_view name, const ElfW(Sym) * sym) {
+      AddFunctionSymbol(table->symbols, table->disk.load_bias(), sym, name.data());
+      return false;
+    });
+  }
+  std::stable_sort(table->symbols.begin(), table->symbols.end(),
+                   [](const FunctionSymbol &a, const FunctionSymbol &b) { return a.address < b.address; });
+  // Aliases share an address, keep the first one that has a size
+  std::vector<FunctionSymbol> unique;
+  unique.reserve(table->symbols.size());
+  for (auto &symbol : table->symbols) {
+    if (!unique.empty() && unique.back().address == symbol.address) {
+      if (unique.back().size == 0) {
+        unique.back() = symbol;
+      }
+      continue;
+    }
+    unique.push_back(symbol);
+  }
+  table->symbols.swap(unique);
+  LOGD("SymbolResolver read %zu function symbols of %s", table->symbols.size(), library);
+  return table;
+}
+
+SymbolResolver::LibraryItem::~LibraryItem() { delete functions.load(std::memory_order_acquire); }
+
+SymbolResolver::~SymbolResolver() {
+  for (auto &entry : format_cache_) {
+    delete entry.load(std::memory_order_acquire);
+  }
+}
+
 bool SymbolResolver::AddLibrary(const std::string &name) {
   soinfo *so = ProxyLinker::Get().FindSoinfoByName(name.c_str());
   if (so == nullptr) {
@@ -14,14 +114,13 @@ bool SymbolResolver::AddLibrary(const std::string &name) {
 }
 
 bool SymbolResolver::AddAddressRange(const std::string &name, uintptr_t start, uintptr_t end) {
-  return libraries_
-    .try_emplace(start,
-                 LibraryItem{
-                   .start = start,
-                   .end = end,
-                   .name = name,
-                 })
-    .second;
+  auto [itr, inserted] = libraries_.try_emplace(start);
+  if (inserted) {
+    itr->second.start = start;
+    itr->second.end = end;
+    itr->second.name = name;
+  }
+  return inserted;
 }
 
 std::string SymbolResolver::FormatAddress(uintptr_t address, bool default_format, const std::string &head) {
@@ -34,7 +133,19 @@ std::string SymbolResolver::FormatAddress(uintptr_t address, bool default_format
 
 bool SymbolResolver::FormatAddressFromBuffer(char *&buffer, size_t max_length, uintptr_t address, bool default_format,
                                              const std::string &head) {
-  if (LibraryItem *item = FindLibrary(address)) {
+  LibraryItem *item = FindLibrary(address);
+  if (item != nullptr && function_symbols_.load(std::memory_order_relaxed)) {
+    TraceEpoch::ReadGuard guard;
+    const std::string &location = FormatLocation(item, address);
+    if (head.empty()) {
+      buffer += snprintf(buffer, max_length, "%p [%s]", reinterpret_cast<void *>(address), location.c_str());
+    } else {
+      buffer +=
+        snprintf(buffer, max_length, "%s %p [%s]", head.c_str(), reinterpret_cast<void *>(address), location.c_str());
+    }
+    return true;
+  }
+  if (item != nullptr) {
     if (head.empty()) {
       buffer += snprintf(buffer, max_length, "%p [%s!%p]", reinterpret_cast<void *>(address), item->name.c_str(),
                          reinterpret_cast<void *>(address - item->start));
@@ -60,11 +171,74 @@ bool SymbolResolver::ResolveSymbol(uintptr_t address, SymbolResolver::SymbolResu
     result.end = item->end;
     result.name = item->name.c_str();
     result.offset = address - item->start;
+    result.symbol = nullptr;
+    result.symbol_offset = 0;
+    if (function_symbols_.load(std::memory_order_relaxed)) {
+      result.symbol = FindFunction(item, address, result.symbol_offset);
+    }
     return true;
   }
   return false;
 }
 
+const char *SymbolResolver::FindFunction(LibraryItem *item, uintptr_t address, uintptr_t &offset) {
+  const FunctionTable *table = item->functions.load(std::memory_order_acquire);
+  if (table == nullptr) {
+    // Threads racing on the first query read the library each, the first one to finish is kept
+    const FunctionTable *loaded = LoadFunctionTable(item->name.c_str());
+    if (item->functions.compare_exchange_strong(table, loaded, std::memory_order_acq_rel)) {
+      table = loaded;
+    } else {
+      delete loaded;
+    }
+  }
+  const std::vector<FunctionSymbol> &symbols = table->symbols;
+  auto itr = std::upper_bound(symbols.begin(), symbols.end(), address,
+                              [](uintptr_t value, const FunctionSymbol &symbol) { return value < symbol.address; });
+  if (itr == symbols.begin()) {
+    return nullptr;
+  }
+  --itr;
+  // Symbols without a size cover everything up to the next symbol
+  if (itr->size != 0 && address - itr->address >= itr->size) {
+    return nullptr;
+  }
+  offset = address - itr->address;
+  return itr->name;
+}
+
+const std::string &SymbolResolver::FormatLocation(LibraryItem *item, uintptr_t address) {
+  static_assert(kFormatCacheSize == 1024, "the hash takes the top 10 bits");
+  size_t index = (static_cast<uint64_t>(address) * 0x9E3779B97F4A7C15ULL) >> 54;
+  std::atomic<const FormatEntry *> &slot = format_cache_[index];
+  const FormatEntry *cached = slot.load(std::memory_order_acquire);
+  if (cached != nullptr && cached->address == address) {
+    return cached->location;
+  }
+  char location[512];
+  uintptr_t offset = 0;
+  if (const char *symbol = FindFunction(item, address, offset)) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
+    const char *function = status == 0 && demangled != nullptr ? demangled : symbol;
+    if (offset == 0) {
+      snprintf(location, sizeof(location), "%s!%s", item->name.c_str(), function);
+    } else {
+      snprintf(location, sizeof(location), "%s!%s+%p", item->name.c_str(), function, reinterpret_cast<void *>(offset));
+    }
+    free(demangled);
+  } else {
+    snprintf(location, sizeof(location), "%s!%p", item->name.c_str(), reinterpret_cast<void *>(address - item->start));
+  }
+  auto entry = new FormatEntry{.address = address, .location = location};
+  const FormatEntry *replaced = slot.exchange(entry, std::memory_order_acq_rel);
+  pthread_mutex_lock(&retired_mutex_);
+  retired_entries_.Retire(replaced);
+  pthread_mutex_unlock(&retired_mutex_);
+  // Still protected by the ReadGuard of the caller if another thread replaces it right away
+  return entry->location;
+}
+
 
 SymbolResolver::LibraryItem *SymbolResolver::FindLibrary(uintptr_t address) {
   auto itr = libraries_.upper_bound(address);
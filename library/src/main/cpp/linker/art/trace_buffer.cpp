@@ -0,0 +1,423 @@
+//
+// Binary JNI trace records, per-thread single producer single consumer rings and their drain thread
+//
+
+#include <fakelinker/trace_buffer.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include <fakelinker/alog.h>
+#include <fakelinker/macros.h>
+
+namespace fakelinker {
+
+static const char *const kJNIFunctionNames[] = {
+  nullptr,
+  nullptr,
+  nullptr,
+  nullptr,
+  "GetVersion",
+  "DefineClass",
+  "FindClass",
+  "FromReflectedMethod",
+  "FromReflectedField",
+  "ToReflectedMethod",
+  "GetSuperclass",
+  "IsAssignableFrom",
+  "ToReflectedField",
+  "Throw",
+  "ThrowNew",
+  "ExceptionOccurred",
+  "ExceptionDescribe",
+  "ExceptionClear",
+  "FatalError",
+  "PushLocalFrame",
+  "PopLocalFrame",
+  "NewGlobalRef",
+  "DeleteGlobalRef",
+  "DeleteLocalRef",
+  "IsSameObject",
+  "NewLocalRef",
+  "EnsureLocalCapacity",
+  "AllocObject",
+  "NewObject",
+  "NewObjectV",
+  "NewObjectA",
+  "GetObjectClass",
+  "IsInstanceOf",
+  "GetMethodID",
+  "CallObjectMethod",
+  "CallObjectMethodV",
+  "CallObjectMethodA",
+  "CallBooleanMethod",
+  "CallBooleanMethodV",
+  "CallBooleanMethodA",
+  "CallByteMethod",
+  "CallByteMethodV",
+  "CallByteMethodA",
+  "CallCharMethod",
+  "CallCharMethodV",
+  "CallCharMethodA",
+  "CallShortMethod",
+  "CallShortMethodV",
+  "CallShortMethodA",
+  "CallIntMethod",
+  "CallIntMethodV",
+  "CallIntMethodA",
+  "CallLongMethod",
+  "CallLongMethodV",
+  "CallLongMethodA",
+  "CallFloatMethod",
+  "CallFloatMethodV",
+  "CallFloatMethodA",
+  "CallDoubleMethod",
+  "CallDoubleMethodV",
+  "CallDoubleMethodA",
+  "CallVoidMethod",
+  "CallVoidMethodV",
+  "CallVoidMethodA",
+  "CallNonvirtualObjectMethod",
+  "CallNonvirtualObjectMethodV",
+  "CallNonvirtualObjectMethodA",
+  "CallNonvirtualBooleanMethod",
+  "CallNonvirtualBooleanMethodV",
+  "CallNonvirtualBooleanMethodA",
+  "CallNonvirtualByteMethod",
+  "CallNonvirtualByteMethodV",
+  "CallNonvirtualByteMethodA",
+  "CallNonvirtualCharMethod",
+  "CallNonvirtualCharMethodV",
+  "CallNonvirtualCharMethodA",
+  "CallNonvirtualShortMethod",
+  "CallNonvirtualShortMethodV",
+  "CallNonvirtualShortMethodA",
+  "CallNonvirtualIntMethod",
+  "CallNonvirtualIntMethodV",
+  "CallNonvirtualIntMethodA",
+  "CallNonvirtualLongMethod",
+  "CallNonvirtualLongMethodV",
+  "CallNonvirtualLongMethodA",
+  "CallNonvirtualFloatMethod",
+  "CallNonvirtualFloatMethodV",
+  "CallNonvirtualFloatMethodA",
+  "CallNonvirtualDoubleMethod",
+  "CallNonvirtualDoubleMethodV",
+  "CallNonvirtualDoubleMethodA",
+  "CallNonvirtualVoidMethod",
+  "CallNonvirtualVoidMethodV",
+  "CallNonvirtualVoidMethodA",
+  "GetFieldID",
+  "GetObjectField",
+  "GetBooleanField",
+  "GetByteField",
+  "GetCharField",
+  "GetShortField",
+  "GetIntField",
+  "GetLongField",
+  "GetFloatField",
+  "GetDoubleField",
+  "SetObjectField",
+  "SetBooleanField",
+  "SetByteField",
+  "SetCharField",
+  "SetShortField",
+  "SetIntField",
+  "SetLongField",
+  "SetFloatField",
+  "SetDoubleField",
+  "GetStaticMethodID",
+  "CallStaticObjectMethod",
+  "CallStaticObjectMethodV",
+  "CallStaticObjectMethodA",
+  "CallStaticBooleanMethod",
+  "CallStaticBooleanMethodV",
+  "CallStaticBooleanMethodA",
+  "CallStaticByteMethod",
+  "CallStaticByteMethodV",
+  "CallStaticByteMethodA",
+  "CallStaticCharMethod",
+  "CallStaticCharMethodV",
+  "CallStaticCharMethodA",
+  "CallStaticShortMethod",
+  "CallStaticShortMethodV",
+  "CallStaticShortMethodA",
+  "CallStaticIntMethod",
+  "CallStaticIntMethodV",
+  "CallStaticIntMethodA",
+  "CallStaticLongMethod",
+  "CallStaticLongMethodV",
+  "CallStaticLongMethodA",
+  "CallStaticFloatMethod",
+  "CallStaticFloatMethodV",
+  "CallStaticFloatMethodA",
+  "CallStaticDoubleMethod",
+  "CallStaticDoubleMethodV",
+  "CallStaticDoubleMethodA",
+  "CallStaticVoidMethod",
+  "CallStaticVoidMethodV",
+  "CallStaticVoidMethodA",
+  "GetStaticFieldID",
+  "GetStaticObjectField",
+  "GetStaticBooleanField",
+  "GetStaticByteField",
+  "GetStaticCharField",
+  "GetStaticShortField",
+  "GetStaticIntField",
+  "GetStaticLongField",
+  "GetStaticFloatField",
+  "GetStaticDoubleField",
+  "SetStaticObjectField",
+  "SetStaticBooleanField",
+  "SetStaticByteField",
+  "SetStaticCharField",
+  "SetStaticShortField",
+  "SetStaticIntField",
+  "SetStaticLongField",
+  "SetStaticFloatField",
+  "SetStaticDoubleField",
+  "NewString",
+  "GetStringLength",
+  "GetStringChars",
+  "ReleaseStringChars",
+  "NewStringUTF",
+  "GetStringUTFLength",
+  "GetStringUTFChars",
+  "ReleaseStringUTFChars",
+  "GetArrayLength",
+  "NewObjectArray",
+  "GetObjectArrayElement",
+  "SetObjectArrayElement",
+  "NewBooleanArray",
+  "NewByteArray",
+  "NewCharArray",
+  "NewShortArray",
+  "NewIntArray",
+  "NewLongArray",
+  "NewFloatArray",
+  "NewDoubleArray",
+  "GetBooleanArrayElements",
+  "GetByteArrayElements",
+  "GetCharArrayElements",
+  "GetShortArrayElements",
+  "GetIntArrayElements",
+  "GetLongArrayElements",
+  "GetFloatArrayElements",
+  "GetDoubleArrayElements",
+  "ReleaseBooleanArrayElements",
+  "ReleaseByteArrayElements",
+  "ReleaseCharArrayElements",
+  "ReleaseShortArrayElements",
+  "ReleaseIntArrayElements",
+  "ReleaseLongArrayElements",
+  "ReleaseFloatArrayElements",
+  "ReleaseDoubleArrayElements",
+  "GetBooleanArrayRegion",
+  "GetByteArrayRegion",
+  "GetCharArrayRegion",
+  "GetShortArrayRegion",
+  "GetIntArrayRegion",
+  "GetLongArrayRegion",
+  "GetFloatArrayRegion",
+  "GetDoubleArrayRegion",
+  "SetBooleanArrayRegion",
+  "SetByteArrayRegion",
+  "SetCharArrayRegion",
+  "SetShortArrayRegion",
+  "SetIntArrayRegion",
+  "SetLongArrayRegion",
+  "SetFloatArrayRegion",
+  "SetDoubleArrayRegion",
+  "RegisterNatives",
+  "UnregisterNatives",
+  "MonitorEnter",
+  "MonitorExit",
+  "GetJavaVM",
+  "GetStringRegion",
+  "GetStringUTFRegion",
+  "GetPrimitiveArrayCritical",
+  "ReleasePrimitiveArrayCritical",
+  "GetStringCritical",
+  "ReleaseStringCritical",
+  "NewWeakGlobalRef",
+  "DeleteWeakGlobalRef",
+  "ExceptionCheck",
+  "NewDirectByteBuffer",
+  "GetDirectBufferAddress",
+  "GetDirectBufferCapacity",
+  "GetObjectRefType",
+};
+
+const char *GetJNIFunctionName(size_t index) {
+  return index < sizeof(kJNIFunctionNames) / sizeof(kJNIFunctionNames[0]) ? kJNIFunctionNames[index] : nullptr;
+}
+
+int FindJNIFunctionIndex(const char *name) {
+  for (size_t i = 0; i < sizeof(kJNIFunctionNames) / sizeof(kJNIFunctionNames[0]); ++i) {
+    if (kJNIFunctionNames[i] != nullptr && strcmp(kJNIFunctionNames[i], name) == 0) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+static constexpr size_t kRingMask = TraceBuffer::kRingCapacity - 1;
+static_assert((TraceBuffer::kRingCapacity & kRingMask) == 0, "ring capacity must be a power of two");
+
+struct TraceRing {
+  // Written by the owner thread only
+  alignas(64) std::atomic<uint64_t> head{0};
+  // Written by the drain thread only
+  alignas(64) std::atomic<uint64_t> tail{0};
+  // Set when the owner thread exited, the ring is reused after it was drained
+  std::atomic<bool> released{false};
+  TraceRecord records[TraceBuffer::kRingCapacity];
+};
+
+static pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_rings_mutex, rings are never freed so the drain thread can use them without the lock
+static std::vector<TraceRing *> g_rings;
+static std::vector<TraceRing *> g_free_rings;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+static thread_local TraceRing *t_ring = nullptr;
+
+static std::atomic<bool> g_running{false};
+static std::atomic<bool> g_stop{false};
+static pthread_t g_drain_thread;
+static TraceRecordSink g_sink = nullptr;
+static void *g_sink_opaque = nullptr;
+static uint32_t g_interval_ms = 20;
+static std::atomic<uint64_t> g_dropped{0};
+static std::atomic<uint64_t> g_drained{0};
+
+static void ReleaseRing(void *ring) {
+  // A JNI call later in the thread teardown takes a new ring, this one may already belong to another thread
+  t_ring = nullptr;
+  static_cast<TraceRing *>(ring)->released.store(true, std::memory_order_release);
+}
+
+static void CreateRingKey() { pthread_key_create(&g_ring_key, ReleaseRing); }
+
+static TraceRing *AcquireRing() {
+  pthread_once(&g_ring_key_once, CreateRingKey);
+  TraceRing *ring = nullptr;
+  pthread_mutex_lock(&g_rings_mutex);
+  if (!g_free_rings.empty()) {
+    ring = g_free_rings.back();
+    g_free_rings.pop_back();
+  } else {
+    ring = new TraceRing();
+    g_rings.push_back(ring);
+  }
+  pthread_mutex_unlock(&g_rings_mutex);
+  ring->released.store(false, std::memory_order_relaxed);
+  pthread_setspecific(g_ring_key, ring);
+  return ring;
+}
+
+bool TraceBuffer::Record(const TraceRecord &record) {
+  if (__predict_false(!g_running.load(std::memory_order_relaxed))) {
+    return false;
+  }
+  TraceRing *ring = t_ring;
+  if (__predict_false(ring == nullptr)) {
+    ring = t_ring = AcquireRing();
+  }
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= kRingCapacity) {
+    g_dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  ring->records[head & kRingMask] = record;
+  ring->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+static size_t DrainRing(TraceRing *ring) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  if (head == tail) {
+    return 0;
+  }
+  size_t count = head - tail;
+  size_t first = tail & kRingMask;
+  // At most two contiguous parts when the ring wrapped
+  size_t part = std::min(count, TraceBuffer::kRingCapacity - first);
+  g_sink(&ring->records[first], part, g_sink_opaque);
+  if (part < count) {
+    g_sink(&ring->records[0], count - part, g_sink_opaque);
+  }
+  ring->tail.store(head, std::memory_order_release);
+  g_drained.fetch_add(count, std::memory_order_relaxed);
+  return count;
+}
+
+static void DrainAll() {
+  pthread_mutex_lock(&g_rings_mutex);
+  size_t ring_count = g_rings.size();
+  pthread_mutex_unlock(&g_rings_mutex);
+  for (size_t i = 0; i < ring_count; ++i) {
+    pthread_mutex_lock(&g_rings_mutex);
+    TraceRing *ring = g_rings[i];
+    pthread_mutex_unlock(&g_rings_mutex);
+    bool released = ring->released.load(std::memory_order_acquire);
+    DrainRing(ring);
+    if (released) {
+      // The owner is gone, nothing can be appended any more
+      pthread_mutex_lock(&g_rings_mutex);
+      if (ring->released.exchange(false, std::memory_order_relaxed)) {
+        g_free_rings.push_back(ring);
+      }
+      pthread_mutex_unlock(&g_rings_mutex);
+    }
+  }
+}
+
+static void *DrainThread(void *) {
+  timespec interval{static_cast<time_t>(g_interval_ms / 1000), static_cast<long>(g_interval_ms % 1000) * 1000000};
+  while (!g_stop.load(std::memory_order_acquire)) {
+    DrainAll();
+    nanosleep(&interval, nullptr);
+  }
+  DrainAll();
+  return nullptr;
+}
+
+bool TraceBuffer::Start(TraceRecordSink sink, void *opaque, uint32_t interval_ms) {
+  if (sink == nullptr || g_running.load(std::memory_order_acquire)) {
+    return false;
+  }
+  g_sink = sink;
+  g_sink_opaque = opaque;
+  g_interval_ms = interval_ms == 0 ? 1 : interval_ms;
+  g_stop.store(false, std::memory_order_relaxed);
+  if (int code = pthread_create(&g_drain_thread, nullptr, DrainThread, nullptr)) {
+    LOGE("create trace drain thread failed: %d", code);
+    return false;
+  }
+  g_running.store(true, std::memory_order_release);
+  return true;
+}
+
+void TraceBuffer::Stop() {
+  if (!g_running.exchange(false, std::memory_order_acq_rel)) {
+    return;
+  }
+  g_stop.store(true, std::memory_order_release);
+  pthread_join(g_drain_thread, nullptr);
+}
+
+bool TraceBuffer::IsRunning() { return g_running.load(std::memory_order_acquire); }
+
+uint64_t TraceBuffer::DroppedRecords() { return g_dropped.load(std::memory_order_relaxed); }
+
+uint64_t TraceBuffer::DrainedRecords() { return g_drained.load(std::memory_order_relaxed); }
+
+} // namespace fakelinker
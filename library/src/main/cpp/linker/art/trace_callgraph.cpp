@@ -0,0 +1,271 @@
+//
+// Aggregated JNI call graph, one open addressing table shared by all threads
+//
+
+#include <fakelinker/trace_callgraph.h>
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <map>
+#include <tuple>
+
+#include <fakelinker/alog.h>
+#include <fakelinker/macros.h>
+#include <fakelinker/trace_latency.h>
+
+namespace fakelinker {
+
+static constexpr size_t kMaxProbes = 32;
+
+struct CallGraphSlot {
+  // Hash of the key with the lowest bit set, 0 is a free slot
+  std::atomic<uint64_t> tag{0};
+  // The key fields are written once by the thread that claimed the slot, then ready is set
+  std::atomic<bool> ready{false};
+  uint8_t function = 0;
+  uint8_t member_type = 0;
+  uint64_t caller = 0;
+  uint64_t member = 0;
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+};
+
+std::atomic<bool> TraceCallGraph::enabled_{false};
+
+// Allocated on the first enable and never freed, recording threads may still hold it
+static std::atomic<CallGraphSlot *> g_slots{nullptr};
+static std::atomic<uint64_t> g_overflow{0};
+
+static uint64_t HashKey(uint8_t function, uint8_t member_type, uint64_t caller, uint64_t member) {
+  uint64_t hash = caller * 0x9E3779B97F4A7C15ULL;
+  hash ^= (member + (static_cast<uint64_t>(function) << 8 | member_type)) * 0xC2B2AE3D27D4EB4FULL;
+  hash ^= hash >> 29;
+  return hash * 0x165667B19E3779F9ULL;
+}
+
+static bool SameKey(const CallGraphSlot &slot, uint8_t function, uint8_t member_type, uint64_t caller,
+                    uint64_t member) {
+  // Never wait for the claiming thread, it may be preempted or be this thread interrupted by a signal handler.
+  // The tuple then gets a second slot, the reports merge them
+  if (!slot.ready.load(std::memory_order_acquire)) {
+    return false;
+  }
+  return slot.function == function && slot.member_type == member_type && slot.caller == caller &&
+         slot.member == member;
+}
+
+void TraceCallGraph::SetEnabled(bool enable) {
+  if (enable && g_slots.load(std::memory_order_acquire) == nullptr) {
+    CallGraphSlot *slots = new CallGraphSlot[kCapacity];
+    CallGraphSlot *expected = nullptr;
+    if (!g_slots.compare_exchange_strong(expected, slots, std::memory_order_acq_rel)) {
+      delete[] slots;
+    }
+  }
+  TraceLatencyStats::SetTimingUser(TraceLatencyStats::kCallGraph, enable);
+  enabled_.store(enable, std::memory_order_release);
+}
+
+void TraceCallGraph::Record(size_t function_index, const void *caller, TraceMember member, uint64_t duration_ns) {
+  CallGraphSlot *slots = g_slots.load(std::memory_order_acquire);
+  if (__predict_false(slots == nullptr)) {
+    return;
+  }
+  uint8_t function = static_cast<uint8_t>(function_index);
+  uint8_t member_type = static_cast<uint8_t>(member.type);
+  uint64_t pc = reinterpret_cast<uintptr_t>(caller);
+  uint64_t tag = HashKey(function, member_type, pc, member.value) | 1;
+  static_assert(kCapacity == 16384, "the hash takes the top 14 bits");
+  size_t index = tag >> (64 - 14);
+  for (size_t probe = 0; probe < kMaxProbes; ++probe) {
+    CallGraphSlot &slot = slots[(index + probe) % kCapacity];
+    uint64_t current = slot.tag.load(std::memory_order_acquire);
+    if (current == 0) {
+      if (slot.tag.compare_exchange_strong(current, tag, std::memory_order_acq_rel)) {
+        slot.function = function;
+        slot.member_type = member_type;
+        slot.caller = pc;
+        slot.member = member.value;
+        slot.ready.store(true, std::memory_order_release);
+        current = tag;
+      }
+    }
+    if (current == tag && SameKey(slot, function, member_type, pc, member.value)) {
+      slot.count.fetch_add(1, std::memory_order_relaxed);
+      slot.total_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+      return;
+    }
+  }
+  g_overflow.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<TraceCallGraphEntry> TraceCallGraph::Snapshot() {
+  std::vector<TraceCallGraphEntry> result;
+  CallGraphSlot *slots = g_slots.load(std::memory_order_acquire);
+  if (slots == nullptr) {
+    return result;
+  }
+  for (size_t i = 0; i < kCapacity; ++i) {
+    CallGraphSlot &slot = slots[i];
+    if (!slot.ready.load(std::memory_order_acquire)) {
+      continue;
+    }
+    uint64_t count = slot.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+      continue;
+    }
+    result.push_back(TraceCallGraphEntry{
+      .caller = slot.caller,
+      .member = TraceMember{static_cast<TraceValueType>(slot.member_type), slot.member},
+      .function = slot.function,
+      .count = count,
+      .total_ns = slot.total_ns.load(std::memory_order_relaxed),
+    });
+  }
+  return result;
+}
+
+void TraceCallGraph::Reset() {
+  CallGraphSlot *slots = g_slots.load(std::memory_order_acquire);
+  if (slots != nullptr) {
+    for (size_t i = 0; i < kCapacity; ++i) {
+      slots[i].count.store(0, std::memory_order_relaxed);
+      slots[i].total_ns.store(0, std::memory_order_relaxed);
+    }
+  }
+  g_overflow.store(0, std::memory_order_relaxed);
+}
+
+uint64_t TraceCallGraph::Overflow() { return g_overflow.load(std::memory_order_relaxed); }
+
+// Callers are printed as "libfoo.so+0x1234", or only "libfoo.so" when grouped by library
+static std::string FormatCaller(uint64_t caller, bool by_library) {
+  Dl_info info;
+  char buf[64];
+  if (dladdr(reinterpret_cast<void *>(caller), &info) == 0 || info.dli_fname == nullptr) {
+    if (by_library) {
+      return "unknown";
+    }
+    snprintf(buf, sizeof(buf), "0x%" PRIx64, caller);
+    return buf;
+  }
+  const char *name = strrchr(info.dli_fname, '/');
+  std::string result = name ? name + 1 : info.dli_fname;
+  if (!by_library) {
+    snprintf(buf, sizeof(buf), "+0x%" PRIx64, caller - reinterpret_cast<uintptr_t>(info.dli_fbase));
+    result += buf;
+  }
+  return result;
+}
+
+static std::string FormatMember(TraceMember member, TraceMemberDescriber describe, void *opaque) {
+  if (member.type == kTVNone) {
+    return std::string();
+  }
+  if (describe != nullptr) {
+    if (const char *description = describe(member, opaque)) {
+      return description;
+    }
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s 0x%" PRIx64, member.type == kTVMethodID ? "method" : "field", member.value);
+  return buf;
+}
+
+struct CallGraphLine {
+  std::string caller;
+  uint8_t function;
+  TraceMember member;
+  uint64_t count;
+  uint64_t total_ns;
+};
+
+// Merges the entries whose callers format to the same text, also the rare second slot of a tuple
+static std::vector<CallGraphLine> MergeEntries(bool by_library) {
+  std::vector<TraceCallGraphEntry> entries = TraceCallGraph::Snapshot();
+  std::map<uint64_t, std::string> callers;
+  std::map<std::tuple<std::string, uint8_t, uint8_t, uint64_t>, size_t> lines_index;
+  std::vector<CallGraphLine> lines;
+  for (auto &entry : entries) {
+    auto it = callers.find(entry.caller);
+    if (it == callers.end()) {
+      it = callers.emplace(entry.caller, FormatCaller(entry.caller, by_library)).first;
+    }
+    auto key = std::make_tuple(it->second, entry.function, static_cast<uint8_t>(entry.member.type), entry.member.value);
+    auto [line, inserted] = lines_index.emplace(key, lines.size());
+    if (inserted) {
+      lines.push_back(CallGraphLine{it->second, entry.function, entry.member, 0, 0});
+    }
+    lines[line->second].count += entry.count;
+    lines[line->second].total_ns += entry.total_ns;
+  }
+  return lines;
+}
+
+std::string TraceCallGraph::DumpTop(size_t top_n, bool by_library, TraceMemberDescriber describe, void *opaque) {
+  std::vector<CallGraphLine> lines = MergeEntries(by_library);
+  std::sort(lines.begin(), lines.end(), [](const CallGraphLine &a, const CallGraphLine &b) {
+    return a.count != b.count ? a.count > b.count : a.total_ns > b.total_ns;
+  });
+  std::string result;
+  char line[256];
+  snprintf(line, sizeof(line), "%10s %12s %-32s %-32s %s\n", "count", "total(us)", "caller", "function", "member");
+  result += line;
+  for (size_t i = 0; i < lines.size() && (top_n == 0 || i < top_n); ++i) {
+    const char *function = GetJNIFunctionName(lines[i].function);
+    snprintf(line, sizeof(line), "%10" PRIu64 " %12.1f %-32s %-32s ", lines[i].count, lines[i].total_ns / 1000.0,
+             lines[i].caller.c_str(), function ? function : "unknown");
+    result += line;
+    result += FormatMember(lines[i].member, describe, opaque);
+    result += '\n';
+  }
+  if (uint64_t overflow = Overflow()) {
+    snprintf(line, sizeof(line), "%" PRIu64 " calls not counted, the call graph table is full\n", overflow);
+    result += line;
+  }
+  return result;
+}
+
+// ';' separates the frames and the last space separates the weight in the folded format
+static void AppendFrame(std::string &out, const std::string &frame) {
+  if (!out.empty()) {
+    out += ';';
+  }
+  for (char c : frame) {
+    out += c == ';' ? ',' : c == '\n' ? ' ' : c;
+  }
+}
+
+bool TraceCallGraph::WriteFolded(const char *path, bool by_library, bool weight_by_time, TraceMemberDescriber describe,
+                                 void *opaque) {
+  FILE *file = fopen(path, "we");
+  if (file == nullptr) {
+    LOGE("open call graph file %s failed: %s", path, strerror(errno));
+    return false;
+  }
+  std::vector<CallGraphLine> lines = MergeEntries(by_library);
+  std::string stack;
+  for (auto &line : lines) {
+    uint64_t weight = weight_by_time ? line.total_ns : line.count;
+    if (weight == 0) {
+      continue;
+    }
+    const char *function = GetJNIFunctionName(line.function);
+    stack.clear();
+    AppendFrame(stack, line.caller);
+    AppendFrame(stack, function ? function : "unknown");
+    if (line.member.type != kTVNone) {
+      AppendFrame(stack, FormatMember(line.member, describe, opaque));
+    }
+    fprintf(file, "%s %" PRIu64 "\n", stack.c_str(), weight);
+  }
+  bool success = ferror(file) == 0;
+  return fclose(file) == 0 && success;
+}
+
+} // namespace fakelinker
@@ -0,0 +1,91 @@
+//
+// Epoch based reclamation of the immutable tables that tracing threads read without locks
+//
+
+#include <fakelinker/trace_epoch.h>
+
+#include <pthread.h>
+
+#include <atomic>
+
+#include <fakelinker/macros.h>
+
+namespace fakelinker {
+
+struct TraceEpochSlot {
+  // Epoch announced by the owner, 0 outside of a ReadGuard
+  std::atomic<uint64_t> epoch{0};
+  // Nested guards keep the epoch of the outermost one, only used by the owner
+  uint32_t depth = 0;
+};
+
+static std::atomic<uint64_t> g_epoch{1};
+static pthread_mutex_t g_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_slots_mutex, slots are never freed and reused after their thread exited
+static std::vector<TraceEpochSlot *> g_slots;
+static std::vector<TraceEpochSlot *> g_free_slots;
+static pthread_key_t g_slot_key;
+static pthread_once_t g_slot_key_once = PTHREAD_ONCE_INIT;
+static thread_local TraceEpochSlot *t_slot = nullptr;
+
+static void ReleaseSlot(void *slot) {
+  t_slot = nullptr;
+  pthread_mutex_lock(&g_slots_mutex);
+  g_free_slots.push_back(static_cast<TraceEpochSlot *>(slot));
+  pthread_mutex_unlock(&g_slots_mutex);
+}
+
+static void CreateSlotKey() { pthread_key_create(&g_slot_key, ReleaseSlot); }
+
+static TraceEpochSlot *AcquireSlot() {
+  pthread_once(&g_slot_key_once, CreateSlotKey);
+  TraceEpochSlot *slot = nullptr;
+  pthread_mutex_lock(&g_slots_mutex);
+  if (!g_free_slots.empty()) {
+    slot = g_free_slots.back();
+    g_free_slots.pop_back();
+  } else {
+    slot = new TraceEpochSlot();
+    g_slots.push_back(slot);
+  }
+  pthread_mutex_unlock(&g_slots_mutex);
+  pthread_setspecific(g_slot_key, slot);
+  return slot;
+}
+
+TraceEpoch::ReadGuard::ReadGuard() {
+  slot_ = t_slot;
+  if (__predict_false(slot_ == nullptr)) {
+    slot_ = t_slot = AcquireSlot();
+  }
+  if (slot_->depth++ == 0) {
+    slot_->epoch.store(g_epoch.load(std::memory_order_acquire), std::memory_order_release);
+    // Orders the announcement before the load of the published pointer, pairs with the fence in OldestActive
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+TraceEpoch::ReadGuard::~ReadGuard() {
+  if (--slot_->depth == 0) {
+    slot_->epoch.store(0, std::memory_order_release);
+  }
+}
+
+uint64_t TraceEpoch::Advance() { return g_epoch.fetch_add(1, std::memory_order_acq_rel); }
+
+uint64_t TraceEpoch::OldestActive() {
+  // A reader whose announcement is not seen here loads the pointer published before this call
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t oldest = UINT64_MAX;
+  pthread_mutex_lock(&g_slots_mutex);
+  for (TraceEpochSlot *slot : g_slots) {
+    uint64_t epoch = slot->epoch.load(std::memory_order_acquire);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  pthread_mutex_unlock(&g_slots_mutex);
+  return oldest;
+}
+
+} // namespace fakelinker
@@ -0,0 +1,253 @@
+//
+// Compact append-only JNI trace file
+//
+
+#include <fakelinker/trace_file.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fakelinker/alog.h>
+
+namespace fakelinker {
+
+// The largest chunk is an event: tag, 7 values of at most 10 bytes and a few small fields
+static constexpr size_t kMaxEventSize = 96;
+static constexpr size_t kMinReserve = 64 * 1024;
+
+static uint64_t ClockNs(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t ZigZag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+// Signed integers are zigzag encoded so small negative values stay short
+static uint64_t EncodeValue(TraceValueType type, uint64_t value) {
+  return type == kTVInt ? ZigZag(static_cast<int64_t>(value)) : value;
+}
+
+static int SymbolSlot(TraceValueType type) {
+  switch (type) {
+  case kTVPointer:
+    return 0;
+  case kTVMethodID:
+    return 1;
+  case kTVFieldID:
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+bool TraceFileWriter::Open(const char *path, size_t reserve) {
+  Close();
+  reserve = std::max(reserve, kMinReserve);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOGE("open trace file %s failed: %s", path, strerror(errno));
+    return false;
+  }
+  if (ftruncate(fd, reserve) != 0) {
+    LOGE("reserve trace file %s failed: %s", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    LOGE("mmap trace file %s failed: %s", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  fd_ = fd;
+  data_ = static_cast<uint8_t *>(data);
+  capacity_ = reserve;
+  TraceFileHeader header{};
+  memcpy(header.magic, "FLJT", 4);
+  header.version = TraceFileHeader::kVersion;
+  header.header_size = sizeof(TraceFileHeader);
+  header.start_ns = ClockNs(CLOCK_MONOTONIC);
+  header.start_wall_ns = ClockNs(CLOCK_REALTIME);
+  memcpy(data_, &header, sizeof(header));
+  size_ = sizeof(header);
+  last_timestamp_ = header.start_ns;
+  events_ = 0;
+  next_string_id_ = 1;
+  functions_.reset();
+  strings_.clear();
+  for (auto &symbols : symbols_) {
+    symbols.clear();
+  }
+  return true;
+}
+
+void TraceFileWriter::Close() {
+  if (data_ == nullptr) {
+    return;
+  }
+  munmap(data_, capacity_);
+  if (ftruncate(fd_, size_) != 0) {
+    LOGW("truncate trace file failed: %s", strerror(errno));
+  }
+  close(fd_);
+  data_ = nullptr;
+  fd_ = -1;
+  capacity_ = 0;
+}
+
+bool TraceFileWriter::Reserve(size_t length) {
+  if (data_ == nullptr) {
+    return false;
+  }
+  if (size_ + length < capacity_) {
+    return true;
+  }
+  size_t capacity = capacity_ * 2;
+  while (size_ + length >= capacity) {
+    capacity *= 2;
+  }
+  // The new pages are zero, so the end tag is always present after the last chunk
+  if (ftruncate(fd_, capacity) != 0) {
+    LOGE("grow trace file to %zu failed: %s", capacity, strerror(errno));
+    Close();
+    return false;
+  }
+  munmap(data_, capacity_);
+  void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    LOGE("remap trace file failed: %s", strerror(errno));
+    data_ = nullptr;
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  data_ = static_cast<uint8_t *>(data);
+  capacity_ = capacity;
+  return true;
+}
+
+void TraceFileWriter::PutVarint(uint64_t value) {
+  while (value >= 0x80) {
+    data_[size_++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  data_[size_++] = static_cast<uint8_t>(value);
+}
+
+uint32_t TraceFileWriter::AddString(const char *str, size_t length) {
+  if (!Reserve(length + 16)) {
+    return 0;
+  }
+  uint32_t id = next_string_id_++;
+  data_[size_++] = kTFString;
+  PutVarint(id);
+  PutVarint(length);
+  memcpy(data_ + size_, str, length);
+  size_ += length;
+  return id;
+}
+
+bool TraceFileWriter::HasSymbol(TraceValueType type, uint64_t value) const {
+  int slot = SymbolSlot(type);
+  return slot >= 0 && symbols_[slot].count(value) > 0;
+}
+
+bool TraceFileWriter::AddSymbol(TraceValueType type, uint64_t value, const char *desc) {
+  int slot = SymbolSlot(type);
+  if (slot < 0 || desc == nullptr) {
+    return false;
+  }
+  uint32_t id;
+  if (type == kTVPointer) {
+    id = AddString(desc, strlen(desc));
+  } else {
+    // The description caches free and reuse their memory, so equal pointers do not mean equal descriptions
+    std::string key(desc);
+    auto it = strings_.find(key);
+    if (it != strings_.end()) {
+      id = it->second;
+    } else {
+      id = AddString(key.data(), key.size());
+      if (id != 0) {
+        strings_.emplace(std::move(key), id);
+      }
+    }
+  }
+  if (id == 0 || !Reserve(32)) {
+    return false;
+  }
+  data_[size_++] = kTFSymbol;
+  data_[size_++] = type;
+  PutVarint(value);
+  PutVarint(id);
+  symbols_[slot][value] = id;
+  return true;
+}
+
+bool TraceFileWriter::WriteRecord(const TraceRecord &record) {
+  if (!functions_.test(record.function)) {
+    const char *name = GetJNIFunctionName(record.function);
+    if (name != nullptr) {
+      uint32_t id = AddString(name, strlen(name));
+      if (id == 0 || !Reserve(16)) {
+        return false;
+      }
+      data_[size_++] = kTFFunction;
+      data_[size_++] = record.function;
+      PutVarint(id);
+    }
+    functions_.set(record.function);
+  }
+  if (!Reserve(kMaxEventSize)) {
+    return false;
+  }
+  // Rings of different threads are drained one after another, so the deltas can be negative
+  int64_t delta = static_cast<int64_t>(record.timestamp_ns - last_timestamp_);
+  last_timestamp_ = record.timestamp_ns;
+  data_[size_++] = kTFEvent;
+  PutVarint(ZigZag(delta));
+  PutVarint(record.tid);
+  data_[size_++] = record.function;
+  data_[size_++] = record.result_type;
+  PutVarint(record.arg_types);
+  PutVarint(record.caller);
+  for (int i = 0; i < 4 && record.ArgType(i) != kTVNone; ++i) {
+    PutVarint(EncodeValue(record.ArgType(i), record.args[i]));
+  }
+  if (record.result_type != kTVNone) {
+    PutVarint(EncodeValue(static_cast<TraceValueType>(record.result_type), record.result));
+  }
+  events_++;
+  return true;
+}
+
+bool TraceFileWriter::WriteDropped(uint64_t count) {
+  if (!Reserve(16)) {
+    return false;
+  }
+  data_[size_++] = kTFDropped;
+  PutVarint(count);
+  return true;
+}
+
+bool TraceFileWriter::WriteSuppressed(const TraceSuppressedCounts &counts) {
+  if (!Reserve(32)) {
+    return false;
+  }
+  data_[size_++] = kTFSuppressed;
+  PutVarint(counts.sampled);
+  PutVarint(counts.caller_limited);
+  PutVarint(counts.global_limited);
+  return true;
+}
+
+} // namespace fakelinker
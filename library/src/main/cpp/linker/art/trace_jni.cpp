@@ -13,6 +13,60 @@ JNINativeInterface hook_jni;
 void *monitor = nullptr;
 void *callback = nullptr;
 JNIEnv org_env{.functions = &backup_jni};
+JNINativeInterface shadow_jni;
+const JNINativeInterface *art_jni = nullptr;
+JNIInvokeInterface shadow_invoke;
+const JNIInvokeInterface *art_invoke = nullptr;
+pthread_key_t opt_out_key;
+std::atomic<bool> async_trace = false;
+std::atomic<uint64_t> enabled_functions[4] = {};
 
 } // namespace jni_trace
+
+// Room for a few nested trace contexts on one thread
+static constexpr size_t kMessageArenaSize = 4 * TraceMessage::kCapacity;
+
+struct MessageArena {
+  char *base;
+  size_t top;
+};
+
+static thread_local MessageArena t_message_arena;
+static pthread_key_t g_message_arena_key;
+static pthread_once_t g_message_arena_once = PTHREAD_ONCE_INIT;
+
+static void FreeMessageArena(void *base) {
+  t_message_arena.base = nullptr;
+  t_message_arena.top = 0;
+  free(base);
+}
+
+static void CreateMessageArenaKey() { pthread_key_create(&g_message_arena_key, FreeMessageArena); }
+
+char *TraceMessage::AcquireBuffer() {
+  MessageArena &arena = t_message_arena;
+  if (arena.base == nullptr) {
+    arena.base = static_cast<char *>(malloc(kMessageArenaSize));
+    arena.top = 0;
+    if (arena.base != nullptr) {
+      pthread_once(&g_message_arena_once, CreateMessageArenaKey);
+      pthread_setspecific(g_message_arena_key, arena.base);
+    }
+  }
+  if (arena.base != nullptr && arena.top + kCapacity <= kMessageArenaSize) {
+    char *buffer = arena.base + arena.top;
+    arena.top += kCapacity;
+    return buffer;
+  }
+  return static_cast<char *>(malloc(kCapacity));
+}
+
+void TraceMessage::ReleaseBuffer(char *buffer) {
+  MessageArena &arena = t_message_arena;
+  if (arena.base != nullptr && buffer >= arena.base && buffer < arena.base + kMessageArenaSize) {
+    arena.top = buffer - arena.base;
+  } else {
+    free(buffer);
+  }
+}
 } // namespace fakelinker
@@ -0,0 +1,345 @@
+//
+// Latency histograms of intercepted JNI calls, per-thread tables merged on demand
+//
+
+#include <fakelinker/trace_latency.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <memory>
+
+#include <fakelinker/macros.h>
+#include <fakelinker/maps_util.h>
+#include <fakelinker/trace_buffer.h>
+
+namespace fakelinker {
+
+// Values below 8 ns have their own bucket, every larger power of two is split into 8 linear sub-buckets
+static constexpr int kSubBits = 3;
+static constexpr uint64_t kSubBuckets = 1 << kSubBits;
+// Durations from 2^40 ns (about 18 minutes) on share the last bucket
+static constexpr int kMaxExponent = 39;
+static constexpr size_t kBuckets = (kMaxExponent - kSubBits + 2) * kSubBuckets;
+static constexpr size_t kPageCacheSize = 64;
+static constexpr size_t kMaxProbes = 16;
+
+static size_t BucketOf(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  int exponent = std::min(63 - __builtin_clzll(value), kMaxExponent);
+  if (exponent == kMaxExponent && value >= (2ULL << kMaxExponent)) {
+    return kBuckets - 1;
+  }
+  return (exponent - kSubBits + 1) * kSubBuckets + ((value >> (exponent - kSubBits)) & (kSubBuckets - 1));
+}
+
+// Middle of the values of a bucket
+static uint64_t BucketValue(size_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int exponent = static_cast<int>(bucket / kSubBuckets) + kSubBits - 1;
+  uint64_t width = 1ULL << (exponent - kSubBits);
+  return (kSubBuckets + bucket % kSubBuckets) * width + width / 2;
+}
+
+struct LatencyHistogram {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint32_t> buckets[kBuckets]{};
+};
+
+struct PageCacheEntry {
+  // Page number plus one, 0 is empty
+  uintptr_t page;
+  uint32_t library;
+};
+
+struct LatencyTable {
+  // Written by the owner thread only, key 0 is an empty slot
+  std::atomic<uint32_t> keys[TraceLatencyStats::kTableSlots]{};
+  std::atomic<LatencyHistogram *> histograms[TraceLatencyStats::kTableSlots]{};
+  // Reset epoch the histograms belong to
+  std::atomic<uint32_t> epoch{0};
+  std::atomic<bool> released{false};
+  // Owner thread only
+  PageCacheEntry pages[kPageCacheSize]{};
+};
+
+std::atomic<uint32_t> TraceLatencyStats::timing_{0};
+
+static std::atomic<uint32_t> g_epoch{0};
+static std::atomic<uint64_t> g_overflow{0};
+
+static pthread_mutex_t g_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_tables_mutex, tables are never freed so snapshots can read them without the lock
+static std::vector<LatencyTable *> g_tables;
+static pthread_key_t g_table_key;
+static pthread_once_t g_table_key_once = PTHREAD_ONCE_INIT;
+static thread_local LatencyTable *t_table = nullptr;
+
+static pthread_mutex_t g_libraries_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_libraries_mutex, the id of a library is its index, 0 is unknown
+static std::vector<std::pair<uintptr_t, const char *>> g_libraries = {{0, "unknown"}};
+
+// Only the owner thread writes, so a load and a store are enough
+template <typename T>
+static inline void Add(std::atomic<T> &value, T delta) {
+  value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+static void ReleaseTable(void *table) {
+  // The table may be taken by another thread as soon as it is released, a later call takes a table again
+  t_table = nullptr;
+  static_cast<LatencyTable *>(table)->released.store(true, std::memory_order_release);
+}
+
+static void CreateTableKey() { pthread_key_create(&g_table_key, ReleaseTable); }
+
+static LatencyTable *AcquireTable() {
+  pthread_once(&g_table_key_once, CreateTableKey);
+  LatencyTable *table = nullptr;
+  pthread_mutex_lock(&g_tables_mutex);
+  // The histograms of exited threads are kept, the new owner keeps adding to them
+  for (LatencyTable *released : g_tables) {
+    if (released->released.exchange(false, std::memory_order_acq_rel)) {
+      table = released;
+      break;
+    }
+  }
+  if (table == nullptr) {
+    table = new LatencyTable();
+    g_tables.push_back(table);
+  }
+  pthread_mutex_unlock(&g_tables_mutex);
+  // Libraries may have been unloaded since the previous owner cached them
+  memset(table->pages, 0, sizeof(table->pages));
+  pthread_setspecific(g_table_key, table);
+  return table;
+}
+
+// dladdr takes the loader lock, which dlopen holds while it runs, the shared maps snapshot is read with an atomic
+// load. It is parsed again only if the caller is outside every mapping, such as a library loaded meanwhile
+static uint32_t ResolveLibrary(uintptr_t caller) {
+  std::shared_ptr<const MapsSnapshot> maps = MapsSnapshot::Get();
+  Address base = 0;
+  bool mapped = false;
+  const char *path = maps ? maps->FindFile(caller, &base, &mapped) : nullptr;
+  if (maps && !mapped) {
+    maps = MapsSnapshot::Get(true);
+    path = maps ? maps->FindFile(caller, &base) : nullptr;
+  }
+  if (path == nullptr) {
+    return 0;
+  }
+  uint32_t id = 0;
+  pthread_mutex_lock(&g_libraries_mutex);
+  for (size_t i = 1; i < g_libraries.size(); ++i) {
+    if (g_libraries[i].first == base) {
+      id = static_cast<uint32_t>(i);
+      break;
+    }
+  }
+  if (id == 0) {
+    const char *name = strrchr(path, '/');
+    g_libraries.emplace_back(base, strdup(name ? name + 1 : path));
+    id = static_cast<uint32_t>(g_libraries.size() - 1);
+  }
+  pthread_mutex_unlock(&g_libraries_mutex);
+  return id;
+}
+
+static uint32_t FindLibrary(LatencyTable *table, uintptr_t caller) {
+  uintptr_t page = (caller >> 12) + 1;
+  PageCacheEntry &entry = table->pages[page % kPageCacheSize];
+  if (entry.page != page) {
+    entry.page = page;
+    entry.library = ResolveLibrary(caller);
+  }
+  return entry.library;
+}
+
+static void ClearTable(LatencyTable *table) {
+  for (auto &slot : table->histograms) {
+    LatencyHistogram *histogram = slot.load(std::memory_order_relaxed);
+    if (histogram == nullptr) {
+      continue;
+    }
+    histogram->count.store(0, std::memory_order_relaxed);
+    histogram->total_ns.store(0, std::memory_order_relaxed);
+    histogram->max_ns.store(0, std::memory_order_relaxed);
+    for (auto &bucket : histogram->buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+static LatencyHistogram *FindHistogram(LatencyTable *table, uint32_t key) {
+  size_t index = (key * 0x9E3779B97F4A7C15ULL) >> (64 - 9);
+  static_assert(TraceLatencyStats::kTableSlots == 512, "the hash takes the top 9 bits");
+  for (size_t probe = 0; probe < kMaxProbes; ++probe) {
+    size_t slot = (index + probe) % TraceLatencyStats::kTableSlots;
+    uint32_t current = table->keys[slot].load(std::memory_order_relaxed);
+    if (current == key) {
+      return table->histograms[slot].load(std::memory_order_relaxed);
+    }
+    if (current == 0) {
+      LatencyHistogram *histogram = table->histograms[slot].load(std::memory_order_relaxed);
+      if (histogram == nullptr) {
+        histogram = new LatencyHistogram();
+        table->histograms[slot].store(histogram, std::memory_order_release);
+      }
+      table->keys[slot].store(key, std::memory_order_release);
+      return histogram;
+    }
+  }
+  return nullptr;
+}
+
+uint64_t TraceLatencyStats::End(size_t function_index, const void *caller, uint64_t start_ns) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t duration = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec - start_ns;
+  if (!IsEnabled()) {
+    return duration;
+  }
+  LatencyTable *table = t_table;
+  if (__predict_false(table == nullptr)) {
+    table = t_table = AcquireTable();
+  }
+  uint32_t epoch = g_epoch.load(std::memory_order_acquire);
+  if (__predict_false(table->epoch.load(std::memory_order_relaxed) != epoch)) {
+    ClearTable(table);
+    table->epoch.store(epoch, std::memory_order_release);
+  }
+  uint32_t library = FindLibrary(table, reinterpret_cast<uintptr_t>(caller));
+  LatencyHistogram *histogram = FindHistogram(table, (library << 8 | (function_index & 0xff)) + 1);
+  if (__predict_false(histogram == nullptr)) {
+    g_overflow.fetch_add(1, std::memory_order_relaxed);
+    return duration;
+  }
+  Add<uint32_t>(histogram->buckets[BucketOf(duration)], 1);
+  Add<uint64_t>(histogram->count, 1);
+  Add<uint64_t>(histogram->total_ns, duration);
+  if (duration > histogram->max_ns.load(std::memory_order_relaxed)) {
+    histogram->max_ns.store(duration, std::memory_order_relaxed);
+  }
+  return duration;
+}
+
+void TraceLatencyStats::SetTimingUser(TimingUser user, bool enable) {
+  if (enable) {
+    timing_.fetch_or(user, std::memory_order_relaxed);
+  } else {
+    timing_.fetch_and(~user, std::memory_order_relaxed);
+  }
+}
+
+void TraceLatencyStats::Reset() { g_epoch.fetch_add(1, std::memory_order_acq_rel); }
+
+uint64_t TraceLatencyStats::Overflow() { return g_overflow.load(std::memory_order_relaxed); }
+
+struct MergedHistogram {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+  uint64_t buckets[kBuckets]{};
+
+  uint64_t Percentile(double percent) const {
+    uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(count * percent + 0.5), 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(BucketValue(i), max_ns);
+      }
+    }
+    return max_ns;
+  }
+};
+
+std::vector<TraceLatencySummary> TraceLatencyStats::Snapshot() {
+  pthread_mutex_lock(&g_tables_mutex);
+  std::vector<LatencyTable *> tables = g_tables;
+  pthread_mutex_unlock(&g_tables_mutex);
+  uint32_t epoch = g_epoch.load(std::memory_order_acquire);
+  std::map<uint32_t, std::unique_ptr<MergedHistogram>> merged;
+  for (LatencyTable *table : tables) {
+    // Threads that did not record anything since the last reset still hold old values
+    if (table->epoch.load(std::memory_order_acquire) != epoch) {
+      continue;
+    }
+    for (size_t slot = 0; slot < kTableSlots; ++slot) {
+      uint32_t key = table->keys[slot].load(std::memory_order_acquire);
+      if (key == 0) {
+        continue;
+      }
+      LatencyHistogram *histogram = table->histograms[slot].load(std::memory_order_acquire);
+      auto &target = merged[key];
+      if (!target) {
+        target.reset(new MergedHistogram());
+      }
+      target->count += histogram->count.load(std::memory_order_relaxed);
+      target->total_ns += histogram->total_ns.load(std::memory_order_relaxed);
+      target->max_ns = std::max(target->max_ns, histogram->max_ns.load(std::memory_order_relaxed));
+      for (size_t i = 0; i < kBuckets; ++i) {
+        target->buckets[i] += histogram->buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+  std::vector<TraceLatencySummary> result;
+  pthread_mutex_lock(&g_libraries_mutex);
+  for (auto &[key, histogram] : merged) {
+    if (histogram->count == 0) {
+      continue;
+    }
+    uint32_t library = (key - 1) >> 8;
+    const char *function = GetJNIFunctionName((key - 1) & 0xff);
+    result.push_back(TraceLatencySummary{
+      .library = library < g_libraries.size() ? g_libraries[library].second : "unknown",
+      .function = function ? function : "unknown",
+      .count = histogram->count,
+      .total_ns = histogram->total_ns,
+      .p50_ns = histogram->Percentile(0.5),
+      .p90_ns = histogram->Percentile(0.9),
+      .p99_ns = histogram->Percentile(0.99),
+      .max_ns = histogram->max_ns,
+    });
+  }
+  pthread_mutex_unlock(&g_libraries_mutex);
+  std::sort(result.begin(), result.end(),
+            [](const TraceLatencySummary &a, const TraceLatencySummary &b) { return a.total_ns > b.total_ns; });
+  return result;
+}
+
+std::string TraceLatencyStats::Dump(size_t max_lines) {
+  std::vector<TraceLatencySummary> summaries = Snapshot();
+  std::string result;
+  char line[256];
+  snprintf(line, sizeof(line), "%-32s %-24s %10s %12s %10s %10s %10s %10s\n", "function", "library", "count",
+           "total(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+  result += line;
+  size_t lines = 0;
+  for (auto &summary : summaries) {
+    if (max_lines != 0 && lines++ >= max_lines) {
+      break;
+    }
+    snprintf(line, sizeof(line), "%-32s %-24s %10" PRIu64 " %12.1f %10.2f %10.2f %10.2f %10.2f\n", summary.function,
+             summary.library, summary.count, summary.total_ns / 1000.0, summary.p50_ns / 1000.0,
+             summary.p90_ns / 1000.0, summary.p99_ns / 1000.0, summary.max_ns / 1000.0);
+    result += line;
+  }
+  if (uint64_t overflow = Overflow()) {
+    snprintf(line, sizeof(line), "%" PRIu64 " calls not recorded, per-thread tables are full\n", overflow);
+    result += line;
+  }
+  return result;
+}
+
+} // namespace fakelinker
@@ -0,0 +1,306 @@
+//
+// Sampling and rate limiting of traced JNI calls
+//
+
+#include <fakelinker/trace_sampler.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <fakelinker/macros.h>
+#include <fakelinker/trace_buffer.h>
+
+namespace fakelinker {
+
+static constexpr size_t kFunctionSlots = 256;
+
+enum SuppressReason {
+  kSuppressSampled,
+  kSuppressCaller,
+  kSuppressGlobal,
+  kSuppressReasons,
+};
+
+/**
+ * Generic cell rate algorithm, an equivalent of a token bucket that only needs one atomic.
+ * tat is the theoretical arrival time of the next call, a call is admitted while tat is at most
+ * tolerance ahead of now and moves tat one interval further
+ */
+struct RateBucket {
+  std::atomic<uint64_t> tat{0};
+
+  bool Admit(uint64_t now, uint64_t interval, uint64_t tolerance) {
+    uint64_t current = tat.load(std::memory_order_relaxed);
+    while (true) {
+      uint64_t base = std::max(current, now);
+      if (base - now > tolerance) {
+        return false;
+      }
+      if (tat.compare_exchange_weak(current, base + interval, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+};
+
+struct CallerBucket {
+  std::atomic<uintptr_t> caller{0};
+  RateBucket bucket;
+};
+
+struct RateLimit {
+  std::atomic<uint64_t> interval_ns{0};
+  std::atomic<uint64_t> tolerance_ns{0};
+
+  void Set(uint32_t events_per_second, uint32_t burst) {
+    uint64_t interval = events_per_second == 0 ? 0 : std::max<uint64_t>(1000000000ULL / events_per_second, 1);
+    interval_ns.store(interval, std::memory_order_relaxed);
+    tolerance_ns.store(interval * (std::max<uint32_t>(burst, 1) - 1), std::memory_order_relaxed);
+  }
+};
+
+struct SamplerThreadState {
+  // Owner thread only
+  uint32_t countdown[kFunctionSlots]{};
+  // Written by the owner thread only, Suppressed reads them from any thread
+  std::atomic<uint64_t> suppressed[kSuppressReasons]{};
+};
+
+std::atomic<bool> TraceSampler::active_{false};
+
+static std::atomic<uint32_t> g_sample_rates[kFunctionSlots];
+static std::atomic<bool> g_sampling{false};
+static RateLimit g_caller_limit;
+static RateLimit g_global_limit;
+static CallerBucket g_caller_buckets[TraceSampler::kCallerSlots];
+// Shared by the callers that found no free slot
+static RateBucket g_overflow_bucket;
+static RateBucket g_global_bucket;
+static pthread_mutex_t g_states_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_states_mutex, the counts of exited threads and the states of all threads, states are never freed
+static uint64_t g_exited_suppressed[kSuppressReasons];
+static std::vector<SamplerThreadState *> g_states;
+static std::vector<SamplerThreadState *> g_free_states;
+static pthread_key_t g_state_key;
+static pthread_once_t g_state_key_once = PTHREAD_ONCE_INIT;
+static thread_local SamplerThreadState *t_sampler = nullptr;
+
+static pthread_mutex_t g_report_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by g_report_mutex
+static uint64_t g_next_report_ns = 0;
+static uint64_t g_reported[kSuppressReasons];
+
+static uint64_t CoarseNowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ReleaseState(void *data) {
+  auto state = static_cast<SamplerThreadState *>(data);
+  t_sampler = nullptr;
+  pthread_mutex_lock(&g_states_mutex);
+  // Moved under the lock, so Suppressed never counts them twice or misses them
+  for (int i = 0; i < kSuppressReasons; ++i) {
+    g_exited_suppressed[i] += state->suppressed[i].exchange(0, std::memory_order_relaxed);
+  }
+  g_free_states.push_back(state);
+  pthread_mutex_unlock(&g_states_mutex);
+}
+
+static void CreateStateKey() { pthread_key_create(&g_state_key, ReleaseState); }
+
+static SamplerThreadState *AcquireState() {
+  pthread_once(&g_state_key_once, CreateStateKey);
+  SamplerThreadState *state = nullptr;
+  pthread_mutex_lock(&g_states_mutex);
+  if (!g_free_states.empty()) {
+    state = g_free_states.back();
+    g_free_states.pop_back();
+  } else {
+    state = new SamplerThreadState();
+    g_states.push_back(state);
+  }
+  pthread_mutex_unlock(&g_states_mutex);
+  // A new thread starts its sampling phases from the beginning
+  memset(state->countdown, 0, sizeof(state->countdown));
+  pthread_setspecific(g_state_key, state);
+  return state;
+}
+
+static SamplerThreadState *ThreadState() {
+  if (__predict_false(t_sampler == nullptr)) {
+    t_sampler = AcquireState();
+  }
+  return t_sampler;
+}
+
+static bool Suppress(SuppressReason reason) {
+  // Only the owner thread writes, so a load and a store are enough
+  std::atomic<uint64_t> &count = ThreadState()->suppressed[reason];
+  count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  return false;
+}
+
+static RateBucket &FindCallerBucket(uintptr_t caller) {
+  static_assert(TraceSampler::kCallerSlots == 1024, "the hash takes the top 10 bits");
+  size_t index = (static_cast<uint64_t>(caller) * 0x9E3779B97F4A7C15ULL) >> 54;
+  for (size_t probe = 0; probe < 8; ++probe) {
+    CallerBucket &slot = g_caller_buckets[(index + probe) % TraceSampler::kCallerSlots];
+    uintptr_t current = slot.caller.load(std::memory_order_acquire);
+    if (current == caller) {
+      return slot.bucket;
+    }
+    if (current == 0 && (slot.caller.compare_exchange_strong(current, caller, std::memory_order_acq_rel) ||
+                         current == caller)) {
+      return slot.bucket;
+    }
+  }
+  return g_overflow_bucket;
+}
+
+bool TraceSampler::AdmitSlow(size_t function_index, uintptr_t caller) {
+  if (g_sampling.load(std::memory_order_relaxed) && function_index < kFunctionSlots) {
+    uint32_t rate = g_sample_rates[function_index].load(std::memory_order_relaxed);
+    if (rate > 1) {
+      uint32_t &countdown = ThreadState()->countdown[function_index];
+      if (countdown > rate) {
+        countdown = rate;
+      }
+      if (countdown > 1) {
+        countdown--;
+        return Suppress(kSuppressSampled);
+      }
+      countdown = rate;
+    }
+  }
+  uint64_t caller_interval = g_caller_limit.interval_ns.load(std::memory_order_relaxed);
+  uint64_t global_interval = g_global_limit.interval_ns.load(std::memory_order_relaxed);
+  if (caller_interval == 0 && global_interval == 0) {
+    return true;
+  }
+  uint64_t now = CoarseNowNs();
+  if (caller_interval != 0 &&
+      !FindCallerBucket(caller).Admit(now, caller_interval,
+                                      g_caller_limit.tolerance_ns.load(std::memory_order_relaxed))) {
+    return Suppress(kSuppressCaller);
+  }
+  if (global_interval != 0 &&
+      !g_global_bucket.Admit(now, global_interval, g_global_limit.tolerance_ns.load(std::memory_order_relaxed))) {
+    return Suppress(kSuppressGlobal);
+  }
+  return true;
+}
+
+void TraceSampler::UpdateActive() {
+  bool sampling = false;
+  for (auto &rate : g_sample_rates) {
+    if (rate.load(std::memory_order_relaxed) > 1) {
+      sampling = true;
+      break;
+    }
+  }
+  g_sampling.store(sampling, std::memory_order_relaxed);
+  active_.store(sampling || g_caller_limit.interval_ns.load(std::memory_order_relaxed) != 0 ||
+                  g_global_limit.interval_ns.load(std::memory_order_relaxed) != 0,
+                std::memory_order_release);
+}
+
+void TraceSampler::SetSampleRate(size_t function_index, uint32_t rate) {
+  if (function_index >= kFunctionSlots) {
+    return;
+  }
+  g_sample_rates[function_index].store(rate, std::memory_order_relaxed);
+  UpdateActive();
+}
+
+bool TraceSampler::SetSampleRate(const char *function, uint32_t rate) {
+  if (function == nullptr) {
+    return false;
+  }
+  if (strcmp(function, "*") == 0) {
+    for (auto &value : g_sample_rates) {
+      value.store(rate, std::memory_order_relaxed);
+    }
+    UpdateActive();
+    return true;
+  }
+  int index = FindJNIFunctionIndex(function);
+  if (index < 0) {
+    return false;
+  }
+  SetSampleRate(index, rate);
+  return true;
+}
+
+void TraceSampler::SetCallerRateLimit(uint32_t events_per_second, uint32_t burst) {
+  g_caller_limit.Set(events_per_second, burst);
+  for (auto &slot : g_caller_buckets) {
+    slot.bucket.tat.store(0, std::memory_order_relaxed);
+  }
+  g_overflow_bucket.tat.store(0, std::memory_order_relaxed);
+  UpdateActive();
+}
+
+void TraceSampler::SetGlobalRateLimit(uint32_t events_per_second, uint32_t burst) {
+  g_global_limit.Set(events_per_second, burst);
+  g_global_bucket.tat.store(0, std::memory_order_relaxed);
+  UpdateActive();
+}
+
+void TraceSampler::Reset() {
+  for (auto &rate : g_sample_rates) {
+    rate.store(0, std::memory_order_relaxed);
+  }
+  g_caller_limit.Set(0, 0);
+  g_global_limit.Set(0, 0);
+  UpdateActive();
+}
+
+TraceSuppressedCounts TraceSampler::Suppressed() {
+  uint64_t total[kSuppressReasons];
+  pthread_mutex_lock(&g_states_mutex);
+  for (int i = 0; i < kSuppressReasons; ++i) {
+    total[i] = g_exited_suppressed[i];
+    // Released states hold zero counts
+    for (SamplerThreadState *state : g_states) {
+      total[i] += state->suppressed[i].load(std::memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&g_states_mutex);
+  return TraceSuppressedCounts{
+    .sampled = total[kSuppressSampled],
+    .caller_limited = total[kSuppressCaller],
+    .global_limited = total[kSuppressGlobal],
+  };
+}
+
+bool TraceSampler::TakeReport(TraceSuppressedCounts &counts, uint32_t interval_ms) {
+  if (!IsActive()) {
+    return false;
+  }
+  uint64_t now = CoarseNowNs();
+  if (pthread_mutex_trylock(&g_report_mutex) != 0) {
+    return false;
+  }
+  bool reported = false;
+  if (now >= g_next_report_ns) {
+    g_next_report_ns = now + interval_ms * 1000000ULL;
+    TraceSuppressedCounts total = Suppressed();
+    counts.sampled = total.sampled - g_reported[kSuppressSampled];
+    counts.caller_limited = total.caller_limited - g_reported[kSuppressCaller];
+    counts.global_limited = total.global_limited - g_reported[kSuppressGlobal];
+    g_reported[kSuppressSampled] = total.sampled;
+    g_reported[kSuppressCaller] = total.caller_limited;
+    g_reported[kSuppressGlobal] = total.global_limited;
+    reported = counts.Total() != 0;
+  }
+  pthread_mutex_unlock(&g_report_mutex);
+  return reported;
+}
+
+} // namespace fakelinker
@@ -52,8 +52,6 @@ using namespace fakelinker;
     *out_error = kErrorNo;                                                                                             \
   }
 
-static std::vector<std::string> filter_symbols;
-
 int get_fakelinker_version_impl() { return FAKELINKER_MODULE_VERSION; }
 
 SoinfoPtr soinfo_find_impl(SoinfoFindType find_type, const void *param, int *out_error) {
@@ -291,32 +289,22 @@ static bool soinfo_remove_global_impl(SoinfoPtr soinfo_ptr) {
 }
 
 static void add_relocation_blacklist_impl(const char *symbol_name) {
-  if (symbol_name) {
-    std::string name = symbol_name;
-    if (std::find(filter_symbols.begin(), filter_symbols.end(), name) == filter_symbols.end()) {
-      filter_symbols.emplace_back(name);
-    }
-  }
+  ProxyLinker::Get().AddRelocationBlacklist(symbol_name);
 }
 
 static void remove_relocation_blacklist_impl(const char *symbol_name) {
-  if (!symbol_name) {
-    return;
-  }
-  auto f = std::find(filter_symbols.begin(), filter_symbols.end(), symbol_name);
-  if (f != filter_symbols.end()) {
-    filter_symbols.erase(f);
-  }
+  ProxyLinker::Get().RemoveRelocationBlacklist(symbol_name);
 }
 
-static void clear_relocation_blacklist_impl() { filter_symbols.clear(); }
+static void clear_relocation_blacklist_impl() { ProxyLinker::Get().ClearRelocationBlacklist(); }
 
 static bool call_manual_relocation_by_soinfo_impl(SoinfoPtr global_lib, SoinfoPtr target) {
   if (!global_lib || !target) {
     return false;
   }
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
   return ProxyLinker::Get().ManualRelinkLibrary(static_cast<soinfo *>(global_lib), static_cast<soinfo *>(target),
-                                                filter_symbols);
+                                                blacklist.get());
 }
 
 static bool call_manual_relocation_by_soinfos_impl(SoinfoPtr global_lib, int len, SoinfoPtr targets[]) {
@@ -331,7 +319,8 @@ static bool call_manual_relocation_by_soinfos_impl(SoinfoPtr global_lib, int len
     }
     soinfos[i] = reinterpret_cast<soinfo *>(targets[i]);
   }
-  return ProxyLinker::Get().ManualRelinkLibraries(static_cast<soinfo *>(global_lib), len, soinfos, filter_symbols);
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
+  return ProxyLinker::Get().ManualRelinkLibraries(static_cast<soinfo *>(global_lib), len, soinfos, blacklist.get());
 }
 
 static bool call_manual_relocation_by_name_impl(SoinfoPtr global_lib, const char *target_name) {
@@ -342,8 +331,9 @@ static bool call_manual_relocation_by_name_impl(SoinfoPtr global_lib, const char
   if (!target) {
     return false;
   }
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
   return ProxyLinker::Get().ManualRelinkLibrary(static_cast<soinfo *>(global_lib), static_cast<soinfo *>(target),
-                                                filter_symbols);
+                                                blacklist.get());
 }
 
 static bool call_manual_relocation_by_names_impl(SoinfoPtr global_lib, int len, const char *target_names[]) {
@@ -359,7 +349,72 @@ static bool call_manual_relocation_by_names_impl(SoinfoPtr global_lib, int len,
     }
     sonames[i] = target_names[i];
   }
-  return ProxyLinker::Get().ManualRelinkLibraries(static_cast<soinfo *>(global_lib), sonames, filter_symbols);
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
+  return ProxyLinker::Get().ManualRelinkLibraries(static_cast<soinfo *>(global_lib), sonames, blacklist.get());
+}
+
+static bool update_manual_relocation_symbol_impl(SoinfoPtr target, const char *symbol_name, SymbolAddress address) {
+  if (!target || !symbol_name) {
+    return false;
+  }
+  return ProxyLinker::Get().UpdateRelinkSymbol(static_cast<soinfo *>(target), symbol_name,
+                                               reinterpret_cast<ElfW(Addr)>(address));
+}
+
+static bool call_manual_unrelocation_impl(SoinfoPtr target) {
+  if (!target) {
+    return false;
+  }
+  return ProxyLinker::Get().ManualUnrelinkLibrary(static_cast<soinfo *>(target));
+}
+
+static bool set_auto_relocation_impl(SoinfoPtr global_lib) {
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
+  return ProxyLinker::Get().SetAutoRelinkLibrary(static_cast<soinfo *>(global_lib), blacklist.get());
+}
+
+static int get_relocation_stats_impl(SoinfoPtr target, RelocationStats *last, RelocationStats *total) {
+  CHECK_PARAM_RET_ERROR(last || total, kErrorParameterNull);
+  if (!ProxyLinker::Get().GetRelinkStats(static_cast<soinfo *>(target), last, total)) {
+    return kErrorSoinfoNotFound;
+  }
+  return kErrorNo;
+}
+
+static void set_relocation_stats_log_impl(bool enable) { ProxyLinker::Get().SetRelinkStatsLog(enable); }
+
+static MEMORY_FREE void *plan_manual_relocation_impl(SoinfoPtr global_lib, SoinfoPtr target, size_t *out_size) {
+  if (!global_lib || !target || !out_size) {
+    return nullptr;
+  }
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
+  relocation_plan plan;
+  if (!ProxyLinker::Get().PlanRelinkLibrary(static_cast<soinfo *>(global_lib), static_cast<soinfo *>(target),
+                                            blacklist.get(), plan)) {
+    return nullptr;
+  }
+  std::string data = plan.serialize();
+  unique_memory memory(data.size());
+  if (!memory.ok()) {
+    return nullptr;
+  }
+  memcpy(memory.get(), data.data(), data.size());
+  *out_size = data.size();
+  return memory.release();
+}
+
+static bool apply_manual_relocation_plan_impl(SoinfoPtr global_lib, SoinfoPtr target, const void *plan_data,
+                                              size_t size) {
+  if (!global_lib || !target || !plan_data) {
+    return false;
+  }
+  relocation_plan plan;
+  if (!plan.deserialize(plan_data, size)) {
+    return false;
+  }
+  auto blacklist = ProxyLinker::Get().GetRelocationBlacklist();
+  return ProxyLinker::Get().ApplyRelinkPlan(static_cast<soinfo *>(global_lib), static_cast<soinfo *>(target),
+                                            blacklist.get(), plan);
 }
 
 static ANDROID_GE_N AndroidNamespacePtr android_namespace_find_impl(NamespaceFindType find_type, const void *param,
@@ -794,13 +849,13 @@ C_API API_PUBLIC FakeLinker g_fakelinker_export = {
   call_manual_relocation_by_name_impl,
   call_manual_relocation_by_names_impl,
   soinfo_get_export_symbol_address_prefix_impl,
-  nullptr, /* unused1 */
-  nullptr, /* unused2 */
-  nullptr, /* unused3 */
-  nullptr, /* unused4 */
-  nullptr, /* unused5 */
-  nullptr, /* unused6 */
-  nullptr, /* unused7 */
+  update_manual_relocation_symbol_impl,
+  call_manual_unrelocation_impl,
+  set_auto_relocation_impl,
+  get_relocation_stats_impl,
+  set_relocation_stats_log_impl,
+  plan_manual_relocation_impl,
+  apply_manual_relocation_plan_impl,
   nullptr, /* unused8 */
   nullptr, /* unused9 */
   android_namespace_find_impl,
@@ -840,9 +895,9 @@ C_API API_PUBLIC FakeLinker g_fakelinker_export = {
   HookJniNativeInterface,
   HookJniNativeInterfaces,
   HookJavaNativeFunctions,
-  nullptr, /* unused20 */
-  nullptr, /* unused21 */
-  nullptr, /* unused22 */
+  QueueJniNativeInterface,
+  CommitJniNativeInterfaces,
+  HookJavaNativeClasses,
   nullptr, /* unused23 */
   nullptr, /* unused24 */
   nullptr, /* unused25 */
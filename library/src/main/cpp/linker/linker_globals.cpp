@@ -14,6 +14,9 @@
 #include <dlfcn.h>
 #include <elf.h>
 #include <sys/mman.h>
+#include <time.h>
+
+#include <cinttypes>
 
 #include <fakelinker/alog.h>
 #include <fakelinker/elf_reader.h>
@@ -37,6 +40,12 @@
 
 namespace fakelinker {
 
+static uint64_t monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 /*
  * About dlopen dlsym
  * Android 8.0+ linker exports symbols __loader_dlopen, __loader_dlsym
@@ -628,6 +637,8 @@ static int unprotect_rel_data(Address start, Address end, int port) {
   int error = mprotect(reinterpret_cast<void *>(start), end - start, port);
   if (error < 0) {
     LOGE("unprotect rel offset error: %d, port: %d ", error, port);
+  } else {
+    MapsHelper::Refresh();
   }
   return error;
 }
@@ -663,11 +674,12 @@ static void symbol_detect(soinfo *si, symbol_observed *symbols, size_t len, bool
 }
 
 bool ProxyLinker::ManualRelinkLibraries(soinfo *global, const std::vector<std::string> &sonames,
-                                        const std::vector<std::string> &filters) {
+                                        const SymbolBlacklist *filters) {
   if (__predict_false(global == nullptr) || __predict_false(sonames.empty())) {
     return false;
   }
-  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters);
+  size_t skipped = 0;
+  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters, &skipped);
   if (rels.empty()) {
     LOGW("Function symbols not exported by the global library : %s",
          global->get_soname() == nullptr ? "(null)" : global->get_soname());
@@ -679,18 +691,19 @@ bool ProxyLinker::ManualRelinkLibraries(soinfo *global, const std::vector<std::s
     if (child == nullptr) {
       LOGW("The specified so was not found: %s", sonames[i].c_str());
     } else {
-      success &= ProxyLinker::ManualRelinkLibrary(rels, child);
+      success &= ProxyLinker::ManualRelinkLibrary(rels, child, skipped);
     }
   }
   return success;
 }
 
 bool ProxyLinker::ManualRelinkLibraries(soinfo *global, int len, const std::vector<soinfo *> &targets,
-                                        std::vector<std::string> &filters) {
+                                        const SymbolBlacklist *filters) {
   if (__predict_false(global == nullptr) || __predict_false(targets.empty())) {
     return false;
   }
-  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters);
+  size_t skipped = 0;
+  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters, &skipped);
   if (rels.empty()) {
     LOGW("Function symbols not exported by the global library : %s",
          global->get_soname() == nullptr ? "(null)" : global->get_soname());
@@ -698,35 +711,332 @@ bool ProxyLinker::ManualRelinkLibraries(soinfo *global, int len, const std::vect
   }
   bool success = true;
   for (int i = 0; i < len; ++i) {
-    success &= ProxyLinker::ManualRelinkLibrary(rels, targets[i]);
+    success &= ProxyLinker::ManualRelinkLibrary(rels, targets[i], skipped);
   }
   return success;
 }
 
 bool ProxyLinker::ManualRelinkLibrary(soinfo *global, soinfo *child) {
-  std::vector<std::string> filters;
-  return ProxyLinker::ManualRelinkLibrary(global, child, filters);
+  return ProxyLinker::ManualRelinkLibrary(global, child, nullptr);
 }
 
-bool ProxyLinker::ManualRelinkLibrary(soinfo *global, soinfo *child, std::vector<std::string> &filters) {
+bool ProxyLinker::ManualRelinkLibrary(soinfo *global, soinfo *child, const SymbolBlacklist *filters) {
   if (__predict_false(global == nullptr)) {
     return false;
   }
-  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters);
+  size_t skipped = 0;
+  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters, &skipped);
   if (rels.empty()) {
     LOGW("Function symbols not exported by the global library : %s",
          global->get_soname() == nullptr ? "(null)" : global->get_soname());
     return false;
   }
-  return ProxyLinker::ManualRelinkLibrary(rels, child);
+  return ProxyLinker::ManualRelinkLibrary(rels, child, skipped);
 }
 
-bool ProxyLinker::ManualRelinkLibrary(symbol_relocations &rels, soinfo *child) {
+bool ProxyLinker::ManualRelinkLibrary(symbol_relocations &rels, soinfo *child, size_t blacklist_skipped) {
   if (rels.empty() || __predict_false(child == nullptr)) {
     return false;
   }
+  uint64_t start_ns = monotonic_ns();
+  RelocationStats stats{};
+  stats.blacklist_skipped = blacklist_skipped;
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  PruneRelinkState();
+  bool success = child->again_process_relocation(rels, relink_journals[GetRelinkKey(child)], &stats);
+  RecordRelinkStats(child, stats, start_ns);
+  return success;
+}
+
+bool ProxyLinker::UpdateRelinkSymbol(soinfo *child, const char *symbol, ElfW(Addr) address) {
+  if (__predict_false(child == nullptr) || __predict_false(symbol == nullptr)) {
+    return false;
+  }
   ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
-  return child->again_process_relocation(rels);
+  auto itr = relink_journals.find(GetRelinkKey(child));
+  if (itr == relink_journals.end()) {
+    LOGW("The library has not been manually relinked: %s",
+         child->get_soname() == nullptr ? "(null)" : child->get_soname());
+    return false;
+  }
+  uint64_t start_ns = monotonic_ns();
+  RelocationStats stats{};
+  bool success = child->update_relocation_symbol(itr->second, symbol, address, &stats);
+  RecordRelinkStats(child, stats, start_ns);
+  return success;
+}
+
+bool ProxyLinker::ManualUnrelinkLibrary(soinfo *child) {
+  if (__predict_false(child == nullptr)) {
+    return false;
+  }
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  auto itr = relink_journals.find(GetRelinkKey(child));
+  if (itr == relink_journals.end()) {
+    return false;
+  }
+  uint64_t start_ns = monotonic_ns();
+  RelocationStats stats{};
+  bool success = child->restore_relocation(itr->second, &stats);
+  RecordRelinkStats(child, stats, start_ns);
+  if (!success) {
+    return false;
+  }
+  relink_journals.erase(itr);
+  return true;
+}
+
+bool ProxyLinker::PlanRelinkLibrary(soinfo *global, soinfo *child, const SymbolBlacklist *filters,
+                                    relocation_plan &plan) {
+  if (__predict_false(global == nullptr) || __predict_false(child == nullptr)) {
+    return false;
+  }
+  // Finding the libraries of the expected values walks solist, which dlopen and dlclose change
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters);
+  if (rels.empty()) {
+    LOGW("Function symbols not exported by the global library : %s",
+         global->get_soname() == nullptr ? "(null)" : global->get_soname());
+    return false;
+  }
+  return child->make_relocation_plan(rels, plan);
+}
+
+bool ProxyLinker::ApplyRelinkPlan(soinfo *global, soinfo *child, const SymbolBlacklist *filters,
+                                  relocation_plan &plan) {
+  if (__predict_false(global == nullptr) || __predict_false(child == nullptr)) {
+    return false;
+  }
+  if (plan.build_id != child->get_build_id()) {
+    LOGE("relocation plan build-id mismatch, library: %s, plan: %s, current: %s",
+         child->get_soname() == nullptr ? "(null)" : child->get_soname(), plan.build_id.c_str(),
+         child->get_build_id().c_str());
+    return false;
+  }
+  uint64_t start_ns = monotonic_ns();
+  // Binding looks up the target libraries in solist, they must stay loaded until the slots are written
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  size_t skipped = 0;
+  symbol_relocations rels = global->get_global_soinfo_export_symbols(false, filters, &skipped);
+  if (!child->bind_relocation_plan(rels, plan)) {
+    return false;
+  }
+  RelocationStats stats{};
+  stats.blacklist_skipped = skipped;
+  bool success = child->apply_relocation_plan(plan, &stats);
+  RecordRelinkStats(child, stats, start_ns);
+  return success;
+}
+
+// Android 8.0+ libdl implements dlopen and android_dlopen_ext by calling these linker exports
+static constexpr const char *kLoaderDlopen = "__loader_dlopen";
+static constexpr const char *kLoaderAndroidDlopenExt = "__loader_android_dlopen_ext";
+
+ANDROID_GE_O void *ProxyLinker::LoaderDlopen(const char *filename, int flags, const void *caller_addr) {
+  return CallDlopen(filename, flags, const_cast<void *>(caller_addr), nullptr);
+}
+
+ANDROID_GE_O void *ProxyLinker::LoaderAndroidDlopenExt(const char *filename, int flags,
+                                                       const android_dlextinfo *extinfo, const void *caller_addr) {
+  return CallDlopen(filename, flags, const_cast<void *>(caller_addr), extinfo);
+}
+
+ANDROID_GE_O bool ProxyLinker::HookLoaderDlopen(bool enable) {
+  soinfo *libdl = FindSoinfoByName("libdl.so");
+  if (libdl == nullptr) {
+    LOGW("libdl.so is not loaded, only libraries loaded by the FakeLinker dlopen are relinked automatically");
+    return false;
+  }
+  if (!enable) {
+    // Restored from the journal of libdl, a later enable only writes the two slots again
+    bool success = UpdateRelinkSymbol(libdl, kLoaderDlopen, 0);
+    success &= UpdateRelinkSymbol(libdl, kLoaderAndroidDlopenExt, 0);
+    return success;
+  }
+  symbol_relocations rels;
+  rels.emplace(kLoaderDlopen, reinterpret_cast<ElfW(Addr)>(&ProxyLinker::LoaderDlopen));
+  rels.emplace(kLoaderAndroidDlopenExt, reinterpret_cast<ElfW(Addr)>(&ProxyLinker::LoaderAndroidDlopenExt));
+  return ManualRelinkLibrary(rels, libdl);
+}
+
+bool ProxyLinker::SetAutoRelinkLibrary(soinfo *global, const SymbolBlacklist *filters) {
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  if (global == nullptr) {
+    if (android_api >= __ANDROID_API_O__ && auto_relink_global.load(std::memory_order_relaxed) != nullptr) {
+      HookLoaderDlopen(false);
+    }
+    auto_relink_global.store(nullptr, std::memory_order_release);
+    auto_relink_filters.reset();
+    return true;
+  }
+  if (global->get_global_soinfo_export_symbols(false, filters).empty()) {
+    LOGW("Function symbols not exported by the global library : %s",
+         global->get_soname() == nullptr ? "(null)" : global->get_soname());
+    return false;
+  }
+  // The exported addresses are resolved again on every relink, global may be unloaded and loaded elsewhere
+  auto_relink_filters = filters == nullptr ? nullptr : std::make_shared<const SymbolBlacklist>(filters->names());
+  auto_relink_base = global->base();
+  auto_relink_global.store(global, std::memory_order_release);
+  if (android_api >= __ANDROID_API_O__ && !HookLoaderDlopen(true)) {
+    LOGW("redirect the libdl dlopen failed, only libraries loaded by the FakeLinker dlopen are relinked automatically");
+  }
+  return true;
+}
+
+void ProxyLinker::AddRelocationBlacklist(const char *symbol) {
+  if (symbol == nullptr) {
+    return;
+  }
+  ScopedPthreadMutexLocker locker(&blacklist_mutex);
+  if (relocation_blacklist && relocation_blacklist->contains(symbol)) {
+    return;
+  }
+  std::vector<std::string> names;
+  if (relocation_blacklist) {
+    names = relocation_blacklist->names();
+  }
+  names.emplace_back(symbol);
+  relocation_blacklist = std::make_shared<const SymbolBlacklist>(std::move(names));
+}
+
+void ProxyLinker::RemoveRelocationBlacklist(const char *symbol) {
+  if (symbol == nullptr) {
+    return;
+  }
+  ScopedPthreadMutexLocker locker(&blacklist_mutex);
+  if (!relocation_blacklist || !relocation_blacklist->contains(symbol)) {
+    return;
+  }
+  std::vector<std::string> names;
+  names.reserve(relocation_blacklist->names().size() - 1);
+  for (auto &name : relocation_blacklist->names()) {
+    if (name != symbol) {
+      names.push_back(name);
+    }
+  }
+  relocation_blacklist = std::make_shared<const SymbolBlacklist>(std::move(names));
+}
+
+void ProxyLinker::ClearRelocationBlacklist() {
+  ScopedPthreadMutexLocker locker(&blacklist_mutex);
+  relocation_blacklist.reset();
+}
+
+std::shared_ptr<const SymbolBlacklist> ProxyLinker::GetRelocationBlacklist() {
+  ScopedPthreadMutexLocker locker(&blacklist_mutex);
+  return relocation_blacklist;
+}
+
+void ProxyLinker::AutoRelinkNewLibraries(soinfo *last) {
+  soinfo *global = auto_relink_global.load(std::memory_order_relaxed);
+  if (global == nullptr) {
+    return;
+  }
+  bool loaded = false;
+  for (soinfo *si = linker_symbol.solist.Get(); si != nullptr; si = si->next()) {
+    if (si == global) {
+      loaded = si->base() == auto_relink_base;
+      break;
+    }
+  }
+  if (!loaded) {
+    LOGW("auto relink global library has been unloaded, automatic relocation is disabled");
+    if (android_api >= __ANDROID_API_O__) {
+      HookLoaderDlopen(false);
+    }
+    auto_relink_global.store(nullptr, std::memory_order_release);
+    auto_relink_filters.reset();
+    return;
+  }
+  PruneRelinkState();
+  size_t skipped = 0;
+  symbol_relocations symbols = global->get_global_soinfo_export_symbols(false, auto_relink_filters.get(), &skipped);
+  // New soinfo are always appended to the end of solist
+  for (soinfo *si = last == nullptr ? linker_symbol.solist.Get() : last->next(); si != nullptr; si = si->next()) {
+    if (si == global) {
+      continue;
+    }
+    uint64_t start_ns = monotonic_ns();
+    RelocationStats stats{};
+    stats.blacklist_skipped = skipped;
+    if (!si->process_new_library_relocation(symbols, relink_journals[GetRelinkKey(si)], &stats)) {
+      LOGW("auto relink library failed: %s", si->get_soname() == nullptr ? "(null)" : si->get_soname());
+    }
+    RecordRelinkStats(si, stats, start_ns);
+  }
+}
+
+void ProxyLinker::PruneRelinkState() {
+  if (relink_journals.empty() && relink_stats.empty()) {
+    return;
+  }
+  std::unordered_map<soinfo *, ElfW(Addr)> loaded;
+  for (soinfo *si = linker_symbol.solist.Get(); si != nullptr; si = si->next()) {
+    loaded.emplace(si, si->load_bias());
+  }
+  auto stale = [&](const RelinkKey &key) {
+    auto itr = loaded.find(key.si);
+    return itr == loaded.end() || itr->second != key.load_bias;
+  };
+  for (auto itr = relink_journals.begin(); itr != relink_journals.end();) {
+    itr = stale(itr->first) ? relink_journals.erase(itr) : std::next(itr);
+  }
+  for (auto itr = relink_stats.begin(); itr != relink_stats.end();) {
+    itr = stale(itr->first) ? relink_stats.erase(itr) : std::next(itr);
+  }
+}
+
+static void accumulate_relocation_stats(RelocationStats &total, const RelocationStats &stats) {
+  total.scanned_jump_slot += stats.scanned_jump_slot;
+  total.scanned_glob_dat += stats.scanned_glob_dat;
+  total.scanned_absolute += stats.scanned_absolute;
+  total.scanned_other += stats.scanned_other;
+  total.patched_slots += stats.patched_slots;
+  total.blacklist_skipped += stats.blacklist_skipped;
+  total.unprotected_pages += stats.unprotected_pages;
+  total.relink_count += stats.relink_count;
+  total.time_ns += stats.time_ns;
+  total.mprotect_calls += stats.mprotect_calls;
+}
+
+void ProxyLinker::RecordRelinkStats(soinfo *child, RelocationStats &stats, uint64_t start_ns) {
+  stats.time_ns = monotonic_ns() - start_ns;
+  stats.relink_count = 1;
+  RelinkStats &entry = relink_stats[GetRelinkKey(child)];
+  entry.last = stats;
+  accumulate_relocation_stats(entry.total, stats);
+  accumulate_relocation_stats(relink_total_stats, stats);
+  if (relink_stats_log.load(std::memory_order_relaxed)) {
+    __android_log_print(ANDROID_LOG_INFO, LOG_TAG,
+                        "relink %s: scanned jump_slot %" PRIu64 " glob_dat %" PRIu64 " absolute %" PRIu64
+                        " other %" PRIu64 ", patched %" PRIu64 ", blacklist skipped %" PRIu64
+                        ", unprotected pages %" PRIu64 ", mprotect %" PRIu64 ", time %" PRIu64 " us",
+                        child->get_soname() == nullptr ? "(null)" : child->get_soname(), stats.scanned_jump_slot,
+                        stats.scanned_glob_dat, stats.scanned_absolute, stats.scanned_other, stats.patched_slots,
+                        stats.blacklist_skipped, stats.unprotected_pages, stats.mprotect_calls, stats.time_ns / 1000);
+  }
+}
+
+bool ProxyLinker::GetRelinkStats(soinfo *child, RelocationStats *last, RelocationStats *total) {
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  if (child == nullptr) {
+    if (total) {
+      *total = relink_total_stats;
+    }
+    return true;
+  }
+  auto itr = relink_stats.find(GetRelinkKey(child));
+  if (itr == relink_stats.end()) {
+    return false;
+  }
+  if (last) {
+    *last = itr->second.last;
+  }
+  if (total) {
+    *total = itr->second.total;
+  }
+  return true;
 }
 
 /*
@@ -744,6 +1054,8 @@ bool ProxyLinker::SystemRelinkLibrary(soinfo *so) {
   }
   ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
   LinkerBlockLock lock;
+  // The system relocation rewrites every slot, the originals of a manual relink journal are no longer restorable
+  relink_journals.erase(GetRelinkKey(so));
   so->set_unlinked();
   // Re-dlopen fails because the SO already exists in the current process and won't go through ElfRead
   // For version 5.0, lookup will modify linker's data segment, so we need to unprotect linker
@@ -782,13 +1094,32 @@ bool ProxyLinker::SystemRelinkLibraries(const std::vector<std::string> &sonames)
 }
 
 void *ProxyLinker::CallDlopen(const char *filename, int flags, void *caller_addr, const android_dlextinfo *extinfo) {
-  if (android_api >= __ANDROID_API_N__) {
-    if (!caller_addr) {
-      caller_addr = __builtin_return_address(0);
-    }
-    return ProxyLinker::Get().CallDoDlopenN(filename, flags, extinfo, caller_addr);
+  if (android_api >= __ANDROID_API_N__ && !caller_addr) {
+    caller_addr = __builtin_return_address(0);
+  }
+  ProxyLinker &linker = ProxyLinker::Get();
+  auto do_dlopen = [&]() {
+    void *handle = android_api >= __ANDROID_API_N__ ? linker.CallDoDlopenN(filename, flags, extinfo, caller_addr)
+                                                    : linker.CallDoDlopen(filename, flags, extinfo);
+    // New libraries and their dependencies have been mapped
+    MapsHelper::Refresh();
+    return handle;
+  };
+  if (__predict_true(linker.auto_relink_global.load(std::memory_order_acquire) == nullptr)) {
+    return do_dlopen();
+  }
+  // g_dl_mutex is recursive, holding it keeps other threads from changing the soinfo list until the new libraries
+  // have been relinked
+  ScopedPthreadMutexLocker locker(linker_symbol.g_dl_mutex.Get());
+  soinfo *last = nullptr;
+  for (soinfo *si = linker_symbol.solist.Get(); si != nullptr; si = si->next()) {
+    last = si;
   }
-  return ProxyLinker::Get().CallDoDlopen(filename, flags, extinfo);
+  void *result = do_dlopen();
+  if (result != nullptr) {
+    linker.AutoRelinkNewLibraries(last);
+  }
+  return result;
 }
 
 void *ProxyLinker::CallDlsym(void *handle, const char *symbol, void *caller_addr, const char *version) {
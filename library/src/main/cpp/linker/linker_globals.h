@@ -3,6 +3,12 @@
 //
 #pragma once
 
+#include <pthread.h>
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
 #include <fakelinker/fake_linker.h>
 #include <fakelinker/macros.h>
 
@@ -114,15 +120,63 @@ public:
 
   bool ManualRelinkLibrary(soinfo *global, soinfo *child);
 
-  bool ManualRelinkLibrary(soinfo *global, soinfo *child, std::vector<std::string> &filters);
+  bool ManualRelinkLibrary(soinfo *global, soinfo *child, const SymbolBlacklist *filters);
 
-  bool ManualRelinkLibrary(symbol_relocations &rels, soinfo *child);
+  bool ManualRelinkLibrary(symbol_relocations &rels, soinfo *child, size_t blacklist_skipped = 0);
 
-  bool ManualRelinkLibraries(soinfo *global, const std::vector<std::string> &sonames,
-                             const std::vector<std::string> &filters);
+  bool ManualRelinkLibraries(soinfo *global, const std::vector<std::string> &sonames, const SymbolBlacklist *filters);
 
   bool ManualRelinkLibraries(soinfo *global, int len, const std::vector<soinfo *> &targets,
-                             std::vector<std::string> &filters);
+                             const SymbolBlacklist *filters);
+
+  /*
+   * Only rewrite the slots of one symbol recorded by a previous manual relink, address 0 restores the original value
+   */
+  bool UpdateRelinkSymbol(soinfo *child, const char *symbol, ElfW(Addr) address);
+
+  /*
+   * Restore all slots changed by manual relinks of the library, the relocation tables are not scanned again
+   */
+  bool ManualUnrelinkLibrary(soinfo *child);
+
+  /*
+   * Two phase relink, a plan can be computed once, saved and applied in later launches without scanning the
+   * relocation tables. Planning and binding look up libraries in solist, so both hold g_dl_mutex. A plan from
+   * another process is bound to the current exports of global before applying
+   */
+  bool PlanRelinkLibrary(soinfo *global, soinfo *child, const SymbolBlacklist *filters, relocation_plan &plan);
+
+  bool ApplyRelinkPlan(soinfo *global, soinfo *child, const SymbolBlacklist *filters, relocation_plan &plan);
+
+  /*
+   * Libraries loaded afterwards are relinked against the exported symbols of global once after loading, pass nullptr
+   * to disable. Note that the constructors of the new libraries have already run at that time.
+   * Android 8.0+ libdl forwards dlopen and android_dlopen_ext to the linker exports, its imports of them are
+   * redirected to CallDlopen so System.loadLibrary and app dlopen are covered. Older versions only relink libraries
+   * loaded through CallDlopen. The exports are resolved at every relink, automatic relinking stops once global has
+   * been unloaded
+   */
+  bool SetAutoRelinkLibrary(soinfo *global, const SymbolBlacklist *filters);
+
+  /*
+   * The relocation blacklist is copied on write under blacklist_mutex, it can be changed from any thread
+   * while relinks are running, readers keep the snapshot they got
+   */
+  void AddRelocationBlacklist(const char *symbol);
+
+  void RemoveRelocationBlacklist(const char *symbol);
+
+  void ClearRelocationBlacklist();
+
+  std::shared_ptr<const SymbolBlacklist> GetRelocationBlacklist();
+
+  /*
+   * Statistics of manual relinks, child is nullptr to get the statistics of the whole process.
+   * The statistics of a library are dropped with its journal once it has been unloaded
+   */
+  bool GetRelinkStats(soinfo *child, RelocationStats *last, RelocationStats *total);
+
+  void SetRelinkStatsLog(bool enable) { relink_stats_log.store(enable, std::memory_order_relaxed); }
 
   bool SystemRelinkLibrary(soinfo *so);
 
@@ -137,7 +191,61 @@ private:
 
   ANDROID_LE_L1 bool RelinkSoinfoImplL(soinfo *si);
 
+  void AutoRelinkNewLibraries(soinfo *last);
+
+  ANDROID_GE_O bool HookLoaderDlopen(bool enable);
+
+  ANDROID_GE_O static void *LoaderDlopen(const char *filename, int flags, const void *caller_addr);
+
+  ANDROID_GE_O static void *LoaderAndroidDlopenExt(const char *filename, int flags, const android_dlextinfo *extinfo,
+                                                   const void *caller_addr);
+
+  void RecordRelinkStats(soinfo *child, RelocationStats &stats, uint64_t start_ns);
+
+  /*
+   * Drop the journals and statistics of libraries that are no longer loaded at the recorded load bias,
+   * caller holds g_dl_mutex
+   */
+  void PruneRelinkState();
+
+  /*
+   * The relink state is keyed by soinfo and load bias, a soinfo reused by a later library never finds the
+   * entries of the unloaded one
+   */
+  struct RelinkKey {
+    soinfo *si;
+    ElfW(Addr) load_bias;
+
+    bool operator==(const RelinkKey &other) const { return si == other.si && load_bias == other.load_bias; }
+  };
+
+  struct RelinkKeyHash {
+    size_t operator()(const RelinkKey &key) const {
+      return std::hash<soinfo *>()(key.si) ^ (std::hash<ElfW(Addr)>()(key.load_bias) * 31);
+    }
+  };
+
+  static RelinkKey GetRelinkKey(soinfo *si) { return RelinkKey{si, si->load_bias()}; }
+
 private:
   ANDROID_GE_N std::vector<android_namespace_t *> namespaces;
+  // Protected by g_dl_mutex
+  std::unordered_map<RelinkKey, relocation_journal, RelinkKeyHash> relink_journals;
+  std::atomic<soinfo *> auto_relink_global = nullptr;
+  // Protected by g_dl_mutex, tell a still loaded global from a new soinfo at the same address
+  ElfW(Addr) auto_relink_base = 0;
+  std::shared_ptr<const SymbolBlacklist> auto_relink_filters;
+  struct RelinkStats {
+    RelocationStats last;
+    RelocationStats total;
+  };
+  // Protected by g_dl_mutex
+  std::unordered_map<RelinkKey, RelinkStats, RelinkKeyHash> relink_stats;
+  RelocationStats relink_total_stats{};
+  std::atomic<bool> relink_stats_log = false;
+  // Held briefly to swap or copy the pointer, a relink reads the blacklist only once when it starts
+  pthread_mutex_t blacklist_mutex = PTHREAD_MUTEX_INITIALIZER;
+  // Protected by blacklist_mutex
+  std::shared_ptr<const SymbolBlacklist> relocation_blacklist;
 };
 } // namespace fakelinker
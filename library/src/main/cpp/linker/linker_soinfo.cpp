@@ -5,7 +5,13 @@
 #include <dlfcn.h>
 #include <sys/auxv.h>
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <unordered_map>
+
 #include <fakelinker/android_level_compat.h>
+#include <fakelinker/elf_reader.h>
 #include <fakelinker/maps_util.h>
 #include <fakelinker/type.h>
 
@@ -552,7 +558,8 @@ enum class RelocMode {
 };
 
 template <RelocMode Mode>
-static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocations &rels) {
+static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocations &rels,
+                               relocation_journal *journal, RelocationStats *stats) {
   // Common for rel
   void *const rel_target = reinterpret_cast<void *>(reloc.r_offset + so->load_bias());
   const uint32_t r_type = R_TYPE(reloc.r_info);
@@ -563,6 +570,17 @@ static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocation
   if (__predict_false(r_type == R_GENERIC_NONE)) { // R_GENERIC_NONE
     return false;
   }
+  if (stats != nullptr) {
+    if (r_type == R_GENERIC_JUMP_SLOT) {
+      stats->scanned_jump_slot++;
+    } else if (r_type == R_GENERIC_GLOB_DAT) {
+      stats->scanned_glob_dat++;
+    } else if (r_type == R_GENERIC_ABSOLUTE) {
+      stats->scanned_absolute++;
+    } else {
+      stats->scanned_other++;
+    }
+  }
   if (is_tls_reloc(r_type)) {
     return false;
   }
@@ -591,11 +609,38 @@ static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocation
   };
 #endif
   ElfW(Addr) orig = *static_cast<ElfW(Addr) *>(rel_target);
+  // Record every slot that may be redirected, so later updates do not need to scan the tables again
+  relocation_slot *record = nullptr;
+  if (journal != nullptr) {
+#if defined(USE_RELA)
+    bool journaled = Mode == RelocMode::JumpTable ? r_type == R_GENERIC_JUMP_SLOT
+                                                  : r_type == R_GENERIC_ABSOLUTE || r_type == R_GENERIC_GLOB_DAT;
+#else
+    // The implicit addend of a REL absolute slot has been overwritten, a later update could not rebuild its value
+    bool journaled = Mode == RelocMode::JumpTable ? r_type == R_GENERIC_JUMP_SLOT : r_type == R_GENERIC_GLOB_DAT;
+#endif
+    if (journaled) {
+      record = &journal->symbols[sym_name].emplace_back(relocation_slot{
+        .slot = reinterpret_cast<ElfW(Addr)>(rel_target),
+        .original = orig,
+        .addend = get_addend_norel(),
+      });
+    }
+  }
+  auto commit = [&]() {
+    if (stats != nullptr && orig != *static_cast<ElfW(Addr) *>(rel_target)) {
+      stats->patched_slots++;
+    }
+    if (record != nullptr) {
+      record->addend = *static_cast<ElfW(Addr) *>(rel_target) - sym_addr;
+    }
+  };
   if (auto itr = rels.find(sym_name); itr != rels.end()) {
     sym_addr = itr->second;
     if (Mode == RelocMode::JumpTable) {
       if (r_type == R_GENERIC_JUMP_SLOT) {
         *static_cast<ElfW(Addr) *>(rel_target) = sym_addr + get_addend_norel();
+        commit();
         LOGV("Relocation symbol JumpTable: %s, original address: %p, new "
              "address: %p",
              sym_name, reinterpret_cast<void *>(orig),
@@ -606,6 +651,7 @@ static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocation
     if (Mode == RelocMode::Typical) {
       if (r_type == R_GENERIC_ABSOLUTE) {
         *static_cast<ElfW(Addr) *>(rel_target) = sym_addr + get_addend_rel();
+        commit();
         LOGV("Relocation symbol Typical ABSOLUTE: %s, original address: %16p, "
              " new address: %16p",
              sym_name, reinterpret_cast<void *>(orig),
@@ -613,6 +659,7 @@ static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocation
         return true;
       } else if (r_type == R_GENERIC_GLOB_DAT) {
         *static_cast<ElfW(Addr) *>(rel_target) = sym_addr + get_addend_norel();
+        commit();
         LOGV("Relocation symbol Typical GLOB_DAT: %s, original address: %16p, "
              " new address: %16p",
              sym_name, reinterpret_cast<void *>(orig),
@@ -626,9 +673,10 @@ static bool process_relocation(soinfo *so, const rel_t &reloc, symbol_relocation
 }
 
 template <RelocMode OptMode>
-static bool plain_relocate_impl(soinfo *so, rel_t *rels, size_t rel_count, symbol_relocations &symbols) {
+static bool plain_relocate_impl(soinfo *so, rel_t *rels, size_t rel_count, symbol_relocations &symbols,
+                                relocation_journal *journal, RelocationStats *stats) {
   for (size_t i = 0; i < rel_count; ++i) {
-    process_relocation<OptMode>(so, rels[i], symbols);
+    process_relocation<OptMode>(so, rels[i], symbols, journal, stats);
   }
   return true;
 }
@@ -2436,6 +2484,11 @@ size_t soinfo::get_symbols_count() {
 }
 
 symbol_relocations soinfo::get_global_soinfo_export_symbols(bool only_func) {
+  return get_global_soinfo_export_symbols(only_func, nullptr);
+}
+
+symbol_relocations soinfo::get_global_soinfo_export_symbols(bool only_func, const SymbolBlacklist *filters,
+                                                            size_t *skipped) {
   uint32_t start = 0;
   uint32_t end;
   ElfW(Sym) sym;
@@ -2472,24 +2525,183 @@ symbol_relocations soinfo::get_global_soinfo_export_symbols(bool only_func) {
     if (!find_global(sym)) {
       continue;
     }
-    result.emplace(get_string(sym.st_name), resolve_symbol_address(&sym));
+    const char *name = get_string(sym.st_name);
+    if (filters != nullptr && filters->contains(name)) {
+      if (skipped != nullptr) {
+        (*skipped)++;
+      }
+      continue;
+    }
+    result.emplace(name, resolve_symbol_address(&sym));
     len++;
   }
   return result;
 }
 
-symbol_relocations soinfo::get_global_soinfo_export_symbols(bool only_func, const std::vector<std::string> &filters) {
-  symbol_relocations symbols = get_global_soinfo_export_symbols(only_func);
-  if (symbols.empty() || filters.empty()) {
-    return symbols;
+bool soinfo::again_process_relocation(symbol_relocations &rels) {
+  fakelinker::MapsHelper util;
+  if (!util.GetLibraryProtect(get_soname())) {
+    LOGE("No access to the library: %s", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  if (!util.UnlockPageProtect()) {
+    LOGE("cannot change soinfo: %s memory protect", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  LOGV("again relocation library: %s", get_soname());
+  scan_relocation(rels, nullptr, nullptr);
+  util.RecoveryPageProtect();
+  return true;
+}
+
+static uint64_t unlocked_page_count(const fakelinker::MapsHelper &util) {
+  uint64_t count = 0;
+  for (auto &page : util) {
+    if (page.new_protect != page.old_protect) {
+      count += (page.end - page.start) / page_size();
+    }
   }
-  for (auto &name : filters) {
-    symbols.erase(name);
+  return count;
+}
+
+static void recovery_page_protect(fakelinker::MapsHelper &util, RelocationStats *stats) {
+  if (stats != nullptr) {
+    stats->unprotected_pages += unlocked_page_count(util);
+  }
+  util.RecoveryPageProtect();
+  if (stats != nullptr) {
+    stats->mprotect_calls += util.MprotectCount();
   }
-  return symbols;
 }
 
-bool soinfo::again_process_relocation(symbol_relocations &rels) {
+static void relro_protect_stats(const ElfW(Phdr) * phdr_table, size_t phdr_count, RelocationStats *stats) {
+  if (stats == nullptr) {
+    return;
+  }
+  for (const ElfW(Phdr) *phdr = phdr_table; phdr < phdr_table + phdr_count; ++phdr) {
+    if (phdr->p_type == PT_GNU_RELRO) {
+      stats->unprotected_pages += (PAGE_END(phdr->p_vaddr + phdr->p_memsz) - PAGE_START(phdr->p_vaddr)) / page_size();
+      // Unprotect and protect again
+      stats->mprotect_calls += 2;
+    }
+  }
+}
+
+void soinfo::scan_relocation(symbol_relocations &rels, relocation_journal *journal, RelocationStats *stats) {
+#if defined(USE_RELA)
+  if (rela() != nullptr) {
+    plain_relocate_impl<RelocMode::Typical>(this, rela(), rela_count(), rels, journal, stats);
+  }
+  if (plt_rela() != nullptr) {
+    plain_relocate_impl<RelocMode::JumpTable>(this, plt_rela(), plt_rela_count(), rels, journal, stats);
+  }
+#else
+  if (rel() != nullptr) {
+    plain_relocate_impl<RelocMode::Typical>(this, rel(), rel_count(), rels, journal, stats);
+  }
+  if (plt_rel() != nullptr) {
+    plain_relocate_impl<RelocMode::JumpTable>(this, plt_rel(), plt_rel_count(), rels, journal, stats);
+  }
+#endif
+}
+
+bool soinfo::again_process_relocation(symbol_relocations &rels, relocation_journal &journal, RelocationStats *stats) {
+  if (!journal.symbols.empty() && journal.load_bias != load_bias()) {
+    // The library was unloaded and another one now lives at this soinfo, the old slots are meaningless
+    LOGW("discard stale relocation journal of library: %s", get_soname() == nullptr ? "(null)" : get_soname());
+    journal.symbols.clear();
+  }
+  if (journal.symbols.empty()) {
+    fakelinker::MapsHelper util;
+    if (!util.GetLibraryProtect(get_soname())) {
+      LOGE("No access to the library: %s", get_soname() == nullptr ? "(null)" : get_soname());
+      return false;
+    }
+    if (!util.UnlockPageProtect()) {
+      LOGE("cannot change soinfo: %s memory protect", get_soname() == nullptr ? "(null)" : get_soname());
+      return false;
+    }
+    LOGV("again relocation library: %s, build relocation journal", get_soname());
+    journal.load_bias = load_bias();
+    scan_relocation(rels, &journal, stats);
+    recovery_page_protect(util, stats);
+    return true;
+  }
+  return write_relocation_journal(journal, rels, false, stats);
+}
+
+bool soinfo::process_new_library_relocation(symbol_relocations &rels, relocation_journal &journal,
+                                            RelocationStats *stats) {
+#if !defined(__LP64__)
+  if (has_text_relocations()) {
+    // The text segment protection has been restored by the system linker, fall back to the maps protection
+    return again_process_relocation(rels, journal, stats);
+  }
+#endif
+  if (fakelinker::phdr_table_unprotect_gnu_relro(phdr(), phnum(), load_bias(), should_pad_segments(),
+                                                 should_use_16kib_app_compat()) < 0) {
+    LOGE("can't unprotect relro for \"%s\": %m", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  LOGV("relocation new library: %s", get_soname());
+  journal.symbols.clear();
+  journal.load_bias = load_bias();
+  scan_relocation(rels, &journal, stats);
+  relro_protect_stats(phdr(), phnum(), stats);
+  if (fakelinker::phdr_table_protect_gnu_relro(phdr(), phnum(), load_bias(), should_pad_segments(),
+                                               should_use_16kib_app_compat()) < 0) {
+    LOGE("can't protect relro for \"%s\": %m", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  return true;
+}
+
+bool soinfo::update_relocation_symbol(relocation_journal &journal, const char *symbol, ElfW(Addr) address,
+                                      RelocationStats *stats) {
+  if (symbol == nullptr || journal.symbols.empty() || journal.load_bias != load_bias()) {
+    return false;
+  }
+  symbol_relocations rels;
+  rels.emplace(symbol, address);
+  return write_relocation_journal(journal, rels, address == 0, stats);
+}
+
+bool soinfo::restore_relocation(relocation_journal &journal, RelocationStats *stats) {
+  if (journal.symbols.empty() || journal.load_bias != load_bias()) {
+    return false;
+  }
+  symbol_relocations rels;
+  for (auto &[name, slots] : journal.symbols) {
+    for (auto &slot : slots) {
+      if (*reinterpret_cast<ElfW(Addr) *>(slot.slot) != slot.original) {
+        rels.emplace(name, 0);
+        break;
+      }
+    }
+  }
+  return rels.empty() || write_relocation_journal(journal, rels, true, stats);
+}
+
+bool soinfo::write_relocation_journal(relocation_journal &journal, const symbol_relocations &rels, bool restore,
+                                      RelocationStats *stats) {
+  // Collect the slots whose value actually changes first, so that unchanged libraries do not touch page protection.
+  // Compare with the live value, the slot may have been rewritten behind the journal
+  std::vector<std::pair<relocation_slot *, ElfW(Addr)>> changed;
+  for (auto &[name, address] : rels) {
+    auto itr = journal.symbols.find(name);
+    if (itr == journal.symbols.end()) {
+      continue;
+    }
+    for (auto &slot : itr->second) {
+      ElfW(Addr) value = restore ? slot.original : address + slot.addend;
+      if (*reinterpret_cast<ElfW(Addr) *>(slot.slot) != value) {
+        changed.emplace_back(&slot, value);
+      }
+    }
+  }
+  if (changed.empty()) {
+    return true;
+  }
   fakelinker::MapsHelper util;
   if (!util.GetLibraryProtect(get_soname())) {
     LOGE("No access to the library: %s", get_soname() == nullptr ? "(null)" : get_soname());
@@ -2499,24 +2711,377 @@ bool soinfo::again_process_relocation(symbol_relocations &rels) {
     LOGE("cannot change soinfo: %s memory protect", get_soname() == nullptr ? "(null)" : get_soname());
     return false;
   }
-  LOGV("again relocation library: %s", get_soname());
+  for (auto &[slot, value] : changed) {
+    LOGV("Relocation journal slot: %p, old value: %p, new value: %p", reinterpret_cast<void *>(slot->slot),
+         reinterpret_cast<void *>(*reinterpret_cast<ElfW(Addr) *>(slot->slot)), reinterpret_cast<void *>(value));
+    *reinterpret_cast<ElfW(Addr) *>(slot->slot) = value;
+  }
+  if (stats != nullptr) {
+    stats->patched_slots += changed.size();
+  }
+  recovery_page_protect(util, stats);
+  return true;
+}
+
+namespace {
+constexpr uint32_t kRelocationPlanMagic = 0x4e4c5052; // "RPLN"
+constexpr uint16_t kRelocationPlanVersion = 2;
+
+struct relocation_plan_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t word_size;
+  uint32_t build_id_size;
+  uint32_t symbol_count;
+  uint32_t strings_size;
+  uint32_t entry_count;
+  // Every target is its name and build-id, both null terminated
+  uint32_t target_count;
+  uint32_t target_strings_size;
+  uint64_t load_bias;
+};
+
+struct relocation_plan_record {
+  uint64_t slot;
+  uint64_t expected;
+  uint64_t addend;
+  uint32_t symbol;
+  uint32_t target;
+};
+} // namespace
+
+std::string relocation_plan::serialize() const {
+  relocation_plan_header header{};
+  header.magic = kRelocationPlanMagic;
+  header.version = kRelocationPlanVersion;
+  header.word_size = sizeof(ElfW(Addr));
+  header.build_id_size = build_id.size();
+  header.symbol_count = symbols.size();
+  header.entry_count = entries.size();
+  header.load_bias = load_bias;
+  header.target_count = targets.size();
+  for (auto &name : symbols) {
+    header.strings_size += name.size() + 1;
+  }
+  for (auto &target : targets) {
+    header.target_strings_size += target.name.size() + target.build_id.size() + 2;
+  }
+  std::string result;
+  result.reserve(sizeof(header) + header.build_id_size + header.strings_size + header.target_strings_size +
+                 entries.size() * sizeof(relocation_plan_record));
+  result.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  result.append(build_id);
+  for (auto &name : symbols) {
+    result.append(name.c_str(), name.size() + 1);
+  }
+  for (auto &target : targets) {
+    result.append(target.name.c_str(), target.name.size() + 1);
+    result.append(target.build_id.c_str(), target.build_id.size() + 1);
+  }
+  for (auto &entry : entries) {
+    relocation_plan_record record{};
+    record.slot = entry.slot;
+    record.expected = entry.expected;
+    record.addend = entry.addend;
+    record.symbol = entry.symbol;
+    record.target = entry.target;
+    result.append(reinterpret_cast<const char *>(&record), sizeof(record));
+  }
+  return result;
+}
+
+bool relocation_plan::deserialize(const void *data, size_t size) {
+  relocation_plan_header header;
+  if (data == nullptr || size < sizeof(header)) {
+    return false;
+  }
+  const char *ptr = static_cast<const char *>(data);
+  memcpy(&header, ptr, sizeof(header));
+  if (header.magic != kRelocationPlanMagic || header.version != kRelocationPlanVersion ||
+      header.word_size != sizeof(ElfW(Addr))) {
+    LOGE("unsupported relocation plan, magic: 0x%x, version: %d, word size: %d", header.magic, header.version,
+         header.word_size);
+    return false;
+  }
+  uint64_t need = sizeof(header) + static_cast<uint64_t>(header.build_id_size) + header.strings_size +
+                  header.target_strings_size +
+                  static_cast<uint64_t>(header.entry_count) * sizeof(relocation_plan_record);
+  if (need != size) {
+    LOGE("relocation plan size mismatch, expected: %" PRIu64 ", actual: %zu", need, size);
+    return false;
+  }
+  ptr += sizeof(header);
+  build_id.assign(ptr, header.build_id_size);
+  ptr += header.build_id_size;
+  load_bias = header.load_bias;
+
+  symbols.clear();
+  symbols.reserve(header.symbol_count);
+  const char *strings_end = ptr + header.strings_size;
+  while (ptr < strings_end) {
+    const char *end = static_cast<const char *>(memchr(ptr, '\0', strings_end - ptr));
+    if (end == nullptr) {
+      return false;
+    }
+    symbols.emplace_back(ptr, end - ptr);
+    ptr = end + 1;
+  }
+  if (symbols.size() != header.symbol_count) {
+    return false;
+  }
+  targets.clear();
+  targets.reserve(header.target_count);
+  const char *target_strings_end = ptr + header.target_strings_size;
+  while (ptr < target_strings_end) {
+    const char *name_end = static_cast<const char *>(memchr(ptr, '\0', target_strings_end - ptr));
+    if (name_end == nullptr) {
+      return false;
+    }
+    const char *build_id_end = static_cast<const char *>(memchr(name_end + 1, '\0', target_strings_end - name_end - 1));
+    if (build_id_end == nullptr) {
+      return false;
+    }
+    targets.push_back(relocation_plan_target{
+      .name = std::string(ptr, name_end - ptr),
+      .build_id = std::string(name_end + 1, build_id_end - name_end - 1),
+      .load_bias = 0,
+    });
+    ptr = build_id_end + 1;
+  }
+  if (targets.size() != header.target_count) {
+    return false;
+  }
+  entries.clear();
+  entries.reserve(header.entry_count);
+  for (uint32_t i = 0; i < header.entry_count; ++i, ptr += sizeof(relocation_plan_record)) {
+    relocation_plan_record record;
+    memcpy(&record, ptr, sizeof(record));
+    if (record.symbol >= header.symbol_count ||
+        (record.target != kNoPlanTarget && record.target >= header.target_count)) {
+      return false;
+    }
+    entries.push_back(relocation_plan_entry{
+      .slot = static_cast<ElfW(Addr)>(record.slot),
+      .expected = static_cast<ElfW(Addr)>(record.expected),
+      .value = 0,
+      .addend = static_cast<ElfW(Addr)>(record.addend),
+      .symbol = record.symbol,
+      .target = record.target,
+    });
+  }
+  return true;
+}
 
+std::string soinfo::get_build_id() {
+  static constexpr char kHex[] = "0123456789abcdef";
+  for (const ElfW(Phdr) *phdr = this->phdr(); phdr < this->phdr() + phnum(); ++phdr) {
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    ElfW(Addr) note = load_bias() + phdr->p_vaddr;
+    ElfW(Addr) note_end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= note_end) {
+      auto *nhdr = reinterpret_cast<const ElfW(Nhdr) *>(note);
+      const char *name = reinterpret_cast<const char *>(nhdr + 1);
+      const uint8_t *desc = reinterpret_cast<const uint8_t *>(name + align_up(nhdr->n_namesz, 4));
+      note = reinterpret_cast<ElfW(Addr)>(desc) + align_up(nhdr->n_descsz, 4);
+      if (note > note_end) {
+        break;
+      }
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+        std::string result;
+        result.reserve(nhdr->n_descsz * 2);
+        for (size_t i = 0; i < nhdr->n_descsz; ++i) {
+          result.push_back(kHex[desc[i] >> 4]);
+          result.push_back(kHex[desc[i] & 0xf]);
+        }
+        return result;
+      }
+    }
+  }
+  return {};
+}
+
+template <RelocMode Mode>
+static void plan_relocate_impl(soinfo *so, const rel_t *rels, size_t rel_count, const symbol_relocations &symbols,
+                               relocation_plan &plan, std::unordered_map<std::string_view, uint32_t> &indexes,
+                               std::unordered_map<soinfo *, uint32_t> &targets) {
+  const ElfW(Addr) bias = so->load_bias();
+  for (size_t i = 0; i < rel_count; ++i) {
+    const rel_t &reloc = rels[i];
+    const uint32_t r_type = R_TYPE(reloc.r_info);
+    const uint32_t r_sym = R_SYM(reloc.r_info);
+    if (Mode == RelocMode::JumpTable ? r_type != R_GENERIC_JUMP_SLOT
+                                     : r_type != R_GENERIC_ABSOLUTE && r_type != R_GENERIC_GLOB_DAT) {
+      continue;
+    }
+    if (r_sym == 0 || ELF_ST_BIND(so->symtab()[r_sym].st_info) == STB_LOCAL) {
+      continue;
+    }
+    const char *sym_name = so->get_string(so->symtab()[r_sym].st_name);
+    auto itr = symbols.find(sym_name);
+    if (itr == symbols.end()) {
+      continue;
+    }
+#if defined(USE_RELA)
+    ElfW(Addr) addend = reloc.r_addend;
+#else
+    if (r_type == R_GENERIC_ABSOLUTE) {
+      // The implicit addend has been overwritten by the system linker, it cannot be planned safely
+      LOGW("skip planning REL absolute relocation of symbol: %s", sym_name);
+      continue;
+    }
+    ElfW(Addr) addend = 0;
+#endif
+    ElfW(Addr) expected = *reinterpret_cast<ElfW(Addr) *>(reloc.r_offset + bias);
+    ElfW(Addr) value = itr->second + addend;
+    if (expected == value) {
+      continue;
+    }
+    auto [index, inserted] = indexes.try_emplace(itr->first, plan.symbols.size());
+    if (inserted) {
+      plan.symbols.push_back(itr->first);
+    }
+    // Keep the expected value relative to the library it points into, that library moves in a later launch
+    uint32_t target = kNoPlanTarget;
+    soinfo *lib = nullptr;
+    if (expected != 0) {
+      lib = fakelinker::ProxyLinker::Get().FindContainingLibrary(reinterpret_cast<void *>(expected));
+    }
+    if (lib != nullptr && lib->get_soname() != nullptr) {
+      auto [target_itr, added] = targets.try_emplace(lib, plan.targets.size());
+      if (added) {
+        plan.targets.push_back(relocation_plan_target{
+          .name = lib->get_soname(),
+          .build_id = lib->get_build_id(),
+          .load_bias = lib->load_bias(),
+        });
+      }
+      target = target_itr->second;
+      expected -= lib->load_bias();
+    }
+    plan.entries.push_back(relocation_plan_entry{
+      .slot = reloc.r_offset,
+      .expected = expected,
+      .value = value,
+      .addend = addend,
+      .symbol = index->second,
+      .target = target,
+    });
+  }
+}
+
+bool soinfo::make_relocation_plan(const symbol_relocations &rels, relocation_plan &plan) {
+  plan.build_id = get_build_id();
+  plan.load_bias = load_bias();
+  plan.symbols.clear();
+  plan.targets.clear();
+  plan.entries.clear();
+  std::unordered_map<std::string_view, uint32_t> indexes;
+  std::unordered_map<soinfo *, uint32_t> targets;
 #if defined(USE_RELA)
   if (rela() != nullptr) {
-    plain_relocate_impl<RelocMode::Typical>(this, rela(), rela_count(), rels);
+    plan_relocate_impl<RelocMode::Typical>(this, rela(), rela_count(), rels, plan, indexes, targets);
   }
   if (plt_rela() != nullptr) {
-    plain_relocate_impl<RelocMode::JumpTable>(this, plt_rela(), plt_rela_count(), rels);
+    plan_relocate_impl<RelocMode::JumpTable>(this, plt_rela(), plt_rela_count(), rels, plan, indexes, targets);
   }
 #else
   if (rel() != nullptr) {
-    plain_relocate_impl<RelocMode::Typical>(this, rel(), rel_count(), rels);
+    plan_relocate_impl<RelocMode::Typical>(this, rel(), rel_count(), rels, plan, indexes, targets);
   }
   if (plt_rel() != nullptr) {
-    plain_relocate_impl<RelocMode::JumpTable>(this, plt_rel(), plt_rel_count(), rels);
+    plan_relocate_impl<RelocMode::JumpTable>(this, plt_rel(), plt_rel_count(), rels, plan, indexes, targets);
   }
 #endif
-  util.RecoveryPageProtect();
+  std::sort(plan.entries.begin(), plan.entries.end(),
+            [](const relocation_plan_entry &a, const relocation_plan_entry &b) { return a.slot < b.slot; });
+  LOGV("plan relocation library: %s, symbols: %zu, slots: %zu", get_soname(), plan.symbols.size(),
+       plan.entries.size());
+  return true;
+}
+
+bool soinfo::bind_relocation_plan(const symbol_relocations &rels, relocation_plan &plan) {
+  const ElfW(Addr) image_start = base();
+  const ElfW(Addr) image_end = base() + size();
+  for (auto &target : plan.targets) {
+    soinfo *lib = fakelinker::ProxyLinker::Get().FindSoinfoByName(target.name.c_str());
+    if (lib == nullptr || lib->get_build_id() != target.build_id) {
+      LOGE("relocation plan of %s expects library %s with build-id %s, current: %s",
+           get_soname() == nullptr ? "(null)" : get_soname(), target.name.c_str(), target.build_id.c_str(),
+           lib == nullptr ? "(not loaded)" : lib->get_build_id().c_str());
+      return false;
+    }
+    target.load_bias = lib->load_bias();
+  }
+  // Values outside of any library can only be expected again in the same mapping
+  const bool same_mapping = plan.load_bias == load_bias();
+  std::vector<const ElfW(Addr) *> addresses(plan.symbols.size(), nullptr);
+  for (size_t i = 0; i < plan.symbols.size(); ++i) {
+    if (auto itr = rels.find(plan.symbols[i]); itr != rels.end()) {
+      addresses[i] = &itr->second;
+    }
+  }
+  size_t count = 0;
+  for (auto &entry : plan.entries) {
+    ElfW(Addr) slot = load_bias() + entry.slot;
+    if (slot < image_start || slot + sizeof(ElfW(Addr)) > image_end) {
+      LOGE("relocation plan slot out of library %s: %p", get_soname() == nullptr ? "(null)" : get_soname(),
+           reinterpret_cast<void *>(slot));
+      return false;
+    }
+    if (entry.target == kNoPlanTarget && entry.expected != 0 && !same_mapping) {
+      LOGE("relocation plan slot %p of %s expects %p outside of any library", reinterpret_cast<void *>(slot),
+           get_soname() == nullptr ? "(null)" : get_soname(), reinterpret_cast<void *>(entry.expected));
+      return false;
+    }
+    if (addresses[entry.symbol] == nullptr) {
+      continue;
+    }
+    entry.value = *addresses[entry.symbol] + entry.addend;
+    plan.entries[count++] = entry;
+  }
+  plan.entries.resize(count);
+  plan.load_bias = load_bias();
+  return true;
+}
+
+bool soinfo::apply_relocation_plan(const relocation_plan &plan, RelocationStats *stats) {
+  if (plan.load_bias != load_bias()) {
+    LOGE("relocation plan is not bound to library: %s", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  // Verify everything before the first write, a plan is either applied completely or not at all
+  for (auto &entry : plan.entries) {
+    ElfW(Addr) current = *reinterpret_cast<ElfW(Addr) *>(load_bias() + entry.slot);
+    ElfW(Addr) expected = plan.expected_value(entry);
+    if (current != expected && current != entry.value) {
+      LOGE("relocation plan slot %p of symbol %s changed, expected: %p, actual: %p",
+           reinterpret_cast<void *>(load_bias() + entry.slot), plan.symbols[entry.symbol].c_str(),
+           reinterpret_cast<void *>(expected), reinterpret_cast<void *>(current));
+      return false;
+    }
+  }
+  if (plan.entries.empty()) {
+    return true;
+  }
+  fakelinker::MapsHelper util;
+  if (!util.GetLibraryProtect(get_soname())) {
+    LOGE("No access to the library: %s", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  if (!util.UnlockPageProtect()) {
+    LOGE("cannot change soinfo: %s memory protect", get_soname() == nullptr ? "(null)" : get_soname());
+    return false;
+  }
+  for (auto &entry : plan.entries) {
+    *reinterpret_cast<ElfW(Addr) *>(load_bias() + entry.slot) = entry.value;
+  }
+  if (stats != nullptr) {
+    stats->patched_slots += plan.entries.size();
+  }
+  recovery_page_protect(util, stats);
+
   return true;
 }
 
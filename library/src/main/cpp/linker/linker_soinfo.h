@@ -5,7 +5,12 @@
 
 #include <list>
 #include <map>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
 
+#include <fakelinker/fake_linker.h>
 #include <fakelinker/linker_macros.h>
 
 #include "linker_namespaces.h"
@@ -176,6 +181,97 @@ ANDROID_GE_N struct android_dlextinfoN : android_dlextinfo {
 
 typedef std::map<std::string, ElfW(Addr)> symbol_relocations;
 
+/*
+ * Immutable set of symbol names excluded from manual relocation. Modifications build a new set that
+ * replaces the old one, so a set that was handed out can be read from any thread without locking
+ */
+class SymbolBlacklist {
+public:
+  explicit SymbolBlacklist(std::vector<std::string> names) : names_(std::move(names)) {
+    index_.reserve(names_.size());
+    for (auto &name : names_) {
+      index_.emplace(name);
+    }
+  }
+
+  bool contains(const char *name) const { return !index_.empty() && index_.count(name) != 0; }
+
+  bool empty() const { return names_.empty(); }
+
+  const std::vector<std::string> &names() const { return names_; }
+
+private:
+  // names_ is never modified after construction, the views in index_ point into it
+  std::vector<std::string> names_;
+  std::unordered_set<std::string_view> index_;
+};
+
+/*
+ * A slot written by manual relocation. original is the value before the first manual relocation, the current
+ * value is always read from the slot because the system linker or other hooks may rewrite it
+ */
+struct relocation_slot {
+  ElfW(Addr) slot;
+  ElfW(Addr) original;
+  ElfW(Addr) addend;
+};
+
+constexpr uint32_t kNoPlanTarget = UINT32_MAX;
+
+/*
+ * A slot write computed in advance. slot is relative to the load bias of the planned library, expected is the
+ * value seen while planning relative to the load bias of the library at target, absolute for kNoPlanTarget.
+ * value is only valid in the process that made or bound the plan
+ */
+struct relocation_plan_entry {
+  ElfW(Addr) slot;
+  ElfW(Addr) expected;
+  ElfW(Addr) value;
+  ElfW(Addr) addend;
+  uint32_t symbol;
+  uint32_t target;
+};
+
+/*
+ * The library an expected value points into, it must have the same build-id when the plan is bound again
+ */
+struct relocation_plan_target {
+  std::string name;
+  std::string build_id;
+  // Only valid in the process that made or bound the plan
+  ElfW(Addr) load_bias;
+};
+
+/*
+ * Relocation plan of a library, entries are sorted by slot. The serialized form keeps the symbol names,
+ * addends and the libraries of the expected values, so a plan made in a previous launch can be bound again
+ * when the build-ids match
+ */
+struct relocation_plan {
+  std::string build_id;
+  ElfW(Addr) load_bias = 0;
+  std::vector<std::string> symbols;
+  std::vector<relocation_plan_target> targets;
+  std::vector<relocation_plan_entry> entries;
+
+  ElfW(Addr) expected_value(const relocation_plan_entry &entry) const {
+    return entry.target == kNoPlanTarget ? entry.expected : targets[entry.target].load_bias + entry.expected;
+  }
+
+  std::string serialize() const;
+
+  bool deserialize(const void *data, size_t size);
+};
+
+/*
+ * Undo journal of a manually relocated library. All slots that reference an imported symbol are recorded
+ * on the first relocation, later updates and restores only touch the slots of the changed symbols
+ */
+struct relocation_journal {
+  ElfW(Addr) load_bias = 0;
+  std::map<std::string, std::vector<relocation_slot>> symbols;
+};
+
 struct memtag_dynamic_entries_t {
   void *memtag_globals;
   size_t memtag_globalssz;
@@ -535,10 +631,62 @@ struct soinfo {
    */
   symbol_relocations get_global_soinfo_export_symbols(bool only_func);
 
-  symbol_relocations get_global_soinfo_export_symbols(bool only_func, const std::vector<std::string> &filters);
+  symbol_relocations get_global_soinfo_export_symbols(bool only_func, const SymbolBlacklist *filters,
+                                                      size_t *skipped = nullptr);
 
   bool again_process_relocation(symbol_relocations &rels);
 
+  /*
+   * Relocate with an undo journal. The relocation tables are only scanned when the journal is empty,
+   * otherwise only the journaled slots of the symbols in rels are written
+   */
+  bool again_process_relocation(symbol_relocations &rels, relocation_journal &journal,
+                                RelocationStats *stats = nullptr);
+
+  /*
+   * Relocate a library that has just been loaded. The protection is taken from the program headers, so no maps
+   * parsing is required, only GNU_RELRO needs to be unlocked
+   */
+  bool process_new_library_relocation(symbol_relocations &rels, relocation_journal &journal,
+                                      RelocationStats *stats = nullptr);
+
+  /*
+   * Hex encoded NT_GNU_BUILD_ID of the loaded image, empty if there is none
+   */
+  std::string get_build_id();
+
+  /*
+   * Walk the relocation tables and compute the slot writes without changing memory, caller holds g_dl_mutex
+   */
+  bool make_relocation_plan(const symbol_relocations &rels, relocation_plan &plan);
+
+  /*
+   * Recompute the addresses of a deserialized plan for the current process, fails if a library of the
+   * expected values is not loaded with the same build-id, caller holds g_dl_mutex
+   */
+  bool bind_relocation_plan(const symbol_relocations &rels, relocation_plan &plan);
+
+  /*
+   * Verify that every slot still holds the expected value and then write all values, caller holds g_dl_mutex
+   */
+  bool apply_relocation_plan(const relocation_plan &plan, RelocationStats *stats);
+
+  /*
+   * Write the journaled slots of a single symbol, address 0 restores the original values
+   */
+  bool update_relocation_symbol(relocation_journal &journal, const char *symbol, ElfW(Addr) address,
+                                RelocationStats *stats = nullptr);
+
+  /*
+   * Restore all journaled slots to their original values without scanning the relocation tables
+   */
+  bool restore_relocation(relocation_journal &journal, RelocationStats *stats = nullptr);
+
+  void scan_relocation(symbol_relocations &rels, relocation_journal *journal, RelocationStats *stats);
+
+  bool write_relocation_journal(relocation_journal &journal, const symbol_relocations &rels, bool restore,
+                                RelocationStats *stats);
+
   ANDROID_GE_M ElfW(Addr) get_verdef_ptr();
 
   ANDROID_GE_M size_t get_verdef_cnt();
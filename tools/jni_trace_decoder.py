@@ -0,0 +1,316 @@
+# -*- coding: utf-8 -*-
+"""Decode the binary JNI trace written by BaseTraceJNICallback::StartFileTrace.
+
+The output is the same text the async trace writes to logcat, or JSON / Chrome trace event format
+(open it in chrome://tracing or https://ui.perfetto.dev).
+"""
+import argparse
+import json
+import logging
+import re
+import struct
+import sys
+from pathlib import Path
+
+MAGIC = b'FLJT'
+VERSION = 1
+HEADER = struct.Struct('<4sHHQQ')
+
+TAG_END = 0
+TAG_STRING = 1
+TAG_FUNCTION = 2
+TAG_SYMBOL = 3
+TAG_EVENT = 4
+TAG_DROPPED = 5
+TAG_SUPPRESSED = 6
+
+TV_NONE = 0
+TV_INT = 1
+TV_UNSIGNED = 2
+TV_FLOAT = 3
+TV_DOUBLE = 4
+TV_POINTER = 5
+TV_OBJECT = 6
+TV_CLASS = 7
+TV_STRING = 8
+TV_METHOD_ID = 9
+TV_FIELD_ID = 10
+TV_CSTRING = 11
+
+HANDLE_PREFIX = {
+  TV_OBJECT: 'jobject ',
+  TV_CLASS: 'jclass ',
+  TV_STRING: 'jstring ',
+  TV_CSTRING: 'char* ',
+}
+
+
+class TraceEvent(object):
+
+  def __init__(self, timestamp_ns, tid, function, caller, args, result):
+    self.timestamp_ns = timestamp_ns
+    self.tid = tid
+    self.function = function
+    self.caller = caller
+    # (type, value) pairs
+    self.args = args
+    self.result = result
+
+
+class TraceNotice(object):
+  """Records lost before the following events"""
+
+  def __init__(self, name, counts):
+    self.name = name
+    self.counts = counts
+
+  def text(self):
+    if self.name == 'dropped':
+      return f'dropped {self.counts["count"]} jni trace records'
+    return ('suppressed jni trace calls, sampled: {sampled}, caller limited: {caller_limited}, '
+            'global limited: {global_limited}').format(**self.counts)
+
+
+class TraceReader(object):
+
+  def __init__(self, data: bytes):
+    if len(data) < HEADER.size:
+      raise Exception('trace file too small')
+    magic, version, header_size, start_ns, start_wall_ns = HEADER.unpack_from(data)
+    if magic != MAGIC:
+      raise Exception(f'bad magic {magic}')
+    if version != VERSION:
+      raise Exception(f'unsupported trace version {version}')
+    self.data = data
+    self.offset = header_size
+    self.start_ns = start_ns
+    self.start_wall_ns = start_wall_ns
+    self.strings = {}
+    self.functions = {}
+    self.symbols = {}
+
+  def _byte(self):
+    value = self.data[self.offset]
+    self.offset += 1
+    return value
+
+  def _varint(self):
+    result = 0
+    shift = 0
+    while True:
+      byte = self._byte()
+      result |= (byte & 0x7f) << shift
+      if byte < 0x80:
+        return result
+      shift += 7
+
+  @staticmethod
+  def _zigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+  def _value(self, value_type):
+    value = self._varint()
+    if value_type == TV_INT:
+      return self._zigzag(value)
+    return value
+
+  def __iter__(self):
+    """Yields TraceEvent or TraceNotice"""
+    timestamp = self.start_ns
+    try:
+      while self.offset < len(self.data):
+        tag = self._byte()
+        if tag == TAG_END:
+          return
+        if tag == TAG_STRING:
+          string_id = self._varint()
+          length = self._varint()
+          self.strings[string_id] = self.data[self.offset:self.offset + length].decode('utf-8', 'replace')
+          self.offset += length
+        elif tag == TAG_FUNCTION:
+          index = self._byte()
+          self.functions[index] = self.strings.get(self._varint(), f'function{index}')
+        elif tag == TAG_SYMBOL:
+          value_type = self._byte()
+          value = self._varint()
+          self.symbols[(value_type, value)] = self.strings.get(self._varint())
+        elif tag == TAG_EVENT:
+          timestamp += self._zigzag(self._varint())
+          tid = self._varint()
+          function = self._byte()
+          result_type = self._byte()
+          arg_types = self._varint()
+          caller = self._varint()
+          args = []
+          for i in range(4):
+            value_type = (arg_types >> (i * 4)) & 0xf
+            if value_type == TV_NONE:
+              break
+            args.append((value_type, self._value(value_type)))
+          result = (result_type, self._value(result_type)) if result_type != TV_NONE else None
+          yield TraceEvent(timestamp, tid, function, caller, args, result)
+        elif tag == TAG_DROPPED:
+          yield TraceNotice('dropped', {'count': self._varint()})
+        elif tag == TAG_SUPPRESSED:
+          counts = {}
+          for key in ('sampled', 'caller_limited', 'global_limited'):
+            counts[key] = self._varint()
+          yield TraceNotice('suppressed', counts)
+        else:
+          raise Exception(f'unknown tag {tag} at {self.offset - 1}')
+    except IndexError:
+      # The process died while a chunk was written
+      logging.warning(f'trace truncated at {self.offset}')
+
+  def function_name(self, event):
+    return self.functions.get(event.function, f'function{event.function}')
+
+  def caller_name(self, event):
+    return self.symbols.get((TV_POINTER, event.caller)) or hex(event.caller)
+
+  def format_value(self, value_type, value):
+    if value_type == TV_INT:
+      return str(value)
+    if value_type == TV_UNSIGNED:
+      return str(value)
+    if value_type == TV_FLOAT:
+      return '%f' % struct.unpack('<f', struct.pack('<I', value & 0xffffffff))[0]
+    if value_type == TV_DOUBLE:
+      return '%f' % struct.unpack('<d', struct.pack('<Q', value))[0]
+    if value_type == TV_METHOD_ID:
+      return self.symbols.get((value_type, value)) or f'jmethodID {hex(value)}'
+    if value_type == TV_FIELD_ID:
+      return self.symbols.get((value_type, value)) or f'jfieldID {hex(value)}'
+    return HANDLE_PREFIX.get(value_type, '') + hex(value)
+
+  def format_text(self, event):
+    args = ', '.join(self.format_value(t, v) for t, v in event.args)
+    line = f'[{event.tid}] {self.function_name(event)} {self.caller_name(event)} ({args})'
+    if event.result is not None:
+      line += ' -> ' + self.format_value(*event.result)
+    return line
+
+  def to_dict(self, event):
+    item = {
+      'timestamp_ns': event.timestamp_ns,
+      'tid': event.tid,
+      'function': self.function_name(event),
+      'caller': self.caller_name(event),
+      'args': [self.format_value(t, v) for t, v in event.args],
+    }
+    if event.result is not None:
+      item['result'] = self.format_value(*event.result)
+    return item
+
+
+class EventFilter(object):
+
+  def __init__(self, args):
+    self.tids = set(args.tid) if args.tid else None
+    self.function = re.compile(args.function) if args.function else None
+    self.caller = re.compile(args.caller) if args.caller else None
+    self.begin_ns = int(args.begin * 1e9) if args.begin is not None else None
+    self.end_ns = int(args.end * 1e9) if args.end is not None else None
+
+  def accept(self, reader: TraceReader, event: TraceEvent):
+    if self.tids is not None and event.tid not in self.tids:
+      return False
+    elapsed = event.timestamp_ns - reader.start_ns
+    if self.begin_ns is not None and elapsed < self.begin_ns:
+      return False
+    if self.end_ns is not None and elapsed > self.end_ns:
+      return False
+    if self.function and not self.function.search(reader.function_name(event)):
+      return False
+    if self.caller and not self.caller.search(reader.caller_name(event)):
+      return False
+    return True
+
+
+def write_text(reader, event_filter, out, show_time):
+  for item in reader:
+    if isinstance(item, TraceNotice):
+      out.write(item.text() + '\n')
+    elif event_filter.accept(reader, item):
+      if show_time:
+        out.write('%12.6f ' % ((item.timestamp_ns - reader.start_ns) / 1e9))
+      out.write(reader.format_text(item))
+      out.write('\n')
+
+
+def write_json(reader, event_filter, out):
+  out.write('[\n')
+  first = True
+  for item in reader:
+    if isinstance(item, TraceNotice):
+      value = {item.name: item.counts}
+    elif event_filter.accept(reader, item):
+      value = reader.to_dict(item)
+    else:
+      continue
+    if not first:
+      out.write(',\n')
+    first = False
+    out.write(json.dumps(value))
+  out.write('\n]\n')
+
+
+def write_chrome(reader, event_filter, out):
+  out.write('{"displayTimeUnit": "ns", "traceEvents": [\n')
+  first = True
+  last_ts = 0
+  for item in reader:
+    if isinstance(item, TraceNotice):
+      value = {'name': item.name, 'ph': 'i', 's': 'g', 'ts': last_ts, 'pid': 0, 'tid': 0, 'args': item.counts}
+    elif event_filter.accept(reader, item):
+      last_ts = (item.timestamp_ns - reader.start_ns) / 1000
+      value = reader.to_dict(item)
+      value.pop('timestamp_ns')
+      value = {
+        'name': value.pop('function'),
+        'ph': 'i',
+        's': 't',
+        'ts': last_ts,
+        'pid': 0,
+        'tid': value.pop('tid'),
+        'args': value,
+      }
+    else:
+      continue
+    if not first:
+      out.write(',\n')
+    first = False
+    out.write(json.dumps(value))
+  out.write('\n]}\n')
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Decode binary JNI trace files')
+  parser.add_argument('trace', type=Path, help='file written by StartFileTrace')
+  parser.add_argument('-f', '--format', choices=['text', 'json', 'chrome'], default='text')
+  parser.add_argument('-o', '--output', type=Path, help='output file, default stdout')
+  parser.add_argument('--tid', type=int, action='append', help='only these threads, can be repeated')
+  parser.add_argument('--function', help='regex of JNI function names to keep')
+  parser.add_argument('--caller', help='regex of caller symbols to keep')
+  parser.add_argument('--begin', type=float, help='seconds after the trace started')
+  parser.add_argument('--end', type=float, help='seconds after the trace started')
+  parser.add_argument('--time', action='store_true', help='prefix text lines with the elapsed seconds')
+  args = parser.parse_args()
+
+  reader = TraceReader(args.trace.read_bytes())
+  event_filter = EventFilter(args)
+  out = args.output.open('w', encoding='utf-8') if args.output else sys.stdout
+  try:
+    if args.format == 'json':
+      write_json(reader, event_filter, out)
+    elif args.format == 'chrome':
+      write_chrome(reader, event_filter, out)
+    else:
+      write_text(reader, event_filter, out, args.time)
+  finally:
+    if args.output:
+      out.close()
+
+
+if __name__ == '__main__':
+  main()
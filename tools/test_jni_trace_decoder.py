@@ -0,0 +1,78 @@
+# -*- coding: utf-8 -*-
+"""Tests of jni_trace_decoder.py, run with: python3 -m unittest discover -s tools
+
+testdata/jni_trace.bin was written by TraceFileWriter: a CallVoidMethod and a GetStaticIntField event
+of two threads with their caller, method and field descriptions, a dropped and a suppressed notice.
+"""
+import json
+import subprocess
+import sys
+import unittest
+from pathlib import Path
+
+TOOLS = Path(__file__).resolve().parent
+sys.path.insert(0, str(TOOLS))
+
+import jni_trace_decoder  # noqa: E402
+
+DECODER = TOOLS / 'jni_trace_decoder.py'
+TRACE = TOOLS / 'testdata' / 'jni_trace.bin'
+
+
+def decode(*args):
+  return subprocess.run([sys.executable, str(DECODER), str(TRACE), *args], check=True, capture_output=True,
+                        text=True).stdout
+
+
+class DecoderTest(unittest.TestCase):
+
+  def test_text(self):
+    self.assertEqual(decode().splitlines(), [
+      '[1234] CallVoidMethod 0x7f001000 [libtest.so!0x1000] (jobject 0x2006, void java.lang.Object.notify())',
+      'dropped 3 jni trace records',
+      '[1235] GetStaticIntField 0x7f002000 (jclass 0x3001, int android.os.Build$VERSION.SDK_INT) -> -5',
+      'suppressed jni trace calls, sampled: 7, caller limited: 2, global limited: 1',
+    ])
+
+  def test_filter(self):
+    # Notices are never filtered
+    lines = decode('--function', 'Static', '--time').splitlines()
+    self.assertEqual(len(lines), 3)
+    self.assertEqual(lines[0], 'dropped 3 jni trace records')
+    self.assertRegex(lines[1], r'^ +0\.\d{6} \[1235\] GetStaticIntField ')
+    lines = decode('--tid', '1234').splitlines()
+    self.assertEqual(len(lines), 3)
+    self.assertIn('CallVoidMethod', lines[0])
+
+  def test_json(self):
+    items = json.loads(decode('-f', 'json'))
+    self.assertEqual(len(items), 4)
+    self.assertEqual(items[0]['function'], 'CallVoidMethod')
+    self.assertEqual(items[0]['args'], ['jobject 0x2006', 'void java.lang.Object.notify()'])
+    self.assertEqual(items[1], {'dropped': {'count': 3}})
+    self.assertEqual(items[2]['result'], '-5')
+    # Rings of different threads are drained one after another, the second event happened earlier
+    self.assertEqual(items[0]['timestamp_ns'] - items[2]['timestamp_ns'], 500)
+
+  def test_chrome(self):
+    trace = json.loads(decode('-f', 'chrome'))
+    names = [event['name'] for event in trace['traceEvents']]
+    self.assertEqual(names, ['CallVoidMethod', 'dropped', 'GetStaticIntField', 'suppressed'])
+
+  def test_truncated(self):
+    data = TRACE.read_bytes()
+    # Cut inside the last event, everything before it is still decoded
+    reader = jni_trace_decoder.TraceReader(data[:data.rindex(b'GetStaticIntField') + 22])
+    with self.assertLogs(level='WARNING'):
+      items = list(reader)
+    self.assertEqual(len(items), 2)
+    self.assertEqual(reader.format_text(items[0]).split(' (')[0],
+                     '[1234] CallVoidMethod 0x7f001000 [libtest.so!0x1000]')
+
+  def test_bad_header(self):
+    with self.assertRaises(Exception):
+      jni_trace_decoder.TraceReader(b'XXXX' + TRACE.read_bytes()[4:])
+
+
+if __name__ == '__main__':
+  unittest.main()